@@ -0,0 +1,154 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "admission.h"
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+using namespace ambe;
+
+
+static double parseNumber(const string& key, const string& value) {
+	size_t end;
+	double rv;
+	try {
+		rv = stod(value, &end);
+	} catch(const logic_error& e) {
+		throw runtime_error("Invalid value of " + key + ": " + value);
+	}
+	if (end != value.size() || rv < 0)
+		throw runtime_error("Invalid value of " + key + ": " + value);
+	return rv;
+}
+
+
+QuotaConfig QuotaConfig::parse(const string& spec) {
+	QuotaConfig rv;
+
+	size_t start = 0;
+	while (start <= spec.size()) {
+		auto end = spec.find(',', start);
+		if (end == string::npos) end = spec.size();
+		auto item = spec.substr(start, end - start);
+		start = end + 1;
+
+		auto eq = item.find('=');
+		if (eq == string::npos)
+			throw runtime_error("Invalid quota option " + item);
+
+		auto key = item.substr(0, eq);
+		auto value = item.substr(eq + 1);
+
+		if      (key == "client") rv.client = value;
+		else if (key == "rate")   rv.rate = parseNumber(key, value);
+		else if (key == "burst")  rv.burst = parseNumber(key, value);
+		else throw runtime_error("Unknown quota option " + key);
+	}
+
+	if (rv.client.empty())
+		throw runtime_error("The client must not be empty");
+
+	if (rv.rate && !rv.burst) rv.burst = max(rv.rate, 1.0);
+	return rv;
+}
+
+
+Quota::Quota(const QuotaConfig& config) :
+	rate(config.rate), burst(config.burst), tokens(config.burst),
+	last(chrono::steady_clock::now()) {
+}
+
+
+bool Quota::admit(chrono::steady_clock::time_point now) {
+	if (!rate) return true;
+
+	lock_guard<std::mutex> lock(mutex);
+	if (now > last) {
+		tokens = min(burst, tokens + rate * chrono::duration<double>(now - last).count());
+		last = now;
+	}
+
+	if (tokens < 1) return false;
+	tokens -= 1;
+	return true;
+}
+
+
+Admission::Admission(unsigned int max_pending) : max_pending(max_pending) {
+}
+
+
+void Admission::configure(const QuotaConfig& config) {
+	lock_guard<std::mutex> lock(mutex);
+	configs[config.client] = config;
+}
+
+
+shared_ptr<Quota> Admission::join(const string& client) {
+	lock_guard<std::mutex> lock(mutex);
+
+	auto& entry = quotas[client];
+	auto rv = entry.lock();
+	if (rv) return rv;
+
+	auto c = configs.find(client);
+	if (c == configs.end()) c = configs.find("*");
+	rv = make_shared<Quota>(c == configs.end() ? QuotaConfig() : c->second);
+	entry = rv;
+
+	// Forget clients that have closed all their sessions
+	for (auto it = quotas.begin(); it != quotas.end(); ) {
+		if (it->second.expired()) it = quotas.erase(it);
+		else ++it;
+	}
+	return rv;
+}
+
+
+void Admission::trust(const string& identity) {
+	lock_guard<std::mutex> lock(mutex);
+	peers.insert(identity);
+}
+
+
+bool Admission::trusted(const string& identity) {
+	lock_guard<std::mutex> lock(mutex);
+	return peers.count(identity) > 0;
+}
+
+
+string Admission::identity(const string& peer) {
+	auto colon = peer.find(':');
+	if (colon == string::npos) return peer;
+
+	// Strip the port from IP addresses so that all connections from a host
+	// share its quota
+	auto scheme = peer.substr(0, colon);
+	if (scheme != "ipv4" && scheme != "ipv6") return peer;
+
+	auto host = peer.substr(colon + 1);
+	auto port = host.rfind(':');
+	if (port != string::npos) host.erase(port);
+
+	// IPv6 addresses are reported as %5B...%5D
+	if (scheme == "ipv6" && host.size() > 6 && host.compare(0, 3, "%5B") == 0)
+		host = host.substr(3, host.size() - 6);
+	return host;
+}
@@ -0,0 +1,118 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+namespace ambe {
+
+	/**
+	 * Limits applied to the sessions of a client
+	 *
+	 * The limits are given as a comma-separated list of key=value pairs,
+	 * e.g.,
+	 *
+	 *   client=10.0.0.1,rate=100,burst=200
+	 *
+	 * Clients are identified by their address or, if they connect through
+	 * a trusted peer such as ambe-router, by the "client" metadata
+	 * attribute of their calls. The client * matches all clients without
+	 * limits of their own.
+	 */
+	struct QuotaConfig {
+		string client = "*";
+
+		// Requests per second admitted for all sessions of the client
+		// together and the number of requests that can be admitted at once
+		// (defaults to one second's worth). Zero means no limit.
+		double rate = 0;
+		double burst = 0;
+
+		// Throws runtime_error if the specification is invalid
+		static QuotaConfig parse(const string& spec);
+	};
+
+
+	/**
+	 * The admission state shared by all sessions of one client
+	 *
+	 * A token bucket refilled at the configured rate. Each request admitted
+	 * takes one token. Thread-safe.
+	 */
+	class Quota {
+	public:
+		Quota(const QuotaConfig& config);
+
+		// Take a token. Returns false if the client has exceeded its rate.
+		bool admit(chrono::steady_clock::time_point now);
+
+	private:
+		std::mutex mutex;
+		double rate;
+		double burst;
+		double tokens;
+		chrono::steady_clock::time_point last;
+	};
+
+
+	/**
+	 * Admission control for client sessions
+	 *
+	 * Keeps the configured limits and the quota of every client that has a
+	 * session open. The quota of a client is created with its first session
+	 * and dropped with its last one. Thread-safe.
+	 */
+	class Admission {
+	public:
+		// A session may have at most max_pending requests queued or in
+		// flight at any time, zero means no limit
+		Admission(unsigned int max_pending=0);
+
+		void configure(const QuotaConfig& config);
+
+		// Return the quota of the client with the given identity
+		shared_ptr<Quota> join(const string& client);
+
+		// Accept the "client" attribute from the peer with the given
+		// identity. Other peers cannot name themselves, since they could
+		// otherwise escape their quota by picking a new name for each call.
+		void trust(const string& identity);
+		bool trusted(const string& identity);
+
+		// The identity of a client derived from the peer address reported by
+		// gRPC, e.g., ipv4:10.0.0.1:40000
+		static string identity(const string& peer);
+
+		unsigned int max_pending;
+
+	private:
+		std::mutex mutex;
+		unordered_map<string, QuotaConfig> configs;
+		unordered_map<string, weak_ptr<Quota>> quotas;
+		unordered_set<string> peers;
+	};
+}
@@ -30,9 +30,12 @@
 #include <byteswap.h>
 #include <future>
 #include <list>
+#include <atomic>
+#include <new>
 
 #include "uri.h"
 #include "rpc.h"
+#include "shm.h"
 #include "api.h"
 
 using namespace std;
@@ -40,6 +43,26 @@ using namespace std::chrono;
 using namespace ambe;
 
 
+// Heap allocations made by the process, including the library. The global
+// operator new is replaced below so that the benchmark can report the number
+// of allocations per frame.
+static atomic<uint64_t> allocations{0};
+
+void* operator new(size_t size) {
+	allocations.fetch_add(1, memory_order_relaxed);
+	if (void* ptr = malloc(size ? size : 1)) return ptr;
+	throw bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+	free(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept {
+	free(ptr);
+}
+
+
 static void printHelp() {
 	cout <<
 	"Usage: ambec [options]\n"
@@ -47,23 +70,29 @@ static void printHelp() {
 	"  -c <number>           Number of channels to use simultaneously (all available by default)\n"
 	"  -t                    Run in concurrent mode (default is synchronous mode)\n"
 	"  -p <max_requests>     Request pipeline size (default is 2)\n"
-	"  -i <filename>         Input data .wav file\n"
+	"  -i <filename>         Input data .wav file (8, 16, 32, 44.1, or 48 kHz, mono or stereo)\n"
 	"  -o <filename>         Optional filename to write output to\n"
-	"  -u <URI>              AMBE device URI\n"
+	"  -u <URI>              AMBE device URI (usb:, grpc:, unix:, or shm:). If given\n"
+	"                        multiple times, the benchmark is run for each URI in turn\n"
 	"  -x [<index>|<rcw[6]>] AMBE_RATET index or 6 comma-delimited AMBE_RATEP values\n"
+	"  -g <law>              Compand speech samples on the serial port (none, ulaw, alaw)\n"
+	"  -a                    Skip silent frames with voice activity detection\n"
 	"  -h                    This help text\n" << endl;
 
 	exit(EXIT_FAILURE);
 }
 
 
-// Load audio samples from the given .wav file. The file must be in the correct
-// format (8000 Hz, 1 channel, S16LE samples). The returned samples are in *big
-// endian format*.
+// Load audio samples from the given .wav file. The file must contain S16LE
+// samples. Files with other sampling rates than 8000 Hz (16, 32, 44.1, or 48
+// kHz) are resampled and stereo files are downmixed to mono. The returned
+// samples are in *big endian format*.
 static Audio load(const string& filename) {
-	size_t n = 0;
+	sf_count_t n = 0;
 	Audio rv;
 	const int mask = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+	unique_ptr<Resampler> resampler;
+	vector<int16_t> buffer;
 
 	SF_INFO info;
 	auto handle = sf_open(filename.c_str(), SFM_READ, &info);
@@ -72,14 +101,14 @@ static Audio load(const string& filename) {
 		goto error;
 	}
 
-	if (info.samplerate != SAMPLE_RATE) {
-		cerr << "Error: Invalid sample rate, expected " << SAMPLE_RATE
-		     << ", got " << info.samplerate << endl;
+	if (!Resampler::supported(info.samplerate)) {
+		cerr << "Error: Unsupported sample rate " << info.samplerate
+		     << ", expected 8000, 16000, 32000, 44100, or 48000" << endl;
 		goto error;
 	}
 
-	if (info.channels != 1) {
-		cerr << "Error: Invalid number of channels, expected 1, got " << info.channels << endl;
+	if (info.channels < 1 || info.channels > 2) {
+		cerr << "Error: Invalid number of channels, expected 1 or 2, got " << info.channels << endl;
 		goto error;
 	}
 
@@ -88,18 +117,34 @@ static Audio load(const string& filename) {
 		goto error;
 	}
 
+	// Read the file in 20 ms chunks and let the resampler re-chunk the
+	// converted audio into frames
+	resampler = make_unique<Resampler>(info.samplerate, SAMPLE_RATE, info.channels);
+	buffer.resize(info.samplerate / 1000 * FRAME_DURATION * info.channels);
+
 	while(true) {
-		AudioFrame f;
-		f.fill(0);
-		n = sf_read_short(handle, f.data(), f.size());
+		auto frames = buffer.size() / info.channels;
+		n = sf_readf_short(handle, buffer.data(), frames);
 		if (n < 0) {
 			cerr << "Error while reading from file: " << sf_strerror(handle) << endl;
 			goto error;
 		}
 
-		swap(f.data(), f.data(), f.size());
+		resampler->push(buffer.data(), n);
+		while(resampler->available() >= FRAME_SIZE) {
+			AudioFrame f;
+			resampler->read(f.data(), f.size(), true);
+			rv.push_back(move(f));
+		}
+		if ((size_t)n < frames) break;
+	}
+
+	// Pad the last incomplete frame with silence
+	if (resampler->available()) {
+		AudioFrame f;
+		f.fill(0);
+		resampler->read(f.data(), f.size(), true);
 		rv.push_back(move(f));
-		if (n < f.size()) break;
 	}
 
 	sf_close(handle);
@@ -150,15 +195,17 @@ error:
 
 void ArgData::ProcessArgs(int argc, char* argv[]) {
 	int opt = 0;
-	while ((opt = getopt(argc, argv, "c:tp:i:o:u:x:h")) != -1) {
+	while ((opt = getopt(argc, argv, "c:tp:i:o:u:x:g:ah")) != -1) {
 		switch (opt) {
 		case 'c': channels = stoi(optarg); break;
 		case 't': mode = ClientMode::CONCURRENT; break;
 		case 'p': pipeline_size = stoi(optarg); break;
 		case 'i': in_file = string(optarg); break;
 		case 'o': out_file = string(optarg); break;
-		case 'u': uri = string(optarg); break;
+		case 'u': uris.push_back(optarg); break;
 		case 'x': rate = Rate(optarg); break;
+		case 'g': compand = parseCompand(optarg); break;
+		case 'a': vad = true; break;
 		case 'h': printHelp(); break;
 		default: printHelp(); break;
 		}
@@ -173,6 +220,11 @@ void ArgData::ProcessArgs(int argc, char* argv[]) {
 		cout << "Invalid pipeline size (must be >=1)" << endl;
 		exit(EXIT_FAILURE);
 	}
+
+	if (uris.empty()) {
+		cout << "Please provide a device URI (see -h)" << endl;
+		exit(EXIT_FAILURE);
+	}
 }
 
 
@@ -199,6 +251,7 @@ Client::Client(const ArgData& args, Device& device, API& api) :
 	for (int i = 0; i < device.channels(); i++) {
 		ambe.rate(i, args.rate);
 		ambe.init(i);
+		if (args.vad) ambe.vad(i, true);
 	}
 	cout << "done." << endl;
 
@@ -229,10 +282,9 @@ duration<double> Client::CompressDecompress(Audio* output, int channel, const Au
 
 		if (output) {
 			AudioFrame f;
-			auto ptr = packet.samples(count);
+			count = ambe.samples(f.data(), f.size(), packet);
 			if (count != f.size())
 				throw runtime_error("Insufficient number of samples");
-			copy_n(ptr, count, begin(f));
 
 			output->push_back(move(f));
 		}
@@ -303,10 +355,9 @@ duration<double> Client::Decompress(Audio* output, int channel, const AmbeBits&
 			if (output) {
 				AudioFrame f;
 
-				auto ptr = response.samples(count);
+				count = ambe.samples(f.data(), f.size(), response);
 				if (count != f.size())
 					throw ClientException("Invalid number of samples");
-				copy_n(ptr, count, begin(f));
 				output->push_back(move(f));
 			}
 		}
@@ -337,6 +388,7 @@ duration<double> Client::Decompress(Audio* output, int channel, const AmbeBits&
  void Client::SynchronousMode() {
 	vector<future<duration<double>>> results;
 	cout << "Running..." << flush;
+	auto allocs = allocations.load();
 
 	for(uint i = 0; i < channels; i++) {
 		auto rv = async(launch::async, &Client::CompressDecompress, this, save_output ? &output[i] : nullptr, i, cref(input));
@@ -350,6 +402,37 @@ duration<double> Client::Decompress(Audio* output, int channel, const AmbeBits&
 	cout << "Time: ";
 	for(auto& time : times) cout << time.count() << "s ";
 	cout << endl;
+
+	// Each frame is compressed and then decompressed
+	PrintThroughput(times, 2 * input.size());
+	PrintLatency(times, 2 * input.size());
+	PrintAllocations(allocations.load() - allocs, 2 * input.size() * channels);
+}
+
+
+void Client::PrintThroughput(const vector<duration<double>>& times, size_t frames) const {
+	double fps = 0;
+	for(auto& time : times)
+		if (time.count() > 0) fps += frames / time.count();
+
+	cout << "Throughput: " << fps << " frames/s (companding: " << toString(device.compand) << ")" << endl;
+}
+
+
+void Client::PrintLatency(const vector<duration<double>>& times, size_t frames) const {
+	if (!frames || times.empty()) return;
+
+	duration<double> total(0);
+	for(auto& time : times) total += time;
+
+	auto us = duration_cast<duration<double, micro>>(total).count() / (frames * times.size());
+	cout << "Latency: " << us << " us per request" << endl;
+}
+
+
+void Client::PrintAllocations(uint64_t count, size_t frames) const {
+	if (!frames) return;
+	cout << "Allocations: " << (double)count / frames << " per frame" << endl;
 }
 
 
@@ -374,6 +457,7 @@ void Client::ConcurrentMode() {
 	auto noop = [](auto data, auto count) {};
 
 	cout << "Running..." << flush;
+	auto allocs = allocations.load();
 
 	for(uint i = 0; i < channels; i++) {
 		auto enc = async(launch::async, &Client::Compress<decltype(noop)>, this, noop, i, cref(input), pipeline_size);
@@ -390,6 +474,25 @@ void Client::ConcurrentMode() {
 	for(uint i = 0; i < times.size(); i += 2)
 		cout << to_string(i / 2) << ":[" << times[i].count() << " s, " << times[i + 1].count() << " s] ";
 	cout << endl;
+
+	PrintThroughput(times, input.size());
+	PrintAllocations(allocations.load() - allocs, 2 * input.size() * channels);
+}
+
+
+void Client::PrintVadStats() {
+	if (!args.vad) return;
+
+	VadStats total;
+	for (int i = 0; i < device.channels(); i++) {
+		auto stats = ambe.vadStats(i);
+		total.frames += stats.frames;
+		total.skipped += stats.skipped;
+	}
+
+	cout << "Voice activity detection: " << total.skipped << " of " << total.frames << " frames skipped";
+	if (total.frames) cout << " (" << 100.0 * total.skipped / total.frames << "% of chip work avoided)";
+	cout << endl;
 }
 
 
@@ -425,8 +528,12 @@ void Client::RunUSBMode(const ArgData& args, const string& authority) {
 	api.paritymode(false);
 	cout << "done." << endl;
 
-	cout << "Disabling companding..." << flush;
-	api.compand(false, false);
+	if (args.compand == Compand::NONE) {
+		cout << "Disabling companding..." << flush;
+	} else {
+		cout << "Enabling " << toString(args.compand) << " companding..." << flush;
+	}
+	api.compand(args.compand);
 	cout << "done." << endl;
 
 	Client client(args, device, api);
@@ -437,6 +544,7 @@ void Client::RunUSBMode(const ArgData& args, const string& authority) {
 		default: throw logic_error("Unsupported client mode"); break;
 	}
 
+	client.PrintVadStats();
 	client.SaveOutput();
 
 	scheduler.stop();
@@ -449,6 +557,19 @@ void Client::RunGRPCMode(const ArgData& args, const string& authority) {
 
 	auto channel = grpc::CreateChannel(authority, grpc::InsecureChannelCredentials());
 	RpcDevice device(channel);
+	RunRemote(args, device);
+}
+
+
+void Client::RunShmMode(const ArgData& args, const string& path) {
+	cout << "Connecting to " << path << " via shared memory" << endl;
+
+	ShmDevice device(path);
+	RunRemote(args, device);
+}
+
+
+void Client::RunRemote(const ArgData& args, TaggingDevice& device) {
 	FifoScheduler scheduler(device);
 	API api(device, scheduler);
 
@@ -463,6 +584,7 @@ void Client::RunGRPCMode(const ArgData& args, const string& authority) {
 		default: throw logic_error("Unsupported client mode"); break;
 	}
 
+	client.PrintVadStats();
 	client.SaveOutput();
 
 	scheduler.stop();
@@ -487,7 +609,8 @@ void Client::RunGRPCMode(const ArgData& args, const string& authority) {
 // -t: Enable compression and decompression threading (optional).
 // -i <input_file>: A file to read from. It must be audio file.
 // -o <output_file>: A file to write decompressed data.
-// -u <URI>: Ambe device URI. For example, usb:/dev/ttyUSB0.
+// -u <URI>: Ambe device URI. For example, usb:/dev/ttyUSB0. Can be given
+//     multiple times.
 // -x <AMBE rate index>: An AMBE rate index.
 // -c <number>: A number of channels to be run. By default it is set to 3.
 // -h: Show help.
@@ -495,12 +618,17 @@ int main(int argc, char* argv[]) {
 
 	ArgData args(argc, argv);
 
-	auto uri = URI::parse(args.uri);
+	// Running the benchmark for several URIs in turn allows comparing
+	// transports, e.g., TCP and Unix domain sockets to the same server
+	for (auto& u : args.uris) {
+		auto uri = URI::parse(u);
 
-	if (uri.type == UriType::USB)
-		Client::RunUSBMode(args, uri.authority);
-	else
-		Client::RunGRPCMode(args, uri.authority);
+		switch(uri.type) {
+			case UriType::USB: Client::RunUSBMode(args, uri.authority);  break;
+			case UriType::SHM: Client::RunShmMode(args, uri.authority);  break;
+			default:           Client::RunGRPCMode(args, uri.authority); break;
+		}
+	}
 
     return 0;
 }
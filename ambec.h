@@ -44,11 +44,13 @@ namespace ambe {
 		ClientMode mode = ClientMode::SYNCHRONOUS;
 		string in_file;
 		string out_file;
-		string uri;
+		vector<string> uris;
 		Rate rate;
 		int channels = 0;
 		DeviceMode device_mode = DeviceMode::USB;
 		int pipeline_size = 2;
+		Compand compand = Compand::NONE;
+		bool vad = false;
 
 	public:
 		ArgData(int argc, char* argv[]) : rate(33) {
@@ -119,15 +121,30 @@ namespace ambe {
 		// is s16be.
 		duration<double> Decompress(Audio* output, int channel, const AmbeBits& input, uint pipeline_size);
 
+		void PrintThroughput(const vector<duration<double>>& times, size_t frames) const;
+
+		// Print the average time of a request, i.e., the round-trip latency
+		// to the device in synchronous mode
+		void PrintLatency(const vector<duration<double>>& times, size_t frames) const;
+
+		// Print the number of heap allocations per compressed or
+		// decompressed frame, measured across the whole process
+		void PrintAllocations(uint64_t count, size_t frames) const;
+		void PrintVadStats();
 		void SaveOutput();
 		AmbeBits PreCompress();
 
-		// Static method for running client in two different modes: USB and GRPC
+		// Static methods for running client in different modes: USB, GRPC,
+		// and shared memory
 		static void RunUSBMode(const ArgData& args, const string& authority);
 		static void RunGRPCMode(const ArgData& args, const string& authority);
+		static void RunShmMode(const ArgData& args, const string& path);
 
 		void SynchronousMode();
 		void ConcurrentMode();
+
+	private:
+		static void RunRemote(const ArgData& args, TaggingDevice& device);
 	};
 
 
@@ -19,19 +19,37 @@
 
 #include <iostream>
 #include <exception>
+#include <system_error>
 #include <memory>
 #include <string>
 #include <chrono>
+#include <thread>
+#include <queue>
+#include <optional>
+#include <condition_variable>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
+#include <cstring>
 #include <getopt.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <grpc++/grpc++.h>
 #include "ambe.grpc.pb.h"
 #include "queue.h"
 #include "api.h"
 #include "device.h"
 #include "serial.h"
+#include "wire.h"
+#include "shm.h"
+#include "uri.h"
+#include "rtp.h"
+#include "jitter.h"
+#include "admission.h"
 
 using namespace std;
 using namespace ambe;
@@ -39,16 +57,61 @@ using namespace ambe;
 using grpc::Server;
 using grpc::ServerBuilder;
 using grpc::ServerContext;
+using grpc::ServerCompletionQueue;
+using grpc::ServerAsyncReaderWriter;
+using grpc::ServerAsyncResponseWriter;
 using grpc::Status;
 using grpc::StatusCode;
-using grpc::ServerReaderWriter;
 
 
 static unsigned short port = 50051;
 static string pathname;
+static string shm_path;
+static vector<string> listeners;
+static vector<RtpConfig> gateway_sessions;
+static Compand compand = Compand::NONE;
+static unsigned int threads = 2;
+static Admission admission(256);
 
 
-class AmbeServiceImpl final : public rpc::AmbeService::Service {
+// The packet streams exchange raw buffers so that packets can be parsed and
+// serialized without intermediate copies (see wire.h). Ping and capacity use
+// generated messages.
+typedef rpc::AmbeService::WithRawMethod_bind<
+	rpc::AmbeService::WithAsyncMethod_ping<
+	rpc::AmbeService::WithRawMethod_transcode<
+	rpc::AmbeService::WithRawMethod_frames<
+	rpc::AmbeService::WithAsyncMethod_capacity<rpc::AmbeService::Service>>>>> AsyncService;
+
+
+class Session;
+
+
+/**
+ * Paces the jitter buffers of all sessions that use one
+ *
+ * A single thread ticks once per frame period on absolute deadlines, so that
+ * the period does not drift, and lets each session submit the next frame
+ * from its buffer. The thread is started with the first session.
+ */
+class PlayoutClock {
+public:
+	~PlayoutClock();
+
+	void add(const shared_ptr<Session>& session);
+
+private:
+	void run();
+
+	std::mutex mutex;
+	condition_variable cond;
+	vector<weak_ptr<Session>> sessions;
+	bool quit = false;
+	thread worker;
+};
+
+
+class AmbeServiceImpl final {
 public:
 	explicit AmbeServiceImpl(const string& pathname) :
 		device(pathname), scheduler(device, 3), api(device, scheduler), dev_manager(pathname, device, scheduler) {
@@ -58,7 +121,20 @@ public:
 		initChip();
 	}
 
+	// Serve all calls from the given completion queue. Each completion
+	// queue is served by one thread.
+	void serve(ServerCompletionQueue* cq);
+
+	DeviceManager& devices() {
+		return dev_manager;
+	}
+
+	AsyncService service;
+
 private:
+	friend class Session;
+	friend class ShmSession;
+
 	void initChip() {
 		cout << "Resetting AMBE chip " << id << "..." << flush;
 		api.reset(true);
@@ -72,71 +148,1264 @@ private:
 		api.paritymode(false);
 		std::cout << "done." << std::endl;
 
-		cout << "Disabling companding in AMBE chip " << id << "..." << flush;
-		api.compand(false, false);
+		if (compand == Compand::NONE) {
+			cout << "Disabling companding in AMBE chip " << id << "..." << flush;
+		} else {
+			cout << "Enabling " << toString(compand) << " companding in AMBE chip " << id << "..." << flush;
+		}
+		api.compand(compand);
 		cout << "done." << endl;
 	}
 
+	string id;
+	Usb3003 device;
+	MultiQueueScheduler scheduler;
+	API api;
+
+	DeviceManager dev_manager;
+	PlayoutClock playout;
+};
+
+
+/**
+ * An asynchronous RPC call
+ *
+ * Calls are driven by events from a completion queue. The tag of each event
+ * points to an Event structure that identifies the call and the operation
+ * that has completed. Each call object accepts exactly one call; once it has
+ * been accepted, a new object is created to wait for the next one.
+ */
+class Call {
+public:
+	enum Op { CONNECT, METADATA, READ, WRITE, FINISH, DONE, OPS };
+
+	struct Event {
+		Call* call;
+		Op op;
+	};
+
+	Call(AmbeServiceImpl& server, ServerCompletionQueue* cq) : server(server), cq(cq) {
+		for (int i = 0; i < OPS; i++)
+			events[i] = {this, (Op)i};
+	}
+
+	virtual ~Call() {}
+	virtual void proceed(Op op, bool ok) = 0;
+
+protected:
+	AmbeServiceImpl& server;
+	ServerCompletionQueue* cq;
+	ServerContext context;
+	Event events[OPS];
+};
+
+
+// Check that a client's packet affects only the channels of its session.
+// Every channel field counts, not only the first one, since a CONTROL packet
+// may switch channels between its fields. Fields that configure or feed a
+// channel must follow a channel field. Fields that act on the whole chip,
+// e.g., RESET, HALT, PARITYMODE, or COMPAND, would disturb all other
+// sessions and are refused; of the fields that are not addressed to a
+// channel, only queries are accepted. Packets that cannot be parsed are
+// refused.
+static bool owns(const Packet& packet, const vector<size_t>& channels, Compand compand) {
+	try {
+		bool addressed = false;
+		for (auto offset : packet.fields(compand != Compand::NONE)) {
+			auto type = packet.payload<Field>(offset)->type;
+			switch(type) {
+			case CHANNEL0:
+			case CHANNEL1:
+			case CHANNEL2:
+				if (find(channels.begin(), channels.end(), type - CHANNEL0) == channels.end())
+					return false;
+				addressed = true;
+				break;
+
+			case SPCHD:
+			case CHAND:
+			case CMODE:
+			case ECMODE:
+			case DCMODE:
+			case RATET:
+			case RATEP:
+			case INIT:
+				if (!addressed) return false;
+				break;
+
+			case PRODID:
+			case VERSTRING:
+			case GETCFG:
+			case READCFG:
+			case PARITY:
+				break;
+
+			default:
+				return false;
+			}
+		}
+	} catch(const runtime_error& e) {
+		return false;
+	}
+	return true;
+}
+
+
+/**
+ * Builds request packets for one channel from the frames sent by clients
+ *
+ * Packets for frames of the same size differ only in their payload. The
+ * header and fields are built once per frame size and copied for each
+ * request; only the payload and the parity are filled in. The build method
+ * is only invoked from the thread that reads the session's stream.
+ */
+class FrameBuilder {
+public:
+	FrameBuilder(uint8_t channel, Compand compand, bool parity) :
+		channel(channel), compand(compand), parity(parity) {}
+
+	// Build the request packet for a frame message. Throws runtime_error if
+	// the message is invalid.
+	Packet build(const rpc::Packet& msg) {
+		if (msg.samples().length()) return speech(msg.samples());
+		if (msg.bits().length()) return chand(msg.bits(), msg.bit_count());
+		return control(msg.data());
+	}
+
+	// Convert the response to a request into a frame message. SPEECH
+	// responses are returned as 16-bit linear samples even if the chip uses
+	// companding.
+	WireMessage store(int32_t tag, const Packet& response, uint32_t seq=0, bool concealed=false) const {
+		size_t n;
+
+		switch(response.type()) {
+		case SPEECH:
+			if (compand == Compand::NONE) {
+				auto samples = response.samples(n);
+				return WireMessage(tag, WireMessage::SAMPLES, samples, n * sizeof(int16_t), 0, seq, concealed);
+			} else {
+				auto samples = response.companded(n);
+				WireMessage msg(tag, WireMessage::SAMPLES, n * sizeof(int16_t), 0, seq, concealed);
+				g711::decode((int16_t*)msg.payload(), samples, n, compand, true);
+				return msg;
+			}
+
+		case CHANNEL: {
+			auto bits = response.bits(n);
+			return WireMessage(tag, WireMessage::BITS, bits, AmbeFrame::byteLength(n), n, seq, concealed);
+		}
+
+		default: {
+			Packet copy(response);
+			auto& data = copy.finalize(false);
+			return WireMessage(tag, WireMessage::DATA, data.data(), data.length(), 0, seq, concealed);
+		}
+		}
+	}
+
+private:
+	Packet speech(const string& samples) {
+		size_t n = samples.length() / sizeof(int16_t);
+		if (samples.length() % sizeof(int16_t) || n > UINT8_MAX)
+			throw runtime_error("Invalid number of samples");
+
+		auto it = speech_templates.find(n);
+		if (it == speech_templates.end()) {
+			Packet tmpl(SPEECH);
+			tmpl.append<ChannelField>(channel);
+			if (compand == Compand::NONE) {
+				tmpl.append<SpchdField>(n);
+				tmpl.appendArray<int16_t>(n);
+			} else {
+				tmpl.append<CompandedSpchdField>(n);
+				tmpl.appendArray<uint8_t>(n);
+			}
+			tmpl.finalize(parity);
+			it = speech_templates.emplace(n, move(tmpl)).first;
+		}
+
+		Packet packet(it->second);
+		auto field = packet.payload<Field>(sizeof(ChannelField));
+		auto dst = (uint8_t*)field + sizeof(SpchdField);
+		if (compand == Compand::NONE) memcpy(dst, samples.data(), samples.length());
+		else g711::encode(dst, (const int16_t*)samples.data(), n, compand, true);
+
+		packet.finalize(parity);
+		return packet;
+	}
+
+	Packet chand(const string& bits, uint32_t count) {
+		if (count > UINT8_MAX || bits.length() != AmbeFrame::byteLength(count))
+			throw runtime_error("Invalid number of AMBE bits");
+
+		auto it = chand_templates.find(count);
+		if (it == chand_templates.end()) {
+			Packet tmpl(CHANNEL);
+			tmpl.append<ChannelField>(channel);
+			tmpl.append<ChandField>(count);
+			tmpl.appendArray<char>(bits.length());
+			tmpl.finalize(parity);
+			it = chand_templates.emplace(count, move(tmpl)).first;
+		}
+
+		Packet packet(it->second);
+		auto field = packet.payload<ChandField>(sizeof(ChannelField));
+		memcpy((char*)field + sizeof(ChandField), bits.data(), bits.length());
+
+		packet.finalize(parity);
+		return packet;
+	}
+
+	// Clients may configure their own channel, but must not send control
+	// packets that affect other channels or the whole chip
+	Packet control(const string& data) {
+		Packet packet(data, false, false);
+		if (packet.type() != CONTROL || !owns(packet, { channel }, compand))
+			throw runtime_error("Control packet for another channel");
+
+		packet.finalize(parity);
+		return packet;
+	}
+
+	uint8_t channel;
+	Compand compand;
+	bool parity;
+
+	unordered_map<size_t, Packet> speech_templates;
+	unordered_map<uint32_t, Packet> chand_templates;
+};
+
+
+// Build a CHANNEL packet which makes the decoder conceal a lost frame. The
+// packet carries the bits of the previous frame, the chip ignores them.
+static Packet concealment(const Packet& previous, uint8_t channel, bool parity) {
+	size_t n;
+	auto bits = previous.bits(n);
+	auto bytes = AmbeFrame::byteLength(n);
+
+	Packet packet(CHANNEL);
+	packet.append<ChannelField>(channel);
+	packet.append<CmodeField>(CMODE_LOST_FRAME);
+	packet.append<ChandField>(n);
+	memcpy(packet.appendArray<char>(bytes), bits, bytes);
+
+	packet.finalize(parity);
+	return packet;
+}
+
+
+// Parse the number of channels requested by a bind client. Returns zero if
+// the number is not between one and max.
+static size_t parseChannelCount(const grpc::string_ref& value, int max) {
+	string s(value.data(), value.size());
+	if (s.empty() || s.find_first_not_of("0123456789") != string::npos || s.size() > 3)
+		return 0;
+
+	auto rv = stoul(s);
+	return rv <= (size_t)max ? rv : 0;
+}
+
+
+/**
+ * A bind, transcode, or frames session
+ *
+ * A regular session (bind) owns one channel, or several channels on the same
+ * chip if the client asks for them with the "channels" attribute. Packets
+ * addressed to a channel the session does not own are answered with an empty
+ * message. A transcoding session owns two channels on the same chip: CHANNEL
+ * packets for the first channel are decompressed there and compressed again
+ * on the second channel. A frames session owns one channel, but exchanges
+ * frames with the client and builds the packets for the chip with a
+ * FrameBuilder.
+ *
+ * Requests read from the stream are submitted to the scheduler without
+ * waiting for earlier responses. Responses are appended to the session's
+ * write queue from the scheduler's thread. Only one write can be outstanding
+ * on a stream, the next write is started when the previous one completes.
+ * The call is finished once the client has stopped sending and all responses
+ * have been written.
+ */
+class Session final : public Call, public enable_shared_from_this<Session> {
+public:
+	enum Kind { BIND, TRANSCODE, FRAMES };
+
+	static void create(AmbeServiceImpl& server, ServerCompletionQueue* cq, Kind kind) {
+		shared_ptr<Session> session(new Session(server, cq, kind));
+		session->self = session;
+
+		lock_guard<std::mutex> lock(session->mutex);
+		session->context.AsyncNotifyWhenDone(&session->events[DONE]);
+		session->ops++;
+
+		auto tag = &session->events[CONNECT];
+		switch(kind) {
+		case BIND:      server.service.Requestbind(&session->context, &session->stream, cq, cq, tag);      break;
+		case TRANSCODE: server.service.Requesttranscode(&session->context, &session->stream, cq, cq, tag); break;
+		case FRAMES:    server.service.Requestframes(&session->context, &session->stream, cq, cq, tag);    break;
+		}
+	}
+
+	void proceed(Op op, bool ok) override {
+		shared_ptr<Session> keep;
+		optional<grpc::ByteBuffer> received;
+		bool cancel = false;
+
+		{
+			lock_guard<std::mutex> lock(mutex);
+			if (op != DONE) ops--;
+
+			switch(op) {
+			case CONNECT:
+				// The server is shutting down
+				if (!ok) {
+					keep = move(self);
+					return;
+				}
+				create(server, cq, kind);
+				connect();
+				break;
+
+			case METADATA:
+				if (ok) issue(READ);
+				else reading = false;
+				break;
+
+			case READ:
+				if (!ok) {
+					reading = false;
+					break;
+				}
+				// The message counts as one request until it has been
+				// parsed, see submit()
+				inflight++;
+				received.emplace();
+				received->Swap(&request);
+				issue(READ);
+				break;
+
+			case WRITE:
+				writing = false;
+				outgoing.Clear();
+				if (!ok) {
+					cancel = !broken;
+					broken = true;
+					writes = queue<WireMessage>();
+				} else if (!writes.empty()) {
+					issue(WRITE);
+				}
+				break;
+
+			case FINISH:
+				finished = true;
+				break;
+
+			case DONE:
+				done = true;
+				if (context.IsCancelled()) {
+					cancel = !broken;
+					broken = true;
+				}
+				break;
+
+			default:
+				throw logic_error("Bug: Invalid operation");
+			}
+
+			maybeFinish();
+
+			// The session can be destroyed once the call is over and no
+			// operation refers to it anymore. Responses for all requests
+			// have been received at this point.
+			if (done && finished && !ops) {
+				if (!channels.second.empty())
+					server.dev_manager.releaseChannels(channels.first, channels.second);
+				keep = move(self);
+			}
+		}
+
+		// Submit outside of the lock, the scheduler may invoke the callback
+		// right away.
+		if (received) submit(*received);
+		if (cancel) purge();
+	}
+
+private:
+	Session(AmbeServiceImpl& server, ServerCompletionQueue* cq, Kind kind) :
+		Call(server, cq), kind(kind), stream(&context) {
+	}
+
+	void connect() {
+		auto& attrs = context.client_metadata();
+
+		size_t count = kind == TRANSCODE ? 2 : 1;
+		auto n = attrs.find("channels");
+		if (kind == BIND && n != attrs.end()) {
+			count = parseChannelCount(n->second, server.device.channels());
+			if (!count) {
+				finish(Status(StatusCode::INVALID_ARGUMENT, "Invalid number of channels"));
+				return;
+			}
+		}
 
-	Status bind(ServerContext* context, ServerReaderWriter<rpc::Packet, rpc::Packet>* stream) override {
-		pair<string, size_t> channel;
 		try {
-			channel = dev_manager.acquireChannel();
+			channels = server.dev_manager.acquireChannels(count);
 		} catch(const runtime_error& e) {
-			return Status(StatusCode::UNAVAILABLE, "No channels left");
+			finish(Status(StatusCode::UNAVAILABLE, "No channels left"));
+			return;
 		}
-		context->AddInitialMetadata("channel", grpc::to_string(channel.second));
 
-		context->AddInitialMetadata("uses_parity", grpc::to_string(device.uses_parity));
-		stream->SendInitialMetadata();
+		source = channels.second[0];
+		context.AddInitialMetadata("channel", grpc::to_string(source));
+		if (kind == TRANSCODE)
+			context.AddInitialMetadata("target_channel", grpc::to_string(channels.second[1]));
 
-		rpc::Packet request;
-		while(stream->Read(&request)) {
-			const auto tag = request.tag();
+		// All channels of a bind session, e.g., 0,1,2. The first one is the
+		// channel above.
+		if (kind == BIND) {
+			string list;
+			for (auto ch : channels.second)
+				list += (list.empty() ? "" : ",") + grpc::to_string(ch);
+			context.AddInitialMetadata("channels", list);
+		}
+
+		// Frames never carry parity or companded samples, the packets for the
+		// chip are built here
+		if (kind == FRAMES) {
+			builder.emplace(source, server.device.compand, server.device.uses_parity);
+			context.AddInitialMetadata("uses_parity", "0");
+			context.AddInitialMetadata("compand", toString(Compand::NONE));
+		} else {
+			context.AddInitialMetadata("uses_parity", grpc::to_string(server.device.uses_parity));
+			context.AddInitialMetadata("compand", toString(server.device.compand));
+		}
 
-			auto callback = [tag, stream](const Packet& packet) {
-				rpc::Packet response;
-				response.set_tag(tag);
-				response.set_data(packet.data());
+		// Clients that can handle packet batches announce it in their
+		// metadata. Older clients never receive batches.
+		auto b = attrs.find("batch");
+		if (b != attrs.end() && b->second == "1") {
+			batching = true;
+			context.AddInitialMetadata("batch", "1");
+		}
 
-				// FIXME: What happens if the the stream object becomes invalid,
-				// e.g., because the client closed the connection, while the
-				// lambda is waiting to be invoked?
-				if (!stream->Write(response))
-					throw runtime_error("Error while sending response");
-			};
+		// All sessions of a client share its rate limit. Clients are
+		// identified by their address. Trusted peers (routers) name the
+		// clients they forward with the "client" attribute.
+		auto peer = Admission::identity(context.peer());
+		auto c = attrs.find("client");
+		if (c != attrs.end() && admission.trusted(peer))
+			quota = admission.join(string(c->second.data(), c->second.size()));
+		else
+			quota = admission.join(peer);
 
-			scheduler.submitAsync(Packet(request.data(), device.uses_parity, false), callback);
+		// Clients that feed frames as they arrive from a radio network can
+		// have them reordered and paced by a jitter buffer (see the seq
+		// field). The buffer serves a single channel.
+		auto j = attrs.find("jitter");
+		if (kind != TRANSCODE && channels.second.size() == 1 && j != attrs.end() && j->second == "1") {
+			jitter.emplace();
+			context.AddInitialMetadata("jitter", "1");
+			server.playout.add(shared_from_this());
 		}
 
-		dev_manager.releaseChannel(channel.first, channel.second);
-		return Status::OK;
+		reading = true;
+		issue(METADATA);
 	}
 
+	// Only invoked from the completion queue's thread, i.e., the parser is
+	// never used concurrently.
+	void submit(grpc::ByteBuffer& buffer) {
+		auto request = parser.parse(buffer);
+		size_t count = 0;
+		if (request) count = request->has_batch() ? request->batch().packets_size() : 1;
+		else cerr << "Warning: Dropping malformed message" << endl;
+
+		// Replace the message with its requests before the first one is
+		// submitted
+		{
+			lock_guard<std::mutex> lock(mutex);
+			inflight += count;
+			inflight--;
+			maybeFinish();
+		}
+
+		if (!request) return;
+		if (!request->has_batch()) {
+			submit(*request, nullptr);
+			return;
+		}
+
+		// Hand all packets of a batch to the scheduler at once. Transcoding
+		// requests are submitted separately because they take two stages.
+		Batch batch;
+		batch.reserve(count);
+		for (auto& pkt : *request->mutable_batch()->mutable_packets())
+			submit(pkt, &batch);
 
-	Status ping(ServerContext* context, ServerReaderWriter<rpc::Ping, rpc::Ping>* stream) override {
-		rpc::Ping ping;
-		while (stream->Read(&ping)) stream->Write(ping);
-		return Status::OK;
+		if (!batch.empty())
+			server.scheduler.submitBatchAsync(move(batch));
 	}
 
+	// The packet data is moved out of the request instead of being copied
+	void submit(rpc::Packet& request, Batch* batch) {
+		auto session = shared_from_this();
+		auto tag = request.tag();
+		Origin origin{this, tag};
 
-	string id;
-	Usb3003 device;
-	MultiQueueScheduler scheduler;
-	API api;
+		// The client has given up on an earlier request. The cancelled
+		// request is answered with an empty message; the cancel message
+		// itself is not answered. A frame still waiting in the jitter buffer
+		// is taken out, its slot is concealed.
+		if (request.cancel()) {
+			optional<JitterFrame> removed;
+			{
+				lock_guard<std::mutex> lock(mutex);
+				if (jitter) removed = jitter->remove([tag](const JitterFrame& frame) { return frame.tag == tag; });
+			}
+			if (removed) respond(tag, nullptr);
+			else server.scheduler.cancel(origin);
 
-	DeviceManager dev_manager;
+			lock_guard<std::mutex> lock(mutex);
+			inflight--;
+			maybeFinish();
+			return;
+		}
+
+		if (!admit()) {
+			reject(tag);
+			return;
+		}
+
+		auto callback = [session, tag](const Packet& packet) {
+			session->respond(tag, &packet);
+		};
+
+		// A malformed packet fails its own request only
+		optional<Packet> parsed;
+		try {
+			if (kind == FRAMES) parsed = builder->build(request);
+			else parsed.emplace(move(*request.mutable_data()), server.device.uses_parity, false);
+		} catch(const runtime_error& e) {
+			respond(tag, nullptr);
+			return;
+		}
+
+		Packet& packet = *parsed;
+		if (!owns(packet, channels.second, server.device.compand)) {
+			respond(tag, nullptr);
+			return;
+		}
+
+		if (jitter && packet.type() == CHANNEL && packet.channel() == source) {
+			buffer(tag, request.seq(), move(packet));
+			return;
+		}
+
+		if (kind == TRANSCODE && packet.type() == CHANNEL && packet.channel() == source)
+			server.scheduler.transcodeAsync(packet, channels.second[1], callback, origin);
+		else if (batch)
+			batch->emplace_back(move(packet), move(callback), origin);
+		else
+			server.scheduler.submitAsync(packet, callback, origin);
+	}
+
+	// Admit a request if the session has room for another pending request
+	// and the client has not exceeded its rate
+	bool admit() {
+		lock_guard<std::mutex> lock(mutex);
+		if (admission.max_pending && pending >= admission.max_pending) return false;
+		if (!quota->admit(chrono::steady_clock::now())) return false;
+		pending++;
+		return true;
+	}
+
+	// Answer a request that has not been admitted with a busy message
+	void reject(int32_t tag) {
+		lock_guard<std::mutex> lock(mutex);
+		inflight--;
+		if (!broken) {
+			writes.push(WireMessage::busy(tag));
+			if (!writing) issue(WRITE);
+		}
+		maybeFinish();
+	}
+
+	// The client has gone away. Drop the frames waiting in the jitter buffer
+	// and purge the session's requests from the scheduler, so that they do
+	// not occupy the chip anymore.
+	void purge() {
+		{
+			lock_guard<std::mutex> lock(mutex);
+			if (jitter) {
+				inflight -= jitter->size();
+				pending -= jitter->size();
+				jitter.emplace();
+			}
+			maybeFinish();
+		}
+		server.scheduler.cancel({this, Origin::ALL});
+	}
+
+	void buffer(int32_t tag, uint32_t seq, Packet&& packet) {
+		optional<JitterFrame> rejected;
+		{
+			lock_guard<std::mutex> lock(mutex);
+			rejected = jitter->push(seq, JitterFrame{tag, move(packet)}, chrono::steady_clock::now());
+		}
+		if (rejected) respond(rejected->tag, nullptr);
+	}
+
+public:
+	// Invoked by the playout clock once per frame period. Submits the next
+	// frame from the jitter buffer, or a concealment request if the frame
+	// is missing. Once the client has stopped sending, the remaining frames
+	// are played without concealment.
+	void tick() {
+		optional<Packet> play;
+		int32_t tag = 0;
+		uint32_t seq = 0;
+		bool concealed = false;
+		vector<int32_t> dropped;
+
+		{
+			lock_guard<std::mutex> lock(mutex);
+			if (broken) return;
+
+			JitterFrame frame;
+			while (true) {
+				auto action = jitter->pop(frame, seq, !reading);
+				if (action == Jitter::Action::DROP) {
+					dropped.push_back(frame.tag);
+					continue;
+				}
+
+				if (action == Jitter::Action::PLAY) {
+					tag = frame.tag;
+					previous = frame.packet;
+					play = move(frame.packet);
+				} else if (action == Jitter::Action::CONCEAL && previous) {
+					try {
+						play = concealment(*previous, source, server.device.uses_parity);
+						concealed = true;
+						inflight++;
+						pending++;
+					} catch(const runtime_error& e) {}
+				}
+				break;
+			}
+		}
+
+		for (auto t : dropped) respond(t, nullptr);
+		if (!play) return;
+
+		// Concealment requests answer no request of the client. Their
+		// origins lie outside the range of client tags, so that cancelling a
+		// client's request never hits one.
+		Origin origin{this, tag};
+		if (concealed) origin.id = concealment_origin--;
+
+		auto session = shared_from_this();
+		server.scheduler.submitAsync(*play, [session, tag, seq, concealed](const Packet& packet) {
+			session->respond(tag, &packet, seq, concealed);
+		}, origin);
+	}
+
+private:
+	// Invoked by the scheduler when the response for a request is available.
+	// Rejected frames and cancelled requests (which complete with an empty
+	// packet) are answered with an empty message.
+	void respond(int32_t tag, const Packet* packet, uint32_t seq=0, bool concealed=false) {
+		lock_guard<std::mutex> lock(mutex);
+		inflight--;
+		pending--;
+
+		if (packet && !packet->payloadLength()) packet = nullptr;
+
+		// Responses for clients that have gone away are dropped
+		if (!broken) {
+			optional<WireMessage> response;
+			if (packet && builder) {
+				try {
+					response = builder->store(tag, *packet, seq, concealed);
+				} catch(const runtime_error& e) {}
+			} else if (packet) {
+				response.emplace(tag, WireMessage::DATA, packet->data().data(), packet->length(), 0, seq, concealed);
+			}
+			if (!response) response.emplace(tag, WireMessage::DATA, nullptr, 0);
+
+			writes.push(move(*response));
+			if (!writing) issue(WRITE);
+		}
+
+		maybeFinish();
+	}
+
+	// Start an asynchronous operation. Must be called with the mutex held.
+	void issue(Op op) {
+		ops++;
+		switch(op) {
+		case METADATA: stream.SendInitialMetadata(&events[METADATA]); break;
+		case READ:     stream.Read(&request, &events[READ]);          break;
+		case WRITE:
+			// Send all responses that have accumulated while the previous
+			// write was in progress in one message
+			outgoing = WireMessage::serialize(writes, batching ? writes.size() : 1);
+			writing = true;
+			stream.Write(outgoing, &events[WRITE]);
+			break;
+		default:
+			throw logic_error("Bug: Invalid operation");
+		}
+	}
+
+	void finish(const Status& status) {
+		finishing = true;
+		ops++;
+		stream.Finish(status, &events[FINISH]);
+	}
+
+	void maybeFinish() {
+		if (connected() && !reading && !inflight && !writing && !finishing)
+			finish(Status::OK);
+	}
+
+	bool connected() const {
+		return !channels.second.empty();
+	}
+
+	Kind kind;
+	ServerAsyncReaderWriter<grpc::ByteBuffer, grpc::ByteBuffer> stream;
+	shared_ptr<Session> self;
+
+	std::mutex mutex;
+	grpc::ByteBuffer request;
+	grpc::ByteBuffer outgoing;
+	queue<WireMessage> writes;
+	WireParser parser;
+	pair<string, vector<size_t>> channels;
+	unsigned int source = 0;
+	optional<FrameBuilder> builder;
+
+	// Frames waiting in the jitter buffer count as submitted requests
+	struct JitterFrame {
+		int32_t tag = 0;
+		Packet packet;
+	};
+	typedef JitterBuffer<JitterFrame> Jitter;
+	optional<Jitter> jitter;
+	optional<Packet> previous;  // The last frame played from the buffer
+
+	// Scheduler origins of concealment requests, below INT32_MIN. Only used
+	// by the playout clock.
+	int64_t concealment_origin = (int64_t)INT32_MIN - 1;
+
+	unsigned int ops = 0;       // Outstanding completion queue operations
+	unsigned int inflight = 0;  // Requests submitted to the scheduler
+	unsigned int pending = 0;   // Admitted requests not answered yet
+	shared_ptr<Quota> quota;
+	bool reading = false;
+	bool writing = false;
+	bool finishing = false;
+	bool finished = false;
+	bool broken = false;
+	bool done = false;
+	bool batching = false;
 };
 
 
+/**
+ * A ping call which echoes every message back to the client
+ */
+class PingCall final : public Call {
+public:
+	static void create(AmbeServiceImpl& server, ServerCompletionQueue* cq) {
+		auto call = new PingCall(server, cq);
+		server.service.Requestping(&call->context, &call->stream, cq, cq, &call->events[CONNECT]);
+	}
+
+	// Only one operation is outstanding at any time
+	void proceed(Op op, bool ok) override {
+		switch(op) {
+		case CONNECT:
+			if (!ok) {
+				delete this;
+				return;
+			}
+			create(server, cq);
+			stream.Read(&ping, &events[READ]);
+			break;
+
+		case READ:
+			if (ok) stream.Write(ping, &events[WRITE]);
+			else stream.Finish(Status::OK, &events[FINISH]);
+			break;
+
+		case WRITE:
+			if (ok) stream.Read(&ping, &events[READ]);
+			else stream.Finish(Status::OK, &events[FINISH]);
+			break;
+
+		case FINISH:
+			delete this;
+			break;
+
+		default:
+			throw logic_error("Bug: Invalid operation");
+		}
+	}
+
+private:
+	PingCall(AmbeServiceImpl& server, ServerCompletionQueue* cq) :
+		Call(server, cq), stream(&context) {
+	}
+
+	ServerAsyncReaderWriter<rpc::Ping, rpc::Ping> stream;
+	rpc::Ping ping;
+};
+
+
+/**
+ * A capacity query, answered right away from the channel leases
+ */
+class CapacityCall final : public Call {
+public:
+	static void create(AmbeServiceImpl& server, ServerCompletionQueue* cq) {
+		auto call = new CapacityCall(server, cq);
+		server.service.Requestcapacity(&call->context, &call->request, &call->responder, cq, cq, &call->events[CONNECT]);
+	}
+
+	void proceed(Op op, bool ok) override {
+		switch(op) {
+		case CONNECT: {
+			if (!ok) {
+				delete this;
+				return;
+			}
+			create(server, cq);
+
+			auto capacity = server.devices().capacity();
+			rpc::Capacity reply;
+			reply.set_channels(capacity.first);
+			reply.set_free(capacity.second);
+			responder.Finish(reply, Status::OK, &events[FINISH]);
+			break;
+		}
+
+		case FINISH:
+			delete this;
+			break;
+
+		default:
+			throw logic_error("Bug: Invalid operation");
+		}
+	}
+
+private:
+	CapacityCall(AmbeServiceImpl& server, ServerCompletionQueue* cq) :
+		Call(server, cq), responder(&context) {
+	}
+
+	rpc::CapacityRequest request;
+	ServerAsyncResponseWriter<rpc::Capacity> responder;
+};
+
+
+/**
+ * A session of a client attached via shared memory (see shm.h)
+ *
+ * The front end's thread performs the handshake, drains the request ring and
+ * submits the packets to the scheduler. Responses are pushed into the
+ * response ring from the scheduler's thread. Callbacks keep the session
+ * alive, the channel is released once the client has disconnected and all
+ * responses have been received.
+ */
+class ShmSession final : public enable_shared_from_this<ShmSession> {
+public:
+	ShmSession(AmbeServiceImpl& server, int sock) : server(server), sock(sock) {
+	}
+
+	~ShmSession() {
+		if (area) munmap(area, sizeof(ShmArea));
+		for (auto fd : { sock, memfd, request_bell, response_bell })
+			if (fd >= 0) ::close(fd);
+		if (!channels.second.empty())
+			server.dev_manager.releaseChannels(channels.first, channels.second);
+	}
+
+	// Process the client's hello message and set up the shared mapping.
+	// Returns the request doorbell to be watched by the front end. Throws
+	// runtime_error if the session cannot be established.
+	int open() {
+		ShmHello hello;
+		size_t count = 0;
+		auto n = shmRecv(sock, &hello, sizeof(hello), nullptr, count);
+		if (n != sizeof(hello) || hello.magic != SHM_MAGIC)
+			throw runtime_error("Invalid hello message");
+
+		if (hello.version != SHM_VERSION) {
+			reject("Unsupported protocol version");
+			throw runtime_error("Unsupported protocol version");
+		}
+
+		try {
+			channels = server.dev_manager.acquireChannels(1);
+		} catch(const runtime_error& e) {
+			reject("No channels left");
+			throw;
+		}
+
+		memfd = memfd_create("ambed", MFD_CLOEXEC);
+		if (memfd < 0)
+			throw system_error(errno, system_category(), "Error in memfd_create");
+
+		if (ftruncate(memfd, sizeof(ShmArea)) < 0)
+			throw system_error(errno, system_category(), "Error in ftruncate");
+
+		auto mem = mmap(nullptr, sizeof(ShmArea), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+		if (mem == MAP_FAILED)
+			throw system_error(errno, system_category(), "Error while mapping shared memory");
+		area = new (mem) ShmArea();
+
+		request_bell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		response_bell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		if (request_bell < 0 || response_bell < 0)
+			throw system_error(errno, system_category(), "Error while creating eventfd");
+
+		// The client rings the doorbell for its first request
+		area->requests.sleep();
+
+		ShmWelcome welcome;
+		memset(&welcome, 0, sizeof(welcome));
+		welcome.magic = SHM_MAGIC;
+		welcome.channel = channels.second[0];
+		welcome.uses_parity = server.device.uses_parity;
+		welcome.compand = static_cast<uint8_t>(server.device.compand);
+
+		int fds[3] = { memfd, request_bell, response_bell };
+		shmSend(sock, &welcome, sizeof(welcome), fds, 3);
+		return request_bell;
+	}
+
+	// Invoked when the request doorbell rings. Throws runtime_error if the
+	// client has corrupted the request ring or sent an invalid packet.
+	// Packets for channels other than the session's are answered with an
+	// empty response.
+	void drain() {
+		uint64_t value;
+		if (read(request_bell, &value, sizeof(value)) < 0 && errno != EAGAIN)
+			throw system_error(errno, system_category(), "Error while reading doorbell");
+
+		auto session = shared_from_this();
+		do {
+			area->requests.wake();
+
+			Batch batch;
+			area->requests.drain([&](int32_t tag, const char* data, size_t length) {
+				Packet packet(string(data, length), server.device.uses_parity, false);
+				if (!owns(packet, channels.second, server.device.compand)) {
+					push(tag, nullptr, 0);
+					return;
+				}
+
+				batch.emplace_back(move(packet), [session, tag](const Packet& packet) {
+					session->respond(tag, packet);
+				}, Origin{this, tag});
+			});
+
+			if (!batch.empty())
+				server.scheduler.submitBatchAsync(move(batch));
+		} while (!area->requests.sleep());
+	}
+
+	int socket() const {
+		return sock;
+	}
+
+	// The client has gone away, purge its requests from the scheduler
+	void cancel() {
+		server.scheduler.cancel({this, Origin::ALL});
+	}
+
+private:
+	void reject(const char* error) {
+		ShmWelcome welcome;
+		memset(&welcome, 0, sizeof(welcome));
+		welcome.magic = SHM_MAGIC;
+		welcome.status = -1;
+		strncpy(welcome.error, error, sizeof(welcome.error) - 1);
+		shmSend(sock, &welcome, sizeof(welcome), nullptr, 0);
+	}
+
+	// Invoked by the scheduler when the response for a request is available.
+	// Cancelled requests complete with an empty packet, nobody is waiting
+	// for them anymore.
+	//
+	// The client keeps at most SHM_SLOTS requests outstanding, so the
+	// response ring only fills up if the client misbehaves. A response that
+	// cannot be delivered would leave the client waiting, the session is
+	// failed instead: shutting the socket down ends the session on both
+	// sides and the client fails its outstanding requests.
+	void respond(int32_t tag, const Packet& packet) {
+		if (!packet.payloadLength()) return;
+		push(tag, packet.data().data(), packet.length());
+	}
+
+	// Push a response into the ring, an empty one fails the request
+	void push(int32_t tag, const char* data, size_t length) {
+		lock_guard<std::mutex> lock(mutex);
+		if (failed) return;
+
+		if (!area->responses.push(tag, data, length)) {
+			cerr << "Shared memory session: Response ring full, closing session" << endl;
+			failed = true;
+			shutdown(sock, SHUT_RDWR);
+			return;
+		}
+		area->responses.notify(response_bell);
+	}
+
+	AmbeServiceImpl& server;
+	int sock;
+	int memfd = -1;
+	int request_bell = -1;
+	int response_bell = -1;
+	ShmArea* area = nullptr;
+	pair<string, vector<size_t>> channels;
+
+	// Serializes producers of the response ring
+	std::mutex mutex;
+	bool failed = false;
+};
+
+
+/**
+ * Accepts clients on a Unix domain socket and serves their shared memory
+ * sessions
+ *
+ * A single thread waits with epoll for new connections, for the request
+ * doorbells of all sessions, and for clients closing their sockets.
+ */
+class ShmFrontEnd final {
+public:
+	ShmFrontEnd(AmbeServiceImpl& server, const string& path) : server(server), path(path) {
+		struct sockaddr_un addr;
+		auto len = shmAddress(path, addr);
+
+		// Remove a socket left behind by a previous instance
+		if (path[0] != '@') unlink(path.c_str());
+
+		listener = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		if (listener < 0)
+			throw system_error(errno, system_category(), "Error while creating socket");
+
+		if (bind(listener, (struct sockaddr*)&addr, len) < 0)
+			throw system_error(errno, system_category(), "Error while binding to " + path);
+
+		if (listen(listener, 16) < 0)
+			throw system_error(errno, system_category(), "Error in listen");
+
+		epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll < 0)
+			throw system_error(errno, system_category(), "Error in epoll_create1");
+		watch(listener);
+	}
+
+	~ShmFrontEnd() {
+		::close(epoll);
+		::close(listener);
+		if (path[0] != '@') unlink(path.c_str());
+	}
+
+	void run() {
+		struct epoll_event events[64];
+		while (true) {
+			auto n = epoll_wait(epoll, events, 64, -1);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+				throw system_error(errno, system_category(), "Error in epoll_wait");
+			}
+
+			for (int i = 0; i < n; i++) {
+				int fd = events[i].data.fd;
+				if (fd == listener) {
+					accept();
+					continue;
+				}
+
+				// The session may have been closed by an earlier event
+				auto b = bells.find(fd);
+				if (b != bells.end()) {
+					auto session = b->second;
+					try {
+						session->drain();
+					} catch(const exception& e) {
+						cerr << "Shared memory session: " << e.what() << endl;
+						close(session);
+					}
+					continue;
+				}
+
+				auto s = sockets.find(fd);
+				if (s != sockets.end()) {
+					auto session = s->second;
+					// The first message is the client's hello. Anything
+					// after that means that the client has disconnected.
+					if (waiting.erase(fd) && !(events[i].events & (EPOLLHUP | EPOLLERR))) {
+						try {
+							auto bell = session->open();
+							bells[bell] = session;
+							watch(bell);
+							continue;
+						} catch(const exception& e) {
+							cerr << "Shared memory session: " << e.what() << endl;
+						}
+					}
+					close(session);
+				}
+			}
+		}
+	}
+
+private:
+	void accept() {
+		while (true) {
+			int sock = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+			if (sock < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+				if (errno == EINTR || errno == ECONNABORTED) continue;
+				cerr << "Error while accepting shared memory client: " << strerror(errno) << endl;
+				return;
+			}
+			sockets[sock] = make_shared<ShmSession>(server, sock);
+			waiting.insert(sock);
+			watch(sock);
+		}
+	}
+
+	void watch(int fd) {
+		struct epoll_event event;
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+			throw system_error(errno, system_category(), "Error in epoll_ctl");
+	}
+
+	// Stop serving the session. The descriptors are closed and the channel
+	// is released once the scheduler has returned all responses.
+	void close(shared_ptr<ShmSession> session) {
+		for (auto map : { &sockets, &bells }) {
+			for (auto i = map->begin(); i != map->end(); ) {
+				if (i->second == session) {
+					epoll_ctl(epoll, EPOLL_CTL_DEL, i->first, nullptr);
+					i = map->erase(i);
+				} else {
+					++i;
+				}
+			}
+		}
+		waiting.erase(session->socket());
+		session->cancel();
+	}
+
+	AmbeServiceImpl& server;
+	string path;
+	int listener = -1;
+	int epoll = -1;
+
+	// Sessions indexed by their socket and request doorbell
+	unordered_map<int, shared_ptr<ShmSession>> sockets;
+	unordered_map<int, shared_ptr<ShmSession>> bells;
+
+	// Sockets of clients that have not sent their hello message yet
+	unordered_set<int> waiting;
+};
+
+
+PlayoutClock::~PlayoutClock() {
+	{
+		lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	cond.notify_all();
+	if (worker.joinable()) worker.join();
+}
+
+
+void PlayoutClock::add(const shared_ptr<Session>& session) {
+	lock_guard<std::mutex> lock(mutex);
+	sessions.push_back(session);
+	if (!worker.joinable()) worker = thread(&PlayoutClock::run, this);
+}
+
+
+void PlayoutClock::run() {
+	auto period = JitterBuffer<int>::period;
+	auto deadline = chrono::steady_clock::now();
+
+	unique_lock<std::mutex> lock(mutex);
+	while (true) {
+		// Catch up after short delays, but do not burst after long ones
+		deadline += period;
+		auto now = chrono::steady_clock::now();
+		if (now - deadline > 5 * period) deadline = now;
+
+		if (cond.wait_until(lock, deadline, [this] { return quit; })) return;
+
+		sessions.erase(remove_if(sessions.begin(), sessions.end(),
+			[](const weak_ptr<Session>& s) { return s.expired(); }), sessions.end());
+		auto current = sessions;
+
+		lock.unlock();
+		for (auto& weak : current)
+			if (auto session = weak.lock()) session->tick();
+		lock.lock();
+	}
+}
+
+
+void AmbeServiceImpl::serve(ServerCompletionQueue* cq) {
+	Session::create(*this, cq, Session::BIND);
+	Session::create(*this, cq, Session::TRANSCODE);
+	Session::create(*this, cq, Session::FRAMES);
+	PingCall::create(*this, cq);
+	CapacityCall::create(*this, cq);
+
+	void* tag;
+	bool ok;
+	while (cq->Next(&tag, &ok)) {
+		auto event = static_cast<Call::Event*>(tag);
+
+		// An error in one call must not take down the server and all the
+		// other calls with it
+		try {
+			event->call->proceed(event->op, ok);
+		} catch(const exception& e) {
+			cerr << "Error while serving a call: " << e.what() << endl;
+		}
+	}
+}
+
+
 static void print_help(void) {
 	static char help_msg[] = "\
 Usage: ambed [options]\n\
 Options:\n\
     -h         This help text.\n\
     -p <num>   Port number to listen on.\n\
+    -l <addr>  Listen on host:port, unix:<path>, or unix:@<name> (abstract\n\
+               socket) instead. Can be given multiple times.\n\
     -s <path>  Serial port with an AMBE chip.\n\
+    -g <law>   Compand speech samples on the serial port (none, ulaw, alaw).\n\
+    -t <num>   Number of threads serving RPC calls (default: 2).\n\
+    -m <path>  Serve local clients via shared memory on this Unix socket.\n\
+    -r <spec>  Add an RTP gateway session (see README). Can be given\n\
+               multiple times.\n\
+    -Q <num>   Maximum number of requests queued or in flight per session\n\
+               (default: 256, 0 = unlimited).\n\
+    -q <spec>  Set the rate limit of a client (see README). Can be given\n\
+               multiple times.\n\
+    -T <addr>  Accept the client attribute from this IP address, e.g., an\n\
+               ambe-router. Can be given multiple times.\n\
 ";
 
 	fprintf(stdout, "%s", help_msg);
@@ -147,13 +1416,50 @@ Options:\n\
 int main(int argc, char** argv) {
 	int opt;
 
-	while((opt = getopt(argc, argv, "hvp:s:")) != -1) {
+	while((opt = getopt(argc, argv, "hvp:l:s:g:t:m:r:Q:q:T:")) != -1) {
 		switch(opt) {
 		case 'h': print_help();        break;
 		case 'p': port = atoi(optarg); break;
+		case 't': threads = atoi(optarg); break;
 		case 's':
 			pathname = string(optarg);
 			break;
+		case 'm':
+			shm_path = string(optarg);
+			break;
+		case 'l':
+			listeners.push_back(grpcAddress(optarg));
+			break;
+		case 'r':
+			try {
+				gateway_sessions.push_back(RtpConfig::parse(optarg));
+			} catch(const runtime_error& e) {
+				fprintf(stderr, "%s\n", e.what());
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'Q':
+			admission.max_pending = atoi(optarg);
+			break;
+		case 'T':
+			admission.trust(optarg);
+			break;
+		case 'q':
+			try {
+				admission.configure(QuotaConfig::parse(optarg));
+			} catch(const runtime_error& e) {
+				fprintf(stderr, "%s\n", e.what());
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'g':
+			try {
+				compand = parseCompand(optarg);
+			} catch(const runtime_error& e) {
+				fprintf(stderr, "%s\n", e.what());
+				exit(EXIT_FAILURE);
+			}
+			break;
 		default:
 			fprintf(stderr, "Use the -h option for list of supported "
 					"program arguments.\n");
@@ -166,22 +1472,58 @@ int main(int argc, char** argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	if (threads < 1) {
+		fprintf(stderr, "Invalid number of threads: %u\n", threads);
+		exit(EXIT_FAILURE);
+	}
+
 	if (!pathname.length()) {
 		fprintf(stderr, "Please provide a serial port (see -h)\n");
 		exit(EXIT_FAILURE);
 	}
 
-	string addr("0.0.0.0:" + to_string(port));
+	if (listeners.empty())
+		listeners.push_back("0.0.0.0:" + to_string(port));
 
 	ServerBuilder builder;
 
 	AmbeServiceImpl service(pathname);
-	builder.AddListeningPort(addr, grpc::InsecureServerCredentials());
-	builder.RegisterService(&service);
+	for (auto& addr : listeners)
+		builder.AddListeningPort(addr, grpc::InsecureServerCredentials());
+	builder.RegisterService(&service.service);
+
+	vector<unique_ptr<ServerCompletionQueue>> cqs;
+	for (unsigned int i = 0; i < threads; i++)
+		cqs.push_back(builder.AddCompletionQueue());
+
 	unique_ptr<Server> server(builder.BuildAndStart());
+	if (!server) {
+		fprintf(stderr, "Could not start gRPC server\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (auto& addr : listeners)
+		cout << "AMBE gRPC server listening on " << addr << endl;
+
+	vector<thread> workers;
+	for (auto& cq : cqs)
+		workers.emplace_back(&AmbeServiceImpl::serve, &service, cq.get());
+
+	unique_ptr<ShmFrontEnd> shm;
+	if (shm_path.length()) {
+		shm = make_unique<ShmFrontEnd>(service, shm_path);
+		cout << "AMBE shared memory server listening on " << shm_path << endl;
+		workers.emplace_back(&ShmFrontEnd::run, shm.get());
+	}
+
+	unique_ptr<RtpGateway> gateway;
+	if (!gateway_sessions.empty()) {
+		gateway = make_unique<RtpGateway>(service.devices(), gateway_sessions);
+		workers.emplace_back(&RtpGateway::run, gateway.get());
+	}
 
-	cout << "AMBE gRPC server listening on " << addr << endl;
-	server->Wait();
+	for (auto& worker : workers)
+		worker.join();
 
 	return EXIT_SUCCESS;
 }
@@ -285,6 +285,14 @@ void API::compand(bool enabled, bool alaw) {
 
 	if (!parseStatus(response, COMPAND))
 		throw runtime_error("PKT_COMPAND request failed");
+
+	if (!enabled) device.compand = Compand::NONE;
+	else device.compand = alaw ? Compand::ALAW : Compand::ULAW;
+}
+
+
+void API::compand(Compand mode) {
+	compand(mode != Compand::NONE, mode == Compand::ALAW);
 }
 
 
@@ -378,6 +386,8 @@ void API::ratet(uint8_t channel, uint8_t index) {
 
 	if (!parseStatus(response, channel, RATET))
 		throw runtime_error("PKT_RATET request on channel " + to_string(channel) + " failed");
+
+	resetGate(channel);
 }
 
 
@@ -393,6 +403,8 @@ void API::ratep(uint8_t channel, const uint16_t* rcw) {
 
 	if (!parseStatus(response, channel, RATEP))
 		throw runtime_error("PKT_RATEP request on channel " + to_string(channel) + " failed");
+
+	resetGate(channel);
 }
 
 
@@ -417,23 +429,198 @@ void API::init(uint8_t channel, bool encoder, bool decoder) {
 
 	if (!parseStatus(response, channel, INIT))
 		throw runtime_error("PKT_INIT request on channel " + to_string(channel) + " failed");
+
+	resetGate(channel);
+}
+
+
+void API::resetGate(uint8_t channel) {
+	if (channel >= gates.size()) return;
+
+	auto& g = gates[channel];
+	lock_guard<std::mutex> lock(g.mutex);
+	g.silence.reset();
+	g.generation++;
+	if (g.vad) g.vad->reset();
+}
+
+
+void API::vad(uint8_t channel, bool enabled, const VadParams& params) {
+	if (channel >= gates.size())
+		throw logic_error("Invalid channel number");
+
+	auto& g = gates[channel];
+	lock_guard<std::mutex> lock(g.mutex);
+	if (enabled) g.vad = make_unique<VoiceActivityDetector>(params);
+	else g.vad.reset();
+	g.stats = VadStats();
+}
+
+
+VadStats API::vadStats(uint8_t channel) {
+	if (channel >= gates.size())
+		throw logic_error("Invalid channel number");
+
+	auto& g = gates[channel];
+	lock_guard<std::mutex> lock(g.mutex);
+	return g.stats;
+}
+
+
+API::GateResult API::gate(uint8_t channel, const int16_t* samples, size_t count, unsigned int& generation, optional<Packet>& silence) {
+	if (channel >= gates.size()) return GateResult::SPEECH;
+
+	auto& g = gates[channel];
+	lock_guard<std::mutex> lock(g.mutex);
+	if (!g.vad) return GateResult::SPEECH;
+
+	g.stats.frames++;
+	if (g.vad->active(samples, count)) return GateResult::SPEECH;
+
+	if (g.silence) {
+		g.stats.skipped++;
+		silence = g.silence;
+		return GateResult::CACHED;
+	}
+
+	generation = g.generation;
+	return GateResult::SILENCE;
 }
 
 
-future<Packet> API::compress(uint8_t channel, const int16_t* samples, size_t count) {
+void API::submitSpeechAsync(uint8_t channel, const Packet& request, GateResult result, unsigned int generation, ResponseCallback callback, const Origin& origin) {
+	if (result == GateResult::SPEECH) {
+		scheduler.submitAsync(request, move(callback), origin);
+		return;
+	}
+
+	// This is the first silent frame since the channel was configured. Send it
+	// to the chip and keep the response as the silence (comfort noise) frame
+	// for the channel, unless the channel got reconfigured in the meantime.
+	scheduler.submitAsync(request, [this, channel, generation, callback](const Packet& response) {
+		if (response.type() == CHANNEL) {
+			auto& g = gates[channel];
+			lock_guard<std::mutex> lock(g.mutex);
+			if (g.generation == generation) g.silence = response;
+		}
+		callback(response);
+	}, origin);
+}
+
+
+future<Packet> API::compress(uint8_t channel, const int16_t* samples, size_t count, const Origin& origin) {
+	auto rv = make_shared<promise<Packet>>();
+	auto future = rv->get_future();
+
+	compressAsync(channel, samples, count, [rv](const Packet& response) {
+		rv->set_value(response);
+	}, origin);
+	return future;
+}
+
+
+void API::compressAsync(uint8_t channel, const int16_t* samples, size_t count, ResponseCallback callback, const Origin& origin) {
+	unsigned int generation = 0;
+	optional<Packet> silence;
+	auto result = gate(channel, samples, count, generation, silence);
+
+	if (result == GateResult::CACHED) {
+		callback(*silence);
+		return;
+	}
+
+	Packet request(SPEECH);
+	request.append<ChannelField>(channel);
+
+	if (device.compand == Compand::NONE) {
+		request.append<SpchdField>(count);
+		auto data = request.appendArray<int16_t>(count);
+		memcpy(data, samples, count * sizeof(samples[0]));
+	} else {
+		request.append<CompandedSpchdField>(count);
+		auto data = request.appendArray<uint8_t>(count);
+		g711::encode(data, samples, count, device.compand, true);
+	}
+
+	request.finalize(device.uses_parity);
+	submitSpeechAsync(channel, request, result, generation, move(callback), origin);
+}
+
+
+future<Packet> API::compress(uint8_t channel, const uint8_t* samples, size_t count, Compand law, const Origin& origin) {
+	// The voice activity detector works on linear samples. If gating is
+	// enabled, expand the frame and let the linear variant handle it.
+	if (channel < gates.size()) {
+		bool gated;
+		{
+			lock_guard<std::mutex> lock(gates[channel].mutex);
+			gated = (bool)gates[channel].vad;
+		}
+		if (gated) {
+			vector<int16_t> tmp(count);
+			g711::decode(tmp.data(), samples, count, law, true);
+			return compress(channel, tmp.data(), count, origin);
+		}
+	}
+
 	Packet request(SPEECH);
 	request.append<ChannelField>(channel);
-	request.append<SpchdField>(count);
 
-	auto data = request.appendArray<int16_t>(count);
-	memcpy(data, samples, count * sizeof(samples[0]));
+	if (device.compand == law) {
+		request.append<CompandedSpchdField>(count);
+		auto data = request.appendArray<uint8_t>(count);
+		memcpy(data, samples, count);
+	} else if (device.compand == Compand::NONE) {
+		request.append<SpchdField>(count);
+		auto data = request.appendArray<int16_t>(count);
+		g711::decode(data, samples, count, law, true);
+	} else {
+		// The caller and the chip use different laws, go through linear
+		// samples on the host.
+		vector<int16_t> tmp(count);
+		g711::decode(tmp.data(), samples, count, law);
+		request.append<CompandedSpchdField>(count);
+		auto data = request.appendArray<uint8_t>(count);
+		g711::encode(data, tmp.data(), count, device.compand);
+	}
 
 	request.finalize(device.uses_parity);
-	return scheduler.submit(request);
+	return scheduler.submit(request, origin);
 }
 
 
-future<Packet> API::decompress(uint8_t channel, const char* bits, size_t count) {
+future<Packet> API::compress(uint8_t channel, Resampler& resampler, const Origin& origin) {
+	if (resampler.outputRate() != SAMPLE_RATE)
+		throw logic_error("Resampler must produce " + to_string(SAMPLE_RATE) + " Hz audio");
+
+	if (resampler.available() < FRAME_SIZE)
+		throw logic_error("Not enough resampled audio for a frame");
+
+	bool gated = false;
+	if (channel < gates.size()) {
+		lock_guard<std::mutex> lock(gates[channel].mutex);
+		gated = (bool)gates[channel].vad;
+	}
+
+	// Voice activity detection and companding need the linear frame first
+	if (gated || device.compand != Compand::NONE) {
+		AudioFrame frame;
+		resampler.read(frame.data(), frame.size(), true);
+		return compress(channel, frame.data(), frame.size(), origin);
+	}
+
+	Packet request(SPEECH);
+	request.append<ChannelField>(channel);
+	request.append<SpchdField>(FRAME_SIZE);
+	auto data = request.appendArray<int16_t>(FRAME_SIZE);
+	resampler.read(data, FRAME_SIZE, true);
+
+	request.finalize(device.uses_parity);
+	return scheduler.submit(request, origin);
+}
+
+
+static Packet channelPacket(uint8_t channel, const char* bits, size_t count, bool parity) {
 	Packet request(CHANNEL);
 	request.append<ChannelField>(channel);
 	request.append<ChandField>(count);
@@ -442,6 +629,97 @@ future<Packet> API::decompress(uint8_t channel, const char* bits, size_t count)
 	auto data = request.appendArray<char>(bytes);
 	memcpy(data, bits, bytes);
 
-	request.finalize(device.uses_parity);
-	return scheduler.submit(request);
+	request.finalize(parity);
+	return request;
+}
+
+
+future<Packet> API::decompress(uint8_t channel, const char* bits, size_t count, const Origin& origin) {
+	return scheduler.submit(channelPacket(channel, bits, count, device.uses_parity), origin);
+}
+
+
+void API::decompressAsync(uint8_t channel, const char* bits, size_t count, ResponseCallback callback, const Origin& origin) {
+	scheduler.submitAsync(channelPacket(channel, bits, count, device.uses_parity), move(callback), origin);
+}
+
+
+vector<future<Packet>> API::compressSuperframe(uint8_t channel, const int16_t* samples, size_t frames, const Origin& origin) {
+	vector<future<Packet>> rv;
+	rv.reserve(frames);
+
+	for (size_t i = 0; i < frames; i++)
+		rv.push_back(compress(channel, samples + i * FRAME_SIZE, FRAME_SIZE, origin));
+	return rv;
+}
+
+
+vector<future<Packet>> API::decompressSuperframe(uint8_t channel, const char* bits, size_t count, size_t frames, const Origin& origin) {
+	vector<future<Packet>> rv;
+	rv.reserve(frames);
+
+	// Submit all frames in one go so that remote devices can send them in a
+	// single message
+	Batch batch;
+	batch.reserve(frames);
+
+	size_t bytes = AmbeFrame::byteLength(count);
+	for (size_t i = 0; i < frames; i++) {
+		auto p = make_shared<promise<Packet>>();
+		rv.push_back(p->get_future());
+		batch.emplace_back(channelPacket(channel, bits + i * bytes, count, device.uses_parity), [p](const Packet& response) {
+			p->set_value(response);
+		}, origin);
+	}
+
+	scheduler.submitBatchAsync(move(batch));
+	return rv;
+}
+
+
+future<Packet> API::transcode(uint8_t source, uint8_t target, const char* bits, size_t count) {
+	return scheduler.transcode(channelPacket(source, bits, count, device.uses_parity), target);
+}
+
+
+void API::cancel(const Origin& origin) {
+	scheduler.cancel(origin);
+}
+
+
+size_t API::samples(int16_t* dst, size_t max, const Packet& response) const {
+	size_t n;
+
+	if (device.compand == Compand::NONE) {
+		auto ptr = response.samples(n);
+		if (max < n) throw runtime_error("Destination buffer too small to hold an audio frame");
+		memcpy(dst, ptr, n * sizeof(dst[0]));
+	} else {
+		auto ptr = response.companded(n);
+		if (max < n) throw runtime_error("Destination buffer too small to hold an audio frame");
+		g711::decode(dst, ptr, n, device.compand, true);
+	}
+	return n;
+}
+
+
+size_t API::companded(uint8_t* dst, size_t max, const Packet& response, Compand law) const {
+	size_t n;
+
+	if (device.compand == law) {
+		auto ptr = response.companded(n);
+		if (max < n) throw runtime_error("Destination buffer too small to hold an audio frame");
+		memcpy(dst, ptr, n);
+	} else if (device.compand == Compand::NONE) {
+		auto ptr = response.samples(n);
+		if (max < n) throw runtime_error("Destination buffer too small to hold an audio frame");
+		g711::encode(dst, ptr, n, law, true);
+	} else {
+		auto ptr = response.companded(n);
+		if (max < n) throw runtime_error("Destination buffer too small to hold an audio frame");
+		vector<int16_t> tmp(n);
+		g711::decode(tmp.data(), ptr, n, device.compand);
+		g711::encode(dst, tmp.data(), n, law);
+	}
+	return n;
 }
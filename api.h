@@ -24,11 +24,20 @@
 #include <stdint.h>
 #include <string.h>
 #include <vector>
+#include <array>
+#include <mutex>
+#include <memory>
+#include <optional>
+#include <functional>
 
 #include "queue.h"
 #include "device.h"
 #include "scheduler.h"
 #include "packet.h"
+#include "origin.h"
+#include "g711.h"
+#include "vad.h"
+#include "resample.h"
 
 using namespace std;
 
@@ -41,6 +50,10 @@ namespace ambe {
 	class Device;
 	class Scheduler;
 
+	// Also declared in scheduler.h, which may not have been fully processed
+	// yet due to the circular include via device.h.
+	typedef function<void (const Packet& packet)> ResponseCallback;
+
 	// A single frame, i.e., 20 ms of audio data in linear 16-bit *big endian*
 	// format.
 	typedef array<int16_t, FRAME_SIZE> AudioFrame;
@@ -98,12 +111,40 @@ namespace ambe {
 	ostream& operator<<(ostream& o, const Rate& rate);
 
 
+	struct VadStats {
+		uint64_t frames = 0;   // Frames classified by the voice activity detector
+		uint64_t skipped = 0;  // Frames answered from the cache without the chip
+	};
+
+
 	class API {
 	private:
 		Device& device;
 		Scheduler& scheduler;
 		bool check_parity;
 
+		// Optional per-channel voice activity gating in front of compress.
+		// Silent frames are answered with a cached AMBE frame produced by the
+		// chip for the first silent frame after the channel was configured.
+		struct Gate {
+			std::mutex mutex;
+			unique_ptr<VoiceActivityDetector> vad;
+			optional<Packet> silence;
+			unsigned int generation = 0;
+			VadStats stats;
+		};
+
+		static const unsigned int max_channels = 3;
+		array<Gate, max_channels> gates;
+
+		enum class GateResult { SPEECH, CACHED, SILENCE };
+
+		// For CACHED, the silence frame is copied into silence while the
+		// gate is locked, since the channel may be reconfigured right after
+		GateResult gate(uint8_t channel, const int16_t* samples, size_t count, unsigned int& generation, optional<Packet>& silence);
+		void submitSpeechAsync(uint8_t channel, const Packet& request, GateResult result, unsigned int generation, ResponseCallback callback, const Origin& origin);
+		void resetGate(uint8_t channel);
+
 		void setMode(uint8_t channel, FieldType type, bool ns_e, bool cp_s, bool cp_e, bool dtx_e, bool td_e, bool ts_e);
 
 		int toBytes(int bits);
@@ -130,7 +171,12 @@ namespace ambe {
 		*/
 		void paritymode(unsigned char mode);
 
+		/* Enable or disable companding of speech samples. When enabled, the
+		* AMBE-3003™ exchanges 8-bit µ-law or A-law samples with the host,
+		* which halves the size of SPEECH packets.
+		*/
 		void compand(bool enabled,  bool alaw);
+		void compand(Compand mode);
 
 		/* ns_e  : Noise Suppression Enable
 		* cp_s  : Compand Select
@@ -259,8 +305,67 @@ namespace ambe {
 
 		void init(uint8_t channel, bool encoder=true, bool decoder=true);
 
-		future<Packet> compress(uint8_t channel, const int16_t* samples, size_t count);
-		future<Packet> decompress(uint8_t channel, const char* bits, size_t count);
+		// Compress 16-bit linear big endian samples. If companding has been
+		// enabled in the chip, the samples are converted to G.711 on the host
+		// before the SPEECH packet is sent.
+		//
+		// All compress and decompress variants accept an optional origin
+		// which allows the caller to cancel the request later.
+		future<Packet> compress(uint8_t channel, const int16_t* samples, size_t count, const Origin& origin=Origin());
+
+		// Compress 8-bit G.711 samples companded with the given law. If the
+		// chip uses the same law, the samples are forwarded to the chip as
+		// they are, otherwise they are converted on the host.
+		future<Packet> compress(uint8_t channel, const uint8_t* samples, size_t count, Compand law, const Origin& origin=Origin());
+
+		// Compress one frame of audio read from a resampler converting to 8
+		// kHz. The resampler must have at least FRAME_SIZE samples available.
+		// The samples are computed directly into the request packet.
+		future<Packet> compress(uint8_t channel, Resampler& resampler, const Origin& origin=Origin());
+
+		// Enable or disable voice activity gating for compress requests on
+		// the given channel. With gating enabled, frames classified as
+		// silence do not reach the chip. They are answered with a cached
+		// AMBE frame instead.
+		void vad(uint8_t channel, bool enabled, const VadParams& params=VadParams());
+		VadStats vadStats(uint8_t channel);
+
+		future<Packet> decompress(uint8_t channel, const char* bits, size_t count, const Origin& origin=Origin());
+
+		// Callback variants of compress and decompress for event-driven
+		// callers. The callback is invoked with the response packet from the
+		// scheduler's thread (or synchronously for frames answered from the
+		// silence cache).
+		void compressAsync(uint8_t channel, const int16_t* samples, size_t count, ResponseCallback callback, const Origin& origin=Origin());
+		void decompressAsync(uint8_t channel, const char* bits, size_t count, ResponseCallback callback, const Origin& origin=Origin());
+
+		// Submit all frames of a superframe (e.g., 9 frames of a P25 LDU or 3
+		// frames of a DMR burst) back-to-back so that they are processed in
+		// a single pipelined batch. Frames are stored contiguously: samples
+		// with FRAME_SIZE samples per frame, bits with
+		// AmbeFrame::byteLength(count) bytes per frame. The returned
+		// futures are in frame order.
+		vector<future<Packet>> compressSuperframe(uint8_t channel, const int16_t* samples, size_t frames, const Origin& origin=Origin());
+		vector<future<Packet>> decompressSuperframe(uint8_t channel, const char* bits, size_t count, size_t frames, const Origin& origin=Origin());
+
+		// Decompress AMBE bits on the source channel and compress the result
+		// on the target channel. The two channels are typically configured
+		// with different rates. The returned CHANNEL packet comes from the
+		// target channel. Multiple frames can be submitted back-to-back; the
+		// decoder and encoder stages then run in parallel.
+		future<Packet> transcode(uint8_t source, uint8_t target, const char* bits, size_t count);
+
+		// Cancel the requests submitted with a matching origin, see
+		// Scheduler::cancel. Their futures and callbacks complete with an
+		// empty packet.
+		void cancel(const Origin& origin);
+
+		// Extract speech samples from a SPEECH packet returned by decompress
+		// into a caller provided buffer. The first variant produces 16-bit
+		// linear big endian samples, the second variant produces 8-bit G.711
+		// samples with the given law. Both return the number of samples.
+		size_t samples(int16_t* dst, size_t max, const Packet& response) const;
+		size_t companded(uint8_t* dst, size_t max, const Packet& response, Compand law) const;
 
 	};
 }
@@ -19,9 +19,21 @@
 
 #include "capi.h"
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/epoll.h>
+#include <deque>
+#include <atomic>
+#include <optional>
+#include <map>
+#include <thread>
+#include <condition_variable>
+#include <system_error>
 #include <grpc++/grpc++.h>
 #include "uri.h"
 #include "rpc.h"
+#include "shm.h"
 #include "serial.h"
 
 using namespace std;
@@ -32,38 +44,248 @@ extern "C" {
 #endif
 
 
+// A USB device opened by this process. The device and its scheduler are
+// shared by all handles opened with the same usb: URI. Each handle leases one
+// channel from the device manager. The device is shut down when the last
+// handle referring to it has been closed.
+struct LocalChip {
+	LocalChip(const string& pathname) :
+		device(pathname), scheduler(device, 3), api(device, scheduler) {
+	}
+
+	Usb3003 device;
+	MultiQueueScheduler scheduler;
+	API api;
+	size_t refs = 0;
+};
+
+
+static mutex registry_lock;
+static unordered_map<string, unique_ptr<LocalChip>> chips;
+static DeviceManager dev_manager;
+
+// How long to wait for the capacity of the servers named by a grpc: URI
+static const chrono::milliseconds capacity_timeout(1000);
+
+
 struct Client {
-	shared_ptr<grpc::Channel> channel;
-	RpcDevice* device = nullptr;
+	// Remote (gRPC and shared memory) handles own their device, scheduler,
+	// and API objects. gRPC handles opened with the same URI share a pooled
+	// connection.
+	shared_ptr<RpcConnection> connection;
+	TaggingDevice* device = nullptr;
 	Scheduler* scheduler = nullptr;
+
+	// Local (USB) handles refer to a chip from the registry instead
+	LocalChip* chip = nullptr;
+	string chip_id;
+
 	API* api = nullptr;
+	unsigned int channel = 0;
 	int deadline;
+
+	// Ids of the blocking calls in progress, see callOrigin
+	atomic<int64_t> calls{0};
+
+	// Optional sample rate converters configured with ambe_resample
+	unique_ptr<Resampler> encoder;
+	unique_ptr<Resampler> decoder;
+
+	shared_ptr<struct AsyncState> async;
 };
 
 
-void* ambe_open(const char* uri, const char* rate, int deadline) {
-	auto u = URI::parse(uri);
+// A request submitted with ambe_submit_compress or ambe_submit_decompress.
+// The caller-provided output buffers must remain valid until the request
+// completes.
+struct AsyncRequest {
+	int type;
+	chrono::steady_clock::time_point deadline;
+	char* bits;
+	size_t* bit_count;
+	int16_t* samples;
+	size_t* sample_count;
+};
 
-	if (u.type != UriType::GRPC)
-		throw logic_error("Currently, only gRPC devices are supported");
 
+// Asynchronous requests of a handle. The state is shared with completion
+// callbacks waiting in the scheduler, so that responses arriving after the
+// request has expired or after the handle has been closed can be dropped.
+// Completed requests are either reported to the callback configured with
+// ambe_set_callback, or queued for ambe_poll and signaled via the eventfd.
+// The timerfd is armed for the earliest deadline of the pending requests, so
+// that expired requests are signaled too. The epoll descriptor combines both
+// and is handed to the application (see ambe_eventfd). Once a callback has
+// been configured, the timer thread expires requests instead, since such an
+// application need not poll the handle.
+struct AsyncState {
+	mutex lock;
+	Client* client;
+	int64_t next_id = 1;
+	unordered_map<int64_t, AsyncRequest> pending;
+	deque<ambe_event> completed;
+	ambe_callback callback = nullptr;
+	void* arg = nullptr;
+	int efd = -1;
+	int tfd = -1;
+	int pfd = -1;
+	optional<chrono::steady_clock::time_point> armed;
+	condition_variable wakeup;
+	thread timer;
+	bool quit = false;
+};
+
+
+static LocalChip* startChip(const string& pathname) {
+	auto chip = make_unique<LocalChip>(pathname);
+	chip->device.start();
+	chip->scheduler.start();
+
+	try {
+		chip->api.reset(true);
+		chip->api.paritymode(false);
+		cout << "ambe: Found AMBE chip " << chip->api.prodid()
+			<< " version " << chip->api.verstring() << endl;
+		dev_manager.add(pathname, chip->device, chip->scheduler);
+	} catch(...) {
+		chip->scheduler.stop();
+		chip->device.stop();
+		throw;
+	}
+
+	auto rv = chip.get();
+	chips[pathname] = move(chip);
+	return rv;
+}
+
+
+static void openUsb(Client* c, const string& pathname) {
+	lock_guard<mutex> guard(registry_lock);
+
+	auto it = chips.find(pathname);
+	auto chip = it == chips.end() ? startChip(pathname) : it->second.get();
+
+	// Take the reference first so that the chip is shut down by ambe_close
+	// if leasing a channel fails below.
+	chip->refs++;
+	c->chip = chip;
+	c->chip_id = pathname;
+	c->channel = dev_manager.acquireChannel(pathname);
+	c->api = &chip->api;
+}
+
+
+static void closeUsb(Client* c) {
+	lock_guard<mutex> guard(registry_lock);
+
+	// The api pointer is only set once a channel has been leased
+	if (c->api) dev_manager.releaseChannel(c->chip_id, c->channel);
+	if (--c->chip->refs) return;
+
+	dev_manager.remove(c->chip_id);
+	c->chip->scheduler.stop();
+	c->chip->device.stop();
+	chips.erase(c->chip_id);
+}
+
+
+static MuxRpcDevice* bindGrpc(Client* c) {
+	// Prefer exchanging frames with the server. Servers that predate the
+	// frames call only understand packets.
+	MuxRpcDevice* device = new FrameRpcDevice(c->connection);
+	c->device = device;
+	try {
+		device->start();
+	} catch(const runtime_error& e) {
+		if (device->statusCode() != grpc::StatusCode::UNIMPLEMENTED) throw;
+		delete device;
+		c->device = device = new MuxRpcDevice(c->connection);
+		device->start();
+	}
+	return device;
+}
+
+
+static void openGrpc(Client* c, const string& authority) {
+	// Try the servers named by the URI in the order of their free capacity.
+	// If a server has no channels left or cannot be reached, move on to the
+	// next one.
+	auto servers = RpcConnection::balance(authority, capacity_timeout);
+	MuxRpcDevice* device = nullptr;
+
+	for (size_t i = 0; !device; i++) {
+		c->connection = servers[i];
+		try {
+			device = bindGrpc(c);
+		} catch(const runtime_error& e) {
+			auto failed = static_cast<MuxRpcDevice*>(c->device);
+			if (failed->statusCode() != grpc::StatusCode::UNAVAILABLE || i + 1 == servers.size()) throw;
+
+			cerr << "ambe: " << e.what() << ", trying another server" << endl;
+			delete failed;
+			c->device = nullptr;
+		}
+	}
+
+	c->scheduler = new FifoScheduler(*c->device);
+	c->api = new API(*c->device, *c->scheduler);
+	c->scheduler->start();
+	c->channel = device->channel;
+}
+
+
+static void openShm(Client* c, const string& path) {
+	auto device = new ShmDevice(path);
+	c->device = device;
+	device->start();
+
+	c->scheduler = new FifoScheduler(*c->device);
+	c->api = new API(*c->device, *c->scheduler);
+	c->scheduler->start();
+	c->channel = device->channel;
+}
+
+
+static Client* openClient(const string& uri, const string& rate, int deadline) {
+	auto u = URI::parse(uri);
 	Client* c = NULL;
 
 	try {
-		auto c = new Client;
+		c = new Client;
 		c->deadline = deadline;
 
-		c->channel = grpc::CreateChannel(u.authority, grpc::InsecureChannelCredentials());
-		c->device = new RpcDevice(c->channel);
-		c->scheduler = new FifoScheduler(*c->device);
-		c->api = new API(*c->device, *c->scheduler);
+		c->async = make_shared<AsyncState>();
+		c->async->client = c;
+		c->async->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (c->async->efd == -1)
+			throw system_error(errno, generic_category(), "Error while creating eventfd");
+
+		c->async->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (c->async->tfd == -1)
+			throw system_error(errno, generic_category(), "Error while creating timerfd");
 
-		c->device->start();
-		c->scheduler->start();
+		c->async->pfd = epoll_create1(EPOLL_CLOEXEC);
+		if (c->async->pfd == -1)
+			throw system_error(errno, generic_category(), "Error while creating epoll descriptor");
 
-		c->api->rate(c->device->channel, Rate(rate));
-		c->api->init(c->device->channel);
-		cout << "ambe: Using channel " << c->device->channel << endl;
+		for (int fd : {c->async->efd, c->async->tfd}) {
+			epoll_event ev = {};
+			ev.events = EPOLLIN;
+			ev.data.fd = fd;
+			if (epoll_ctl(c->async->pfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+				throw system_error(errno, generic_category(), "Error while adding descriptor to epoll");
+		}
+
+		switch(u.type) {
+		case UriType::USB:  openUsb(c, u.authority);  break;
+		case UriType::GRPC: openGrpc(c, u.authority); break;
+		case UriType::SHM:  openShm(c, u.authority);  break;
+		default: throw logic_error("Unsupported URI scheme " + u.scheme);
+		}
+
+		c->api->rate(c->channel, Rate(rate.c_str()));
+		c->api->init(c->channel);
+		cout << "ambe: Using channel " << c->channel << endl;
 		return c;
 	} catch(...) {
 		ambe_close(c);
@@ -72,39 +294,805 @@ void* ambe_open(const char* uri, const char* rate, int deadline) {
 }
 
 
+// Handles opened and initialized in the background ahead of time, see
+// ambe_pool. The pool's thread also serves ambe_open_async requests that
+// cannot be satisfied from the pool.
+class Pool {
+public:
+	~Pool();
+
+	void configure(const string& uri, const string& rate, size_t size);
+	Client* take(const string& uri, const string& rate);
+	void submit(function<void()> job);
+
+private:
+	struct Entry {
+		size_t size = 0;
+		size_t opening = 0;
+		deque<Client*> ready;
+		chrono::steady_clock::time_point retry;
+	};
+
+	void run();
+	void refill(const pair<string, string>& key, Entry& entry, unique_lock<std::mutex>& lock);
+	bool hasWork(chrono::steady_clock::time_point& wakeup);
+
+	std::mutex mutex;
+	condition_variable cond;
+	map<pair<string, string>, Entry> entries;
+	deque<function<void()>> jobs;
+	bool quit = false;
+	thread worker;
+};
+
+static Pool pool;
+
+
+void* ambe_open(const char* uri, const char* rate, int deadline) {
+	Client* c = pool.take(uri, rate);
+	if (c) {
+		c->deadline = deadline;
+		return c;
+	}
+	return openClient(uri, rate, deadline);
+}
+
+
+void ambe_open_async(const char* uri, const char* rate, int deadline, ambe_open_callback callback, void* arg) {
+	Client* c = pool.take(uri, rate);
+	if (c) {
+		c->deadline = deadline;
+		callback(arg, c);
+		return;
+	}
+
+	pool.submit([uri = string(uri), rate = string(rate), deadline, callback, arg]() {
+		Client* c = NULL;
+		try {
+			c = openClient(uri, rate, deadline);
+		} catch(const exception& e) {
+			cerr << "ambe: Error while opening " << uri << ": " << e.what() << endl;
+		}
+		callback(arg, c);
+	});
+}
+
+
+void ambe_pool(const char* uri, const char* rate, size_t size) {
+	// Validate the URI here so that the caller gets an error right away
+	auto u = URI::parse(uri);
+	if (u.type == UriType::UNKNOWN)
+		throw logic_error("Unsupported URI scheme " + u.scheme);
+
+	pool.configure(uri, rate, size);
+}
+
+
 void ambe_close(void *handle) {
 	Client* c = static_cast<Client*>(handle);
 
 	if (c) {
-		if (c->scheduler) c->scheduler->stop();
-		if (c->device) c->device->stop();
+		// Drop all pending asynchronous requests. Their responses will be
+		// ignored if they arrive later.
+		if (c->async) {
+			lock_guard<mutex> guard(c->async->lock);
+			c->async->quit = true;
+			c->async->wakeup.notify_all();
+			c->async->client = nullptr;
+			c->async->pending.clear();
+			c->async->completed.clear();
+			c->async->callback = nullptr;
+			for (int* fd : {&c->async->efd, &c->async->tfd, &c->async->pfd}) {
+				if (*fd != -1) close(*fd);
+				*fd = -1;
+			}
+		}
+
+		// The callback may close the handle from the timer thread itself.
+		// The thread holds on to the state and exits once it returns.
+		if (c->async && c->async->timer.joinable()) {
+			if (c->async->timer.get_id() == this_thread::get_id()) c->async->timer.detach();
+			else c->async->timer.join();
+		}
 
-		if (c->api) delete c->api;
-		if (c->scheduler) delete c->scheduler;
-		if (c->device) delete c->device;
+		// Purge whatever the handle still has queued in the scheduler or on
+		// the server
+		if (c->api) c->api->cancel({c, Origin::ALL});
+
+		if (c->chip) {
+			closeUsb(c);
+		} else {
+			if (c->scheduler) c->scheduler->stop();
+
+			// The device reports the status of a stream that the server has
+			// broken off. There is nobody to report it to anymore.
+			try {
+				if (c->device) c->device->stop();
+			} catch(const exception& e) {}
+
+			if (c->api) delete c->api;
+			if (c->scheduler) delete c->scheduler;
+			if (c->device) delete c->device;
+		}
 		delete c;
 	}
 }
 
 
-int ambe_compress(char* bits, size_t* bit_count, void* handle, const int16_t* samples, size_t sample_count) {
+Pool::~Pool() {
+	{
+		lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	cond.notify_all();
+	if (worker.joinable()) worker.join();
+
+	for (auto& entry : entries) {
+		for (auto c : entry.second.ready) {
+			try {
+				ambe_close(c);
+			} catch(const exception& e) {
+				cerr << "ambe: Error while closing pooled handle: " << e.what() << endl;
+			}
+		}
+	}
+}
+
+
+void Pool::configure(const string& uri, const string& rate, size_t size) {
+	vector<Client*> surplus;
+	{
+		lock_guard<std::mutex> lock(mutex);
+		auto& entry = entries[make_pair(uri, rate)];
+		entry.size = size;
+		entry.retry = chrono::steady_clock::time_point();
+
+		while (entry.ready.size() > size) {
+			surplus.push_back(entry.ready.back());
+			entry.ready.pop_back();
+		}
+
+		if (!worker.joinable()) worker = thread(&Pool::run, this);
+	}
+	cond.notify_all();
+
+	for (auto c : surplus) ambe_close(c);
+}
+
+
+Client* Pool::take(const string& uri, const string& rate) {
+	Client* c = NULL;
+	{
+		lock_guard<std::mutex> lock(mutex);
+		auto it = entries.find(make_pair(uri, rate));
+		if (it == entries.end() || it->second.ready.empty()) return NULL;
+
+		c = it->second.ready.front();
+		it->second.ready.pop_front();
+	}
+
+	// Start opening a replacement
+	cond.notify_all();
+	return c;
+}
+
+
+void Pool::submit(function<void()> job) {
+	{
+		lock_guard<std::mutex> lock(mutex);
+		jobs.push_back(move(job));
+		if (!worker.joinable()) worker = thread(&Pool::run, this);
+	}
+	cond.notify_all();
+}
+
+
+// Return true if there is anything to do right now. Otherwise, store the time
+// of the next retry of a failed refill in wakeup.
+bool Pool::hasWork(chrono::steady_clock::time_point& wakeup) {
+	if (quit || !jobs.empty()) return true;
+
+	auto now = chrono::steady_clock::now();
+	wakeup = chrono::steady_clock::time_point::max();
+
+	for (auto& entry : entries) {
+		auto& e = entry.second;
+		if (e.ready.size() + e.opening >= e.size) continue;
+		if (e.retry <= now) return true;
+		wakeup = min(wakeup, e.retry);
+	}
+	return false;
+}
+
+
+void Pool::run() {
+	unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		chrono::steady_clock::time_point wakeup;
+		while (!hasWork(wakeup)) {
+			if (wakeup == chrono::steady_clock::time_point::max()) cond.wait(lock);
+			else cond.wait_until(lock, wakeup);
+		}
+		if (quit) break;
+
+		// Requests from ambe_open_async take priority over refilling
+		if (!jobs.empty()) {
+			auto job = move(jobs.front());
+			jobs.pop_front();
+			lock.unlock();
+			job();
+			lock.lock();
+			continue;
+		}
+
+		auto now = chrono::steady_clock::now();
+		for (auto& entry : entries) {
+			auto& e = entry.second;
+			if (e.ready.size() + e.opening < e.size && e.retry <= now) {
+				refill(entry.first, e, lock);
+				break;
+			}
+		}
+	}
+}
+
+
+// Open one handle for the given pool entry. Called with the lock held, the
+// lock is released while the handle is being opened.
+void Pool::refill(const pair<string, string>& key, Entry& entry, unique_lock<std::mutex>& lock) {
+	Client* c = NULL;
+
+	entry.opening++;
+	lock.unlock();
+	try {
+		c = openClient(key.first, key.second, 0);
+	} catch(const exception& e) {
+		cerr << "ambe: Error while opening pooled handle for " << key.first << ": " << e.what() << endl;
+	}
+	lock.lock();
+	entry.opening--;
+
+	if (!c) {
+		// Do not retry right away, the server may be out of channels
+		entry.retry = chrono::steady_clock::now() + chrono::seconds(1);
+		return;
+	}
+
+	if (entry.ready.size() < entry.size) {
+		entry.ready.push_back(c);
+		return;
+	}
+
+	// The pool has been shrunk in the meantime
+	lock.unlock();
+	ambe_close(c);
+	lock.lock();
+}
+
+
+int ambe_resample(void* handle, unsigned int rate, unsigned int channels) {
 	Client* c = static_cast<Client*>(handle);
+
+	if (!Resampler::supported(rate) || channels < 1 || channels > 2)
+		return -1;
+
+	if (rate == SAMPLE_RATE && channels == 1) {
+		c->encoder.reset();
+		c->decoder.reset();
+	} else {
+		c->encoder = make_unique<Resampler>(rate, SAMPLE_RATE, channels);
+		c->decoder = make_unique<Resampler>(SAMPLE_RATE, rate);
+	}
+	return 0;
+}
+
+
+// Copy the AMBE bits from a CHANNEL response into the caller's buffer. On
+// input, bit_count is the capacity of the buffer in bits.
+static void storeBits(char* bits, size_t* bit_count, const Packet& packet) {
 	size_t n;
+	auto ptr = packet.bits(n);
+	if ((*bit_count) < n) throw logic_error("Destionation buffer too small to hold AMBE bits");
+
+	memcpy(bits, ptr, AmbeFrame::byteLength(n));
+	*bit_count = n;
+}
+
+
+// Copy the samples from a SPEECH response into the caller's buffer in host
+// byte order, converting the audio to the rate configured with ambe_resample.
+static void storeSamples(Client* c, int16_t* samples, size_t* sample_count, const Packet& packet) {
+	// The samples are expanded from G.711 here if the chip uses companding
+	if (c->decoder) {
+		AudioFrame frame;
+		auto n = c->api->samples(frame.data(), frame.size(), packet);
+		c->decoder->push(frame.data(), n, true);
+
+		// The decoded audio is mono. Duplicate it into all channels the
+		// caller configured with ambe_resample.
+		unsigned int channels = c->encoder->inputChannels();
+		n = c->decoder->read(samples, *sample_count / channels);
+		for (size_t i = n; i-- > 0;)
+			for (unsigned int ch = 0; ch < channels; ch++)
+				samples[i * channels + ch] = samples[i];
+
+		*sample_count = n * channels;
+		return;
+	}
+
+	auto n = c->api->samples(samples, *sample_count, packet);
+
+	swap(samples, samples, n);
+	*sample_count = n;
+}
 
+
+// Each blocking call submits its requests with an id of its own in the
+// handle's origin. The ids are negative, asynchronous requests use their
+// (positive) request id. Requests are cancelled once the caller has given up
+// on them, so that they no longer occupy the chip. Other threads' calls on
+// the same handle are not affected.
+static Origin callOrigin(Client* c) {
+	return {c, -++c->calls};
+}
+
+
+static int timeout(Client* c, const Origin& origin) {
+	c->api->cancel(origin);
+	return -1;
+}
+
+
+// Requests that the server did not process complete with an empty packet.
+// Returns the status to report for such a request (AMBE_BUSY if the client
+// has exceeded its quota), or zero if the request has been processed.
+static int rejected(const Packet& packet) {
+	if (packet.payloadLength()) return 0;
+	return packet.isBusy() ? AMBE_BUSY : -1;
+}
+
+
+int ambe_compress(char* bits, size_t* bit_count, void* handle, const int16_t* samples, size_t sample_count) {
+	Client* c = static_cast<Client*>(handle);
+	auto origin = callOrigin(c);
+	future<Packet> future;
+
+	if (c->encoder) {
+		// With a sample rate converter, the input can have any length. The
+		// converted audio is re-chunked into 20 ms frames and at most one
+		// frame is compressed per call.
+		c->encoder->push(samples, sample_count / c->encoder->inputChannels());
+		if (c->encoder->available() < FRAME_SIZE) {
+			*bit_count = 0;
+			return 0;
+		}
+		future = c->api->compress(c->channel, *c->encoder, origin);
+	} else {
+		AudioFrame frame;
+		if (sample_count != frame.size())
+			throw logic_error("Only " + to_string(frame.size()) + " sample frames are supported");
+
+		swap(frame.data(), samples, sample_count);
+		future = c->api->compress(c->channel, frame.data(), sample_count, origin);
+	}
+
+	auto status = future.wait_for(chrono::milliseconds(c->deadline));
+	if (status != future_status::ready) return timeout(c, origin);
+
+	auto packet = future.get();
+	if (auto rv = rejected(packet)) return rv;
+
+	storeBits(bits, bit_count, packet);
+	return 0;
+}
+
+
+int ambe_decompress(int16_t* samples, size_t* sample_count, void* handle, const char* bits, size_t bit_count) {
+	Client* c = static_cast<Client*>(handle);
+	auto origin = callOrigin(c);
+
+	auto future = c->api->decompress(c->channel, bits, bit_count, origin);
+	auto status = future.wait_for(chrono::milliseconds(c->deadline));
+	if (status != future_status::ready) return timeout(c, origin);
+
+	auto packet = future.get();
+	if (auto rv = rejected(packet)) return rv;
+
+	storeSamples(c, samples, sample_count, packet);
+	return 0;
+}
+
+
+// Report a completed asynchronous request. Must be called with the lock held.
+// Returns true if the event must be passed to the callback by the caller
+// after the lock has been released.
+static bool report(AsyncState& state, const ambe_event& event) {
+	if (state.callback) return true;
+
+	state.completed.push_back(event);
+	uint64_t one = 1;
+	if (write(state.efd, &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+		throw system_error(errno, generic_category(), "Error while writing to eventfd");
+	return false;
+}
+
+
+static void complete(const shared_ptr<AsyncState>& state, int64_t id, const Packet& packet) {
+	ambe_event event;
+	ambe_callback callback;
+	void* arg;
+
+	{
+		lock_guard<mutex> guard(state->lock);
+
+		// The request has expired or the handle has been closed
+		auto it = state->pending.find(id);
+		if (it == state->pending.end()) return;
+
+		auto& r = it->second;
+		event.id = id;
+		event.type = r.type;
+		event.status = rejected(packet);
+
+		if (!event.status) {
+			try {
+				if (r.type == AMBE_COMPRESS) storeBits(r.bits, r.bit_count, packet);
+				else storeSamples(state->client, r.samples, r.sample_count, packet);
+			} catch(const exception& e) {
+				event.status = -1;
+			}
+		}
+		state->pending.erase(it);
+
+		if (!report(*state, event)) return;
+		callback = state->callback;
+		arg = state->arg;
+	}
+
+	callback(arg, &event);
+}
+
+
+// Arm the timerfd for the given deadline, or disarm it if there is none. Must
+// be called with the lock held.
+static void arm(AsyncState& state, optional<chrono::steady_clock::time_point> deadline) {
+	itimerspec spec = {};
+	if (deadline) {
+		// A zero value would disarm the timer, fire right away instead
+		auto ns = chrono::duration_cast<chrono::nanoseconds>(*deadline - chrono::steady_clock::now()).count();
+		if (ns < 1) ns = 1;
+		spec.it_value.tv_sec = ns / 1000000000;
+		spec.it_value.tv_nsec = ns % 1000000000;
+	}
+
+	if (timerfd_settime(state.tfd, 0, &spec, nullptr) == -1)
+		throw system_error(errno, generic_category(), "Error while arming timerfd");
+	state.armed = deadline;
+	state.wakeup.notify_all();
+}
+
+
+// Fail all pending requests whose deadline has passed. Their responses will
+// be dropped if they arrive later. The timer is re-armed for the earliest
+// deadline left.
+static void expire(AsyncState& state) {
+	vector<ambe_event> events;
+	vector<int64_t> expired;
+	Client* client;
+	ambe_callback callback;
+	void* arg;
+
+	{
+		lock_guard<mutex> guard(state.lock);
+		auto now = chrono::steady_clock::now();
+		optional<chrono::steady_clock::time_point> next;
+
+		for (auto it = state.pending.begin(); it != state.pending.end();) {
+			if (it->second.deadline > now) {
+				if (!next || it->second.deadline < *next) next = it->second.deadline;
+				++it;
+				continue;
+			}
+
+			ambe_event event;
+			event.id = it->first;
+			event.type = it->second.type;
+			event.status = -1;
+			if (report(state, event)) events.push_back(event);
+			expired.push_back(it->first);
+			it = state.pending.erase(it);
+		}
+		if (state.tfd != -1 && next != state.armed) arm(state, next);
+
+		client = state.client;
+		callback = state.callback;
+		arg = state.arg;
+	}
+
+	// Cancel outside of the lock, the scheduler may invoke the completion
+	// callbacks right away
+	for (auto id : expired) client->api->cancel({client, id});
+	for (auto& event : events) callback(arg, &event);
+}
+
+
+// Expire the requests of a handle that reports to a callback, at the deadline
+// the timerfd is armed for.
+static void runTimer(shared_ptr<AsyncState> state) {
+	unique_lock<mutex> guard(state->lock);
+	while (!state->quit) {
+		if (!state->armed) {
+			state->wakeup.wait(guard);
+		} else if (chrono::steady_clock::now() < *state->armed) {
+			state->wakeup.wait_until(guard, *state->armed);
+		} else {
+			guard.unlock();
+			try {
+				expire(*state);
+			} catch(const exception& e) {
+				cerr << "ambe: Error while expiring requests: " << e.what() << endl;
+			}
+			guard.lock();
+		}
+	}
+}
+
+
+static int64_t enqueue(Client* c, AsyncRequest&& request) {
+	lock_guard<mutex> guard(c->async->lock);
+
+	request.deadline = chrono::steady_clock::now() + chrono::milliseconds(c->deadline);
+	if (!c->async->armed || request.deadline < *c->async->armed)
+		arm(*c->async, request.deadline);
+
+	auto id = c->async->next_id++;
+	c->async->pending.emplace(id, move(request));
+	return id;
+}
+
+
+static void cancel(Client* c, int64_t id) {
+	lock_guard<mutex> guard(c->async->lock);
+	c->async->pending.erase(id);
+}
+
+
+int64_t ambe_submit_compress(char* bits, size_t* bit_count, void* handle, const int16_t* samples, size_t sample_count) {
+	Client* c = static_cast<Client*>(handle);
 	AudioFrame frame;
-	if (sample_count != frame.size())
-		throw logic_error("Only " + to_string(frame.size()) + " sample frames are supported");
 
-	swap(frame.data(), samples, sample_count);
+	expire(*c->async);
 
-	auto future = c->api->compress(c->device->channel, frame.data(), sample_count);
+	if (c->encoder) {
+		c->encoder->push(samples, sample_count / c->encoder->inputChannels());
+		if (c->encoder->available() < FRAME_SIZE) {
+			// Not enough audio for a frame yet. Complete the request right
+			// away with no bits.
+			*bit_count = 0;
+			ambe_event event = {0, AMBE_COMPRESS, 0};
+			ambe_callback callback;
+			void* arg;
+			{
+				lock_guard<mutex> guard(c->async->lock);
+				event.id = c->async->next_id++;
+				if (!report(*c->async, event)) return event.id;
+				callback = c->async->callback;
+				arg = c->async->arg;
+			}
+			callback(arg, &event);
+			return event.id;
+		}
+		c->encoder->read(frame.data(), frame.size(), true);
+	} else {
+		if (sample_count != frame.size())
+			throw logic_error("Only " + to_string(frame.size()) + " sample frames are supported");
+		swap(frame.data(), samples, sample_count);
+	}
+
+	auto id = enqueue(c, {AMBE_COMPRESS, {}, bits, bit_count, nullptr, nullptr});
+	try {
+		auto state = c->async;
+		c->api->compressAsync(c->channel, frame.data(), frame.size(), [state, id](const Packet& response) {
+			complete(state, id, response);
+		}, {c, id});
+	} catch(...) {
+		cancel(c, id);
+		throw;
+	}
+	return id;
+}
+
+
+int64_t ambe_submit_decompress(int16_t* samples, size_t* sample_count, void* handle, const char* bits, size_t bit_count) {
+	Client* c = static_cast<Client*>(handle);
+
+	expire(*c->async);
+
+	auto id = enqueue(c, {AMBE_DECOMPRESS, {}, nullptr, nullptr, samples, sample_count});
+	try {
+		auto state = c->async;
+		c->api->decompressAsync(c->channel, bits, bit_count, [state, id](const Packet& response) {
+			complete(state, id, response);
+		}, {c, id});
+	} catch(...) {
+		cancel(c, id);
+		throw;
+	}
+	return id;
+}
+
+
+int ambe_poll(void* handle, struct ambe_event* events, size_t max) {
+	Client* c = static_cast<Client*>(handle);
+	auto& state = *c->async;
+
+	// Consume the timer expiration, expire() re-arms the timer if needed
+	uint64_t expirations;
+	if (read(state.tfd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+		throw system_error(errno, generic_category(), "Error while reading from timerfd");
+
+	expire(state);
+
+	lock_guard<mutex> guard(state.lock);
+	size_t n = 0;
+	while (n < max && !state.completed.empty()) {
+		events[n++] = state.completed.front();
+		state.completed.pop_front();
+	}
+
+	// Reset the eventfd counter once all events have been consumed. The
+	// eventfd remains readable while there are events left in the queue.
+	if (state.completed.empty()) {
+		uint64_t count;
+		if (read(state.efd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+			throw system_error(errno, generic_category(), "Error while reading from eventfd");
+	}
+
+	return n;
+}
+
+
+int ambe_eventfd(void* handle) {
+	Client* c = static_cast<Client*>(handle);
+	return c->async->pfd;
+}
+
+
+void ambe_set_callback(void* handle, ambe_callback callback, void* arg) {
+	Client* c = static_cast<Client*>(handle);
+	lock_guard<mutex> guard(c->async->lock);
+	c->async->callback = callback;
+	c->async->arg = arg;
+
+	if (callback && !c->async->timer.joinable())
+		c->async->timer = thread(runTimer, c->async);
+}
+
+
+// The superframe variants submit all frames at once and wait for the results
+// with a single deadline. The status of each frame is stored in the array
+// status (0 on success, -1 on timeout or if the server rejected the frame,
+// AMBE_BUSY if the client has exceeded its quota).
+// The functions return -1 if any of the frames failed. Frames that failed are filled with silence (decompression)
+// or zero bits (compression).
+
+int ambe_compress_superframe(char* bits, size_t* bit_count, int* status, void* handle, const int16_t* samples, size_t frames) {
+	Client* c = static_cast<Client*>(handle);
+	auto origin = callOrigin(c);
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(c->deadline);
+
+	// On input, bit_count is the capacity of each frame in bits. It also
+	// determines the distance between frames in the destination buffer.
+	size_t capacity = *bit_count;
+	size_t stride = AmbeFrame::byteLength(capacity);
+	size_t bits_per_frame = 0;
+
+	vector<int16_t> tmp(frames * FRAME_SIZE);
+	swap(tmp.data(), samples, tmp.size());
+
+	auto futures = c->api->compressSuperframe(c->channel, tmp.data(), frames, origin);
+
+	int rv = 0;
+	bool expired = false;
+	for (size_t i = 0; i < frames; i++) {
+		char* dst = bits + i * stride;
+
+		if (futures[i].wait_until(deadline) != future_status::ready) {
+			memset(dst, 0, stride);
+			status[i] = -1;
+			rv = -1;
+			expired = true;
+			continue;
+		}
+
+		size_t n;
+		auto packet = futures[i].get();
+		if (auto error = rejected(packet)) {
+			memset(dst, 0, stride);
+			status[i] = error;
+			rv = -1;
+			continue;
+		}
+
+		auto ptr = packet.bits(n);
+		if (capacity < n) throw logic_error("Destionation buffer too small to hold AMBE bits");
+
+		memcpy(dst, ptr, AmbeFrame::byteLength(n));
+		bits_per_frame = n;
+		status[i] = 0;
+	}
+
+	*bit_count = bits_per_frame;
+	return expired ? timeout(c, origin) : rv;
+}
+
+
+int ambe_decompress_superframe(int16_t* samples, size_t* sample_count, int* status, void* handle, const char* bits, size_t bit_count, size_t frames) {
+	Client* c = static_cast<Client*>(handle);
+	auto origin = callOrigin(c);
+	auto deadline = chrono::steady_clock::now() + chrono::milliseconds(c->deadline);
+
+	if (*sample_count < frames * FRAME_SIZE)
+		throw logic_error("Destionation buffer too small to hold " + to_string(frames) + " audio frames");
+
+	auto futures = c->api->decompressSuperframe(c->channel, bits, bit_count, frames, origin);
+
+	int rv = 0;
+	bool expired = false;
+	for (size_t i = 0; i < frames; i++) {
+		int16_t* dst = samples + i * FRAME_SIZE;
+
+		if (futures[i].wait_until(deadline) != future_status::ready) {
+			memset(dst, 0, FRAME_SIZE * sizeof(dst[0]));
+			status[i] = -1;
+			rv = -1;
+			expired = true;
+			continue;
+		}
+
+		auto packet = futures[i].get();
+		if (auto error = rejected(packet)) {
+			memset(dst, 0, FRAME_SIZE * sizeof(dst[0]));
+			status[i] = error;
+			rv = -1;
+			continue;
+		}
+
+		auto n = c->api->samples(dst, FRAME_SIZE, packet);
+		swap(dst, dst, n);
+		status[i] = 0;
+	}
+
+	*sample_count = frames * FRAME_SIZE;
+	return expired ? timeout(c, origin) : rv;
+}
+
+
+static Compand toCompand(int law) {
+	switch(law) {
+	case AMBE_ULAW: return Compand::ULAW;
+	case AMBE_ALAW: return Compand::ALAW;
+	default: throw logic_error("Unsupported G.711 law " + to_string(law));
+	}
+}
+
+
+int ambe_compress_g711(char* bits, size_t* bit_count, void* handle, const uint8_t* samples, size_t sample_count, int law) {
+	Client* c = static_cast<Client*>(handle);
+	auto origin = callOrigin(c);
+	size_t n;
+
+	if (sample_count != FRAME_SIZE)
+		throw logic_error("Only " + to_string(FRAME_SIZE) + " sample frames are supported");
+
+	auto future = c->api->compress(c->channel, samples, sample_count, toCompand(law), origin);
 	auto status = future.wait_for(chrono::milliseconds(c->deadline));
-	if (status != future_status::ready) return -1;
+	if (status != future_status::ready) return timeout(c, origin);
 
-	// Note: we need to create the packet object here on the stack to ensure
-	// that the pointer returned by packet.bits() remains valid until the memcpy
-	// command below is reached.
 	auto packet = future.get();
+	if (auto rv = rejected(packet)) return rv;
+
 	auto ptr = packet.bits(n);
 	if ((*bit_count) < n) throw logic_error("Destionation buffer too small to hold AMBE bits");
 
@@ -114,26 +1102,34 @@ int ambe_compress(char* bits, size_t* bit_count, void* handle, const int16_t* sa
 }
 
 
-int ambe_decompress(int16_t* samples, size_t* sample_count, void* handle, const char* bits, size_t bit_count) {
+int ambe_decompress_g711(uint8_t* samples, size_t* sample_count, void* handle, const char* bits, size_t bit_count, int law) {
 	Client* c = static_cast<Client*>(handle);
-	size_t n;
+	auto origin = callOrigin(c);
 
-	auto future = c->api->decompress(c->device->channel, bits, bit_count);
+	auto future = c->api->decompress(c->channel, bits, bit_count, origin);
 	auto status = future.wait_for(chrono::milliseconds(c->deadline));
-	if (status != future_status::ready) return -1;
+	if (status != future_status::ready) return timeout(c, origin);
 
-	// Note: we need to create the packet object here on the stack to ensure
-	// that the pointer returned by packet.samples() remains valid until the
-	// memcpy command below is reached.
 	auto packet = future.get();
-	auto ptr = packet.samples(n);
-	if ((*sample_count) < n) throw logic_error("Destionation buffer too small to hold an audio frame");
+	if (auto rv = rejected(packet)) return rv;
 
-	swap(samples, ptr, n);
-	*sample_count = n;
+	*sample_count = c->api->companded(samples, *sample_count, packet, toCompand(law));
 	return 0;
 }
 
+void ambe_vad(void* handle, int enabled) {
+	Client* c = static_cast<Client*>(handle);
+	c->api->vad(c->channel, enabled);
+}
+
+
+void ambe_vad_stats(void* handle, uint64_t* frames, uint64_t* skipped) {
+	Client* c = static_cast<Client*>(handle);
+	auto stats = c->api->vadStats(c->channel);
+	*frames = stats.frames;
+	*skipped = stats.skipped;
+}
+
 #ifdef __cplusplus
 }
 #endif
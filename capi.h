@@ -25,11 +25,59 @@
 extern "C" {
 #endif
 
+/* The number of voice frames in a P25 LDU and in a DMR voice burst */
+#define AMBE_P25_LDU_FRAMES 9
+#define AMBE_DMR_BURST_FRAMES 3
+
+/* G.711 companding laws for ambe_compress_g711 and ambe_decompress_g711 */
+#define AMBE_ULAW 1
+#define AMBE_ALAW 2
+
+/* Request types reported in struct ambe_event */
+#define AMBE_COMPRESS   1
+#define AMBE_DECOMPRESS 2
+
+/* Returned by the compress and decompress functions (and reported as the
+ * status of asynchronous requests and superframe frames) if the server has
+ * rejected the request because the client has exceeded its quota. The
+ * client should back off before it submits more requests. */
+#define AMBE_BUSY -2
+
+/* A completed asynchronous request */
+struct ambe_event {
+	int64_t id;   /* The id returned by ambe_submit_compress/decompress */
+	int type;     /* AMBE_COMPRESS or AMBE_DECOMPRESS */
+	int status;   /* 0 on success, -1 on timeout or error, AMBE_BUSY */
+};
+
+typedef void (*ambe_callback)(void* arg, const struct ambe_event* event);
+
+typedef void (*ambe_open_callback)(void* arg, void* handle);
+
 void* ambe_open      (const char* uri, const char* rate, int deadline);
+void  ambe_open_async(const char* uri, const char* rate, int deadline, ambe_open_callback callback, void* arg);
+void  ambe_pool      (const char* uri, const char* rate, size_t size);
 void  ambe_close     (void* handle);
 int   ambe_compress  (char* bits, size_t* bit_count, void* handle, const int16_t* samples, size_t sample_count);
 int   ambe_decompress(int16_t* samples, size_t* sample_count, void* handle, const char* bits, size_t bit_count);
 
+int64_t ambe_submit_compress  (char* bits, size_t* bit_count, void* handle, const int16_t* samples, size_t sample_count);
+int64_t ambe_submit_decompress(int16_t* samples, size_t* sample_count, void* handle, const char* bits, size_t bit_count);
+int     ambe_poll             (void* handle, struct ambe_event* events, size_t max);
+int     ambe_eventfd          (void* handle);
+void    ambe_set_callback     (void* handle, ambe_callback callback, void* arg);
+
+int   ambe_compress_g711  (char* bits, size_t* bit_count, void* handle, const uint8_t* samples, size_t sample_count, int law);
+int   ambe_decompress_g711(uint8_t* samples, size_t* sample_count, void* handle, const char* bits, size_t bit_count, int law);
+
+int   ambe_compress_superframe  (char* bits, size_t* bit_count, int* status, void* handle, const int16_t* samples, size_t frames);
+int   ambe_decompress_superframe(int16_t* samples, size_t* sample_count, int* status, void* handle, const char* bits, size_t bit_count, size_t frames);
+
+int   ambe_resample (void* handle, unsigned int rate, unsigned int channels);
+
+void  ambe_vad      (void* handle, int enabled);
+void  ambe_vad_stats(void* handle, uint64_t* frames, uint64_t* skipped);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,11 +19,16 @@
 
 #include "device.h"
 #include <iostream>
+#include <algorithm>
 
 using namespace ambe;
 using namespace std;
 
 
+DeviceManager::DeviceManager() {
+}
+
+
 DeviceManager::DeviceManager(const string& id, Device& device, Scheduler& scheduler) {
 	add(id, device, scheduler);
 }
@@ -41,6 +46,8 @@ DeviceManager::~DeviceManager() {
 
 
 void DeviceManager::add(const string& id, Device& device, Scheduler& scheduler) {
+	lock_guard<mutex> guard(lock);
+
 	if (devices.find(id) == devices.end()) {
 		vector<bool> channels(device.channels(), false);
 		devices.insert({id, forward_as_tuple(ref(device), ref(scheduler), channels)});
@@ -53,7 +60,17 @@ void DeviceManager::add(const string& id, Device& device, Scheduler& scheduler)
 }
 
 
+void DeviceManager::remove(const string& id) {
+	lock_guard<mutex> guard(lock);
+
+	if (!devices.erase(id))
+		throw runtime_error("AMBE chip " + id + " not found");
+}
+
+
 pair<string, size_t> DeviceManager::acquireChannel() {
+	lock_guard<mutex> guard(lock);
+
 	for (auto& device : devices) {
 		auto& channels = get<2>(device.second);
 		for (size_t i = 0; i < channels.size(); i++) {
@@ -68,7 +85,61 @@ pair<string, size_t> DeviceManager::acquireChannel() {
 }
 
 
+// Acquire a channel on the given device
+size_t DeviceManager::acquireChannel(const string& id) {
+	lock_guard<mutex> guard(lock);
+
+	auto it = devices.find(id);
+	if (it == devices.end()) throw runtime_error("AMBE chip " + id + " not found");
+
+	auto& channels = get<2>(it->second);
+	for (size_t i = 0; i < channels.size(); i++) {
+		if (!channels[i]) {
+			channels[i] = true;
+			return i;
+		}
+	}
+
+	throw runtime_error("No channels left in AMBE chip " + id);
+}
+
+
+// Acquire the given number of channels on a single device. Requests that need
+// several channels at once (e.g., transcoding) must not be split across
+// devices because the channels are driven by the same scheduler.
+pair<string, vector<size_t>> DeviceManager::acquireChannels(size_t count) {
+	lock_guard<mutex> guard(lock);
+
+	for (auto& device : devices) {
+		auto& channels = get<2>(device.second);
+		vector<size_t> free;
+
+		for (size_t i = 0; i < channels.size() && free.size() < count; i++)
+			if (!channels[i]) free.push_back(i);
+
+		if (free.size() < count) continue;
+
+		for (auto i : free) channels[i] = true;
+		return make_pair(device.first, free);
+	}
+
+	throw runtime_error("No channels left");
+}
+
+
+void DeviceManager::releaseChannels(const string& id, const vector<size_t>& channels) {
+	lock_guard<mutex> guard(lock);
+	for (auto i : channels) release(id, i);
+}
+
+
 void DeviceManager::releaseChannel(const string& id, size_t channel) {
+	lock_guard<mutex> guard(lock);
+	release(id, channel);
+}
+
+
+void DeviceManager::release(const string& id, size_t channel) {
 	if (!deviceExists(id)) throw runtime_error("Channel releasing error. AMBE chip " + id + " not found");
 
 	auto it = devices.find(id);
@@ -80,7 +151,22 @@ void DeviceManager::releaseChannel(const string& id, size_t channel) {
 }
 
 
+pair<size_t, size_t> DeviceManager::capacity() {
+	lock_guard<mutex> guard(lock);
+
+	size_t total = 0, free = 0;
+	for (auto& device : devices) {
+		auto& channels = get<2>(device.second);
+		total += channels.size();
+		free += count(channels.begin(), channels.end(), false);
+	}
+	return make_pair(total, free);
+}
+
+
 tuple<Device&, Scheduler&, vector<bool>>* DeviceManager::getData(const string& id) {
+	lock_guard<mutex> guard(lock);
+
 	auto it = devices.find(id);
 	if (it != devices.end()) return &it->second;
 	return nullptr;
@@ -28,6 +28,7 @@
 #include <tuple>
 
 #include "api.h"
+#include "g711.h"
 #include "queue.h"
 #include "scheduler.h"
 
@@ -41,7 +42,7 @@ namespace ambe {
 	class API;
 
 	typedef function<void(const string&)> FifoCallback;
-	typedef function<void(int32_t, const string&)> TaggedCallback;
+	typedef function<void(int32_t, const string&, bool)> TaggedCallback;
 
 	enum class DeviceMode {
 		USB = 0,
@@ -66,6 +67,10 @@ namespace ambe {
 
 		bool uses_parity = true;
 
+		// The companding law configured in the AMBE chip. If set to anything
+		// but NONE, SPEECH packets carry 8-bit G.711 samples.
+		Compand compand = Compand::NONE;
+
 		/**
 		 * Start the device
 		 *
@@ -169,27 +174,58 @@ namespace ambe {
 		 * whenever the device sends a packet to the host. The callback function
 		 * may be invoked from a different thread. Returns the previous callback
 		 * if any or nullptr.
+		 *
+		 * The callback receives the tag, the packet, and a busy flag. Requests
+		 * that could not be processed complete with an empty packet. The flag
+		 * is set if the server rejected the request because the client has
+		 * exceeded its quota.
 		 */
 		virtual TaggedCallback setCallback(TaggedCallback recv) = 0;
 
 		/**
 		 * Send a packet to the device
 		 *
-		 * Send a packet stored in string "packet" to the device. This method is
-		 * blocking and is not thread-safe. In particular, an implementation can
-		 * block until the packet has been transferred to the AMBE chip.
-		 * Invoking the method concurrently from multiple threads results in
-		 * undefined behavior.
+		 * Send a packet stored in string "packet" to the device. This method
+		 * must be thread-safe and should not block on the network; the
+		 * scheduler invokes it from the submitting threads without holding a
+		 * lock. Implementations typically queue the packet for a background
+		 * writer.
 		 *
-		 * NOTE: Currently, there is no way to find out whether the driver
-		 * succesfully wrote the packet to the device. If an error is thrown
-		 * while the packet is being written to the device, the implementation
-		 * is expected to throw an exception that will terminate the whole
-		 * process. Due to the nature of the serial protocol between the AMBE
-		 * chip and the host, write errors are hard to recover from correctly
-		 * and it might be best to reset the entire process if one occurs.
+		 * If the packet cannot be sent, the method either throws an exception
+		 * or, if the failure is detected later, invokes the callback with the
+		 * packet's tag and an empty response.
 		 */
 		virtual void send(int32_t tag, const string& packet) = 0;
+
+		/**
+		 * Send several packets at once
+		 *
+		 * Devices that can transfer multiple packets in a single message
+		 * should override this method. The default implementation sends the
+		 * packets one by one.
+		 */
+		virtual void sendBatch(const vector<pair<int32_t, string>>& packets) {
+			for (auto& packet : packets) send(packet.first, packet.second);
+		}
+
+		/**
+		 * Return true if the device chains transcoding requests itself
+		 *
+		 * A remote device may be able to perform both stages of a
+		 * transcoding request (see Scheduler::transcodeAsync) on its own. In
+		 * that case, the client sends the CHANNEL packet for the source
+		 * channel and receives the CHANNEL packet from the target channel.
+		 */
+		virtual bool transcodes() const { return false; }
+
+		/**
+		 * Ask the device to cancel a request sent earlier
+		 *
+		 * A remote device can drop the request before it reaches the chip.
+		 * The device still answers the request, possibly with an empty
+		 * packet. The default implementation does nothing.
+		 */
+		virtual void cancel(int32_t tag) {}
 	};
 
 
@@ -200,14 +236,27 @@ namespace ambe {
 		~DeviceManager();
 
 		void add(const string& id, Device& device, Scheduler& scheduler);
+		void remove(const string& id);
 
 		pair<string, size_t> acquireChannel();
+		size_t acquireChannel(const string& id);
+		pair<string, vector<size_t>> acquireChannels(size_t count);
 		void releaseChannel(const string& id, size_t channel);
+		void releaseChannels(const string& id, const vector<size_t>& channels);
+
+		// Return the number of channels on all devices and the number of
+		// those not leased
+		pair<size_t, size_t> capacity();
 
 		tuple<Device&, Scheduler&, vector<bool>>* getData(const string& id);
 
 	private:
+		// The manager can be shared by multiple threads, e.g., gRPC sessions
+		// or C API handles opened concurrently. The lock protects the
+		// devices map and the channel allocation vectors.
+		mutex lock;
 		unordered_map<string, tuple<Device&, Scheduler&, vector<bool>>> devices;
 		bool deviceExists(const string& id);
+		void release(const string& id, size_t channel);
 	};
 }
@@ -0,0 +1,189 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "g711.h"
+#include <stdexcept>
+#include <algorithm>
+#include <byteswap.h>
+
+using namespace std;
+using namespace ambe;
+
+
+// The reference G.711 conversion routines below are based on the public
+// domain implementation by Sun Microsystems. They are only used to build the
+// lookup tables.
+
+static const int16_t seg_uend[8] = {0x3f, 0x7f, 0xff, 0x1ff, 0x3ff, 0x7ff, 0xfff, 0x1fff};
+static const int16_t seg_aend[8] = {0x1f, 0x3f, 0x7f, 0xff, 0x1ff, 0x3ff, 0x7ff, 0xfff};
+
+
+static int segment(int val, const int16_t* table) {
+	for (int i = 0; i < 8; i++)
+		if (val <= table[i]) return i;
+	return 8;
+}
+
+
+static uint8_t linear2ulaw(int16_t pcm) {
+	const int bias = 0x84 >> 2;
+	const int clip = 8159;
+	int val = pcm >> 2;
+	uint8_t mask;
+
+	if (val < 0) {
+		val = -val;
+		mask = 0x7f;
+	} else {
+		mask = 0xff;
+	}
+
+	if (val > clip) val = clip;
+	val += bias;
+
+	int seg = segment(val, seg_uend);
+	if (seg >= 8) return 0x7f ^ mask;
+
+	return ((seg << 4) | ((val >> (seg + 1)) & 0xf)) ^ mask;
+}
+
+
+static int16_t ulaw2linear(uint8_t u) {
+	const int bias = 0x84;
+	u = ~u;
+	int t = ((u & 0x0f) << 3) + bias;
+	t <<= (u & 0x70) >> 4;
+	return (u & 0x80) ? (bias - t) : (t - bias);
+}
+
+
+static uint8_t linear2alaw(int16_t pcm) {
+	int val = pcm >> 3;
+	uint8_t mask;
+
+	if (val >= 0) {
+		mask = 0xd5;
+	} else {
+		mask = 0x55;
+		val = -val - 1;
+	}
+
+	int seg = segment(val, seg_aend);
+	if (seg >= 8) return 0x7f ^ mask;
+
+	uint8_t aval = seg << 4;
+	if (seg < 2) aval |= (val >> 1) & 0x0f;
+	else aval |= (val >> seg) & 0x0f;
+	return aval ^ mask;
+}
+
+
+static int16_t alaw2linear(uint8_t a) {
+	a ^= 0x55;
+	int t = (a & 0x0f) << 4;
+	int seg = (a & 0x70) >> 4;
+
+	switch(seg) {
+	case 0: t += 8; break;
+	case 1: t += 0x108; break;
+	default: t += 0x108; t <<= seg - 1; break;
+	}
+	return (a & 0x80) ? t : -t;
+}
+
+
+namespace {
+	// µ-law only uses the 14 most significant bits of a linear sample and
+	// A-law only uses 13 bits. Thus, the encoder tables can be indexed with
+	// the shifted sample value directly.
+	struct Tables {
+		uint8_t ulaw_enc[1 << 14];
+		uint8_t alaw_enc[1 << 13];
+		int16_t ulaw_dec[256];
+		int16_t alaw_dec[256];
+		int16_t ulaw_dec_be[256];
+		int16_t alaw_dec_be[256];
+
+		Tables() {
+			for (int i = 0; i < (1 << 14); i++) ulaw_enc[i] = linear2ulaw((int16_t)(i << 2));
+			for (int i = 0; i < (1 << 13); i++) alaw_enc[i] = linear2alaw((int16_t)(i << 3));
+
+			for (int i = 0; i < 256; i++) {
+				ulaw_dec[i] = ulaw2linear(i);
+				alaw_dec[i] = alaw2linear(i);
+				ulaw_dec_be[i] = bswap_16(ulaw_dec[i]);
+				alaw_dec_be[i] = bswap_16(alaw_dec[i]);
+			}
+		}
+	};
+
+	const Tables tables;
+}
+
+
+Compand ambe::parseCompand(const string& value) {
+	string v(value);
+	for_each(v.begin(), v.end(), [](char& c){ c = ::tolower(c); });
+
+	if (v == "none" || v == "0") return Compand::NONE;
+	if (v == "ulaw" || v == "mulaw" || v == "pcmu") return Compand::ULAW;
+	if (v == "alaw" || v == "pcma") return Compand::ALAW;
+	throw runtime_error("Invalid companding mode: " + value);
+}
+
+
+const char* ambe::toString(Compand mode) {
+	switch(mode) {
+	case Compand::NONE: return "none";
+	case Compand::ULAW: return "ulaw";
+	case Compand::ALAW: return "alaw";
+	default: throw logic_error("Bug: Invalid companding mode");
+	}
+}
+
+
+void g711::encode(uint8_t* dst, const int16_t* src, size_t count, Compand law, bool big_endian) {
+	switch(law) {
+	case Compand::ULAW:
+		if (big_endian) for (size_t i = 0; i < count; i++) dst[i] = tables.ulaw_enc[(uint16_t)bswap_16(src[i]) >> 2];
+		else            for (size_t i = 0; i < count; i++) dst[i] = tables.ulaw_enc[(uint16_t)src[i] >> 2];
+		break;
+
+	case Compand::ALAW:
+		if (big_endian) for (size_t i = 0; i < count; i++) dst[i] = tables.alaw_enc[(uint16_t)bswap_16(src[i]) >> 3];
+		else            for (size_t i = 0; i < count; i++) dst[i] = tables.alaw_enc[(uint16_t)src[i] >> 3];
+		break;
+
+	default:
+		throw logic_error("Bug: G.711 encoder invoked without companding law");
+	}
+}
+
+
+void g711::decode(int16_t* dst, const uint8_t* src, size_t count, Compand law, bool big_endian) {
+	const int16_t* table;
+
+	switch(law) {
+	case Compand::ULAW: table = big_endian ? tables.ulaw_dec_be : tables.ulaw_dec; break;
+	case Compand::ALAW: table = big_endian ? tables.alaw_dec_be : tables.alaw_dec; break;
+	default: throw logic_error("Bug: G.711 decoder invoked without companding law");
+	}
+
+	for (size_t i = 0; i < count; i++) dst[i] = table[src[i]];
+}
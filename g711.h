@@ -0,0 +1,59 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+namespace ambe {
+
+	/**
+	 * Speech sample companding modes supported by AMBE chips
+	 *
+	 * With companding enabled, the AMBE chip exchanges 8-bit G.711 samples
+	 * with the host instead of 16-bit linear samples. That halves the size of
+	 * SPEECH packets on the serial link.
+	 */
+	enum class Compand {
+		NONE = 0,
+		ULAW = 1,
+		ALAW = 2
+	};
+
+	Compand parseCompand(const string& value);
+	const char* toString(Compand mode);
+
+
+	/**
+	 * Table-driven G.711 codec
+	 *
+	 * Both directions are implemented with precomputed lookup tables, i.e.,
+	 * each sample costs a single (branch-free) table lookup. The tables are
+	 * built once when the library is loaded. Linear samples can be in host or
+	 * big endian byte order, the latter is the format used by AMBE chips.
+	 */
+	namespace g711 {
+		void encode(uint8_t* dst, const int16_t* src, size_t count, Compand law, bool big_endian=false);
+		void decode(int16_t* dst, const uint8_t* src, size_t count, Compand law, bool big_endian=false);
+	}
+}
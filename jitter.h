@@ -0,0 +1,196 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <map>
+#include <chrono>
+#include <cmath>
+#include <optional>
+#include <algorithm>
+
+using namespace std;
+
+namespace ambe {
+
+	/**
+	 * An adaptive jitter buffer for 20 ms frames
+	 *
+	 * Frames are identified by a sequence number that the sender increments
+	 * by one for every frame. The buffer is drained by a playout clock which
+	 * calls pop() once per frame period. Playout starts once the buffer
+	 * holds the target number of frames. The target follows the
+	 * interarrival jitter, estimated like in RFC 3550, and stays between the
+	 * configured minimum and maximum. Frames that arrive after their slot
+	 * has been played are rejected; slots without a frame are reported so
+	 * that the caller can conceal them.
+	 *
+	 * The buffer is not thread-safe.
+	 */
+	template<typename T>
+	class JitterBuffer {
+	public:
+		enum class Action {
+			NONE,     // Nothing to play (yet)
+			PLAY,     // Play the returned frame
+			CONCEAL,  // The frame for the slot is missing
+			DROP      // Discard the returned frame to shrink the buffer
+		};
+
+		// Duration of a frame
+		static constexpr chrono::milliseconds period{20};
+
+		JitterBuffer(unsigned int min=1, unsigned int max=25) :
+			min(min), max(max), target_(min) {}
+
+		// Add a frame received at the given time. Returns the frame to be
+		// discarded, if any: the given frame if it is late or a duplicate,
+		// or the oldest frame if the buffer has overflowed.
+		optional<T> push(uint32_t seq, T&& value, chrono::steady_clock::time_point now) {
+			estimate(seq, now);
+
+			if ((started && before(seq, next)) || frames.count(seq))
+				return move(value);
+
+			frames.emplace(seq, move(value));
+			if (frames.size() <= max) return nullopt;
+
+			auto oldest = frames.begin();
+			optional<T> rv(move(oldest->second));
+			if (started && !before(oldest->first, next)) next = oldest->first + 1;
+			frames.erase(oldest);
+			return rv;
+		}
+
+		// Invoked once per frame period. For PLAY and DROP, the frame is
+		// moved into value. For PLAY and CONCEAL, seq is set to the slot's
+		// sequence number. After DROP, the caller invokes pop again. With
+		// flush set, e.g., after the sender has finished, the remaining
+		// frames are played without waiting for the target and without
+		// concealing missing frames.
+		Action pop(T& value, uint32_t& seq, bool flush=false) {
+			if (!started) {
+				if (frames.empty() || (frames.size() < target_ && !flush)) return Action::NONE;
+				started = true;
+				misses = 0;
+				next = frames.begin()->first;
+			}
+
+			if (frames.empty()) {
+				// The sender has stopped or stalled. Conceal a few frames
+				// and then wait for the buffer to fill up again.
+				if (flush || ++misses > max_misses) {
+					started = false;
+					return Action::NONE;
+				}
+				seq = next++;
+				return Action::CONCEAL;
+			}
+			misses = 0;
+
+			auto first = frames.begin();
+			if (flush) next = first->first;
+			if (first->first != next) {
+				seq = next++;
+				return Action::CONCEAL;
+			}
+
+			value = move(first->second);
+			seq = first->first;
+			frames.erase(first);
+			next++;
+
+			// Skip frames while the buffer holds more than the target
+			// (with some hysteresis), e.g., after the jitter has decreased
+			// or after a burst
+			return frames.size() > target_ + slack ? Action::DROP : Action::PLAY;
+		}
+
+		// Remove and return the first frame for which match returns true,
+		// e.g., a frame whose request has been cancelled. Its slot is then
+		// concealed like that of a missing frame.
+		template<typename Match>
+		optional<T> remove(Match match) {
+			for (auto it = frames.begin(); it != frames.end(); ++it) {
+				if (!match(it->second)) continue;
+				optional<T> rv(move(it->second));
+				frames.erase(it);
+				return rv;
+			}
+			return nullopt;
+		}
+
+		bool empty() const {
+			return frames.empty();
+		}
+
+		size_t size() const {
+			return frames.size();
+		}
+
+		unsigned int target() const {
+			return target_;
+		}
+
+	private:
+		// Sequence number comparison with wrap-around
+		struct Less {
+			bool operator()(uint32_t a, uint32_t b) const {
+				return (int32_t)(a - b) < 0;
+			}
+		};
+
+		static bool before(uint32_t a, uint32_t b) {
+			return Less()(a, b);
+		}
+
+		// The difference in transit time between two frames is computed from
+		// the difference of their sequence numbers, which stays small when
+		// the sequence number wraps around
+		void estimate(uint32_t seq, chrono::steady_clock::time_point now) {
+			if (have_last) {
+				double elapsed = chrono::duration<double, milli>(now - last_arrival).count();
+				double d = elapsed - (double)(int32_t)(seq - last_seq) * period.count();
+				jitter += (fabs(d) - jitter) / 16;
+				auto frames = 1 + (unsigned int)ceil(2 * jitter / period.count());
+				target_ = clamp(frames, min, max);
+			}
+			last_arrival = now;
+			last_seq = seq;
+			have_last = true;
+		}
+
+		static const unsigned int max_misses = 3;
+		static const unsigned int slack = 2;
+
+		unsigned int min;
+		unsigned int max;
+		unsigned int target_;
+
+		map<uint32_t, T, Less> frames;
+		bool started = false;
+		uint32_t next = 0;
+		unsigned int misses = 0;
+
+		double jitter = 0;  // Estimated interarrival jitter in ms
+		chrono::steady_clock::time_point last_arrival;
+		uint32_t last_seq = 0;
+		bool have_last = false;
+	};
+}
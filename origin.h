@@ -0,0 +1,46 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+
+namespace ambe {
+
+	/**
+	 * The client session a request has been submitted for
+	 *
+	 * Requests submitted with an origin can be cancelled with
+	 * Scheduler::cancel, e.g., when the client has gone away or has given up
+	 * waiting for the response. The session is an opaque key, typically the
+	 * address of the object that represents the session. The id identifies
+	 * the request within the session; several requests may share an id.
+	 */
+	struct Origin {
+		// An id that matches all requests of the session in cancel()
+		static constexpr int64_t ALL = INT64_MIN;
+
+		const void* session = nullptr;
+		int64_t id = 0;
+
+		bool matches(const Origin& request) const {
+			return session && session == request.session && (id == ALL || id == request.id);
+		}
+	};
+}
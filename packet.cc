@@ -29,29 +29,29 @@ Packet::Packet(PacketType type) : buffer(sizeof(Header), '\0'), has_parity(false
 }
 
 
-Packet::Packet(const string& packet, bool has_parity, bool check_parity) : buffer(packet), has_parity(has_parity) {
+Packet::Packet(string packet, bool has_parity, bool check_parity) : buffer(move(packet)), has_parity(has_parity) {
 	// If the packet has a parity field and we are asked to check it, do so as
 	// the first step before any other processing. This allows the parser to
 	// fail early in case the packet got corrupted in transit.
 
 	if (has_parity) {
-		if (packet.length() < sizeof(Header) + sizeof(ParityField))
+		if (buffer.length() < sizeof(Header) + sizeof(ParityField))
 			throw runtime_error("Packet too short to have parity field");
 
-		auto parity = (ParityField*)(packet.data() + packet.length() - sizeof(ParityField));
+		auto parity = (ParityField*)(buffer.data() + buffer.length() - sizeof(ParityField));
 
 		if (parity->type != PARITY)
 			throw runtime_error("Invalid parity header");
 
 		if (check_parity) {
-			auto data = string_view(packet).substr(1, packet.length() - 2);
+			auto data = string_view(buffer).substr(1, buffer.length() - 2);
 			if (ParityField::parity(data) != parity->value)
 				throw runtime_error("Invalid packet parity");
 		}
 	}
 
 	// Make sure all fields in the packet header have sane values.
-	Header::check(packet);
+	Header::check(buffer);
 }
 
 
@@ -66,6 +66,23 @@ bool Packet::checkParity() {
 }
 
 
+bool Packet::hasParity() const {
+	return has_parity;
+}
+
+
+Packet Packet::busy() {
+	Packet rv;
+	rv.rejected = true;
+	return rv;
+}
+
+
+bool Packet::isBusy() const {
+	return rejected;
+}
+
+
 Header* Packet::header() const {
 	return (Header*)buffer.data();
 }
@@ -158,3 +175,82 @@ unsigned int Packet::channel() const {
 		return -1;
 	}
 }
+
+
+// The size of the parameters that follow the type of a field in a request.
+// SPCHD and CHAND fields have a variable size, -1 marks unknown fields.
+static int parameterSize(uint8_t type) {
+	switch(type) {
+	case CHANNEL0: case CHANNEL1: case CHANNEL2:
+	case PRODID: case VERSTRING: case RESET: case HALT:
+	case GETCFG: case READCFG: case READY:
+		return 0;
+
+	case RATET: case INIT: case LOWPOWER: case PARITY:
+	case COMPAND: case PARITYMODE:
+		return 1;
+
+	case CMODE: case ECMODE: case DCMODE: case CHANFMT: case SPCHFMT:
+	case DELAYNUS: case DELAYNNS: case GAIN:
+		return 2;
+
+	case RESETSOFTCFG: return 6;
+	case RATEP:        return 12;
+	default:           return -1;
+	}
+}
+
+
+/**
+ * Return the offsets of all fields in the payload
+ *
+ * The offsets can be passed to payload(). Unlike channel(), which looks at
+ * the first field only, this walks the entire payload, e.g., to find all
+ * channel fields of a CONTROL packet that switches channels between its
+ * fields. The flag companded tells whether speech samples are carried as
+ * 8-bit G.711 samples. Throws runtime_error if the payload cannot be parsed,
+ * e.g., because it contains a field of unknown size or is truncated.
+ */
+vector<size_t> Packet::fields(bool companded) const {
+	vector<size_t> rv;
+	auto data = (const uint8_t*)buffer.data() + sizeof(Header);
+	size_t length = payloadLength(), i = 0;
+
+	while (i < length) {
+		rv.push_back(i);
+		auto type = data[i++];
+		size_t size;
+
+		if (type == SPCHD || type == CHAND) {
+			if (i >= length) throw runtime_error("Truncated packet field");
+			auto n = data[i];
+			if (type == CHAND) size = 1 + (n + 7) / 8;
+			else size = 1 + n * (companded ? 1 : 2);
+		} else {
+			auto s = parameterSize(type);
+			if (s < 0) throw runtime_error("Unknown packet field");
+			size = s;
+		}
+
+		if (length - i < size) throw runtime_error("Truncated packet field");
+		i += size;
+	}
+	return rv;
+}
+
+
+/**
+ * Redirect the packet to another channel
+ *
+ * Overwrite the channel field at the beginning of the payload in place. The
+ * caller is expected to invoke finalize() afterwards to recalculate the
+ * parity. This is used to turn a SPEECH response from one channel into a
+ * SPEECH request for another channel without copying the samples.
+ */
+void Packet::setChannel(uint8_t channel) {
+	auto field = payload<ChannelField>();
+	if (!field->valid())
+		throw runtime_error("Packet has no channel field");
+
+	new (field) ChannelField(channel);
+}
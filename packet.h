@@ -20,6 +20,7 @@
 #pragma once
 #include <string>
 #include <string_view>
+#include <vector>
 #include <stdexcept>
 #include <algorithm>
 #include <memory>
@@ -46,6 +47,7 @@ namespace ambe {
 	enum __attribute__ ((packed)) FieldType {
 		SPCHD        = 0x00,  // Field carries speech samples
 		CHAND        = 0x01,  // Field carries AMBE channel bits
+		CMODE        = 0x02,  // Mode flags for the frame in this packet
 		ECMODE       = 0x05,  // Encoder cmode flags for current channel
 		DCMODE       = 0x06,  // Decoder cmode flags for current channel
 		RATET        = 0x09,  // Select rate from table for current channel
@@ -185,6 +187,17 @@ namespace ambe {
 	static_assert(sizeof(SpchdField) == sizeof(Field) + 1);
 
 
+	// With companding enabled, the SPCHD field carries 8-bit G.711 samples
+	// instead of 16-bit linear samples.
+	struct __attribute__ ((packed)) CompandedSpchdField : Field {
+		uint8_t samples;   // Number of 8-bit companded speech samples
+		uint8_t data[0];   // An array of samples
+		CompandedSpchdField(uint8_t samples) : Field(SPCHD), samples(samples) {}
+	};
+
+	static_assert(sizeof(CompandedSpchdField) == sizeof(Field) + 1);
+
+
 	struct __attribute__ ((packed)) ChandField : Field {
 		uint8_t bits;  // Number of bits stored in data
 		char data[0];  // A bit representation of AMBE-compressed frame
@@ -194,6 +207,21 @@ namespace ambe {
 	static_assert(sizeof(ChandField) == sizeof(Field) + 1);
 
 
+	// Flag in the CMODE field of a CHANNEL packet: the frame has been lost.
+	// The decoder conceals it (frame repeat, then muting) and ignores the
+	// bits in the packet.
+	static const uint16_t CMODE_LOST_FRAME = 0x0004;
+
+	struct __attribute__ ((packed)) CmodeField : Field {
+	private:
+		uint16_t flags;
+	public:
+		CmodeField(uint16_t flags) : Field(CMODE), flags(htons(flags)) {}
+	};
+
+	static_assert(sizeof(CmodeField) == sizeof(Field) + 2);
+
+
 	struct __attribute__ ((packed)) StatusField : Field {
 		const uint8_t status = 0;
 		StatusField(FieldType type) = delete;
@@ -273,35 +301,45 @@ namespace ambe {
 	static_assert(sizeof(RatepField) == sizeof(Field) + 12);
 
 
+	// The ECMODE and DCMODE fields carry a 16-bit big endian parameter. The
+	// compand bits are above bit 7, so the parameter must not be truncated.
 	struct __attribute__ ((packed)) ModeField : Field {
 	private:
-		uint8_t params;
+		uint16_t params;
 	public:
 		ModeField(FieldType type, bool ns_e, bool cp_s, bool cp_e, bool dtx_e, bool td_e, bool ts_e) :
 			Field(type) {
-			params = (ns_e  << 6)
+			params = htons((ns_e  << 6)
 				   | (cp_s  << 7)
 				   | (cp_e  << 8)
 				   | (dtx_e << 11)
 				   | (td_e  << 12)
-				   | (ts_e  << 14);
+				   | (ts_e  << 14));
 		}
 	};
 
-	static_assert(sizeof(ModeField) == sizeof(Field) + 1);
+	static_assert(sizeof(ModeField) == sizeof(Field) + 2);
 
 
 	class Packet {
 		string buffer;
 		bool has_parity;
+		bool rejected = false;
 
 		void updateHeaderLength();
 
 	public:
 		Packet(PacketType type=CONTROL);
-		Packet(const string& packet, bool has_parity, bool check_parity);
+		// Pass an rvalue to take over the buffer of the string without copying
+		Packet(string packet, bool has_parity, bool check_parity);
+
+		// An empty packet standing for a request that the server has rejected
+		// without processing because the client has exceeded its quota
+		static Packet busy();
+		bool isBusy() const;
 
 		bool checkParity();
+		bool hasParity() const;
 
 		Header* header() const;
 		ParityField* parity() const;
@@ -311,6 +349,8 @@ namespace ambe {
 		const string& data() const;
 		const string& finalize(bool with_parity=true);
 		unsigned int channel() const;
+		vector<size_t> fields(bool companded) const;
+		void setChannel(uint8_t channel);
 
 		template<typename FieldClass>
 		FieldClass* payload(size_t offset=0) const {
@@ -352,6 +392,19 @@ namespace ambe {
 #pragma GCC diagnostic pop
 		}
 
+		const uint8_t* companded(size_t& count) const {
+			if (type() != SPEECH)
+				throw runtime_error("Speech packet expected");
+
+			auto channel = payload<ChannelField>();
+			if (!channel->valid())
+				throw runtime_error("Invalid packet channel");
+
+			auto spchd = payload<CompandedSpchdField>(sizeof(ChannelField));
+			count = spchd->samples;
+			return &spchd->data[0];
+		}
+
 		const char* bits(size_t& count) const {
 			if (type() != CHANNEL)
 				throw runtime_error("Channel packet expected");
@@ -20,6 +20,7 @@
 #pragma once
 
 #include <queue>
+#include <vector>
 #include <mutex>
 #include <condition_variable>
 
@@ -44,6 +45,13 @@ public:
 		notifier.notify_one();
 	}
 
+	// Push several elements at once, waking up the consumer only once
+	void push(vector<T>&& values) {
+		lock_guard<std::mutex> lock(mutex);
+		for (auto& value : values) queue.push(move(value));
+		notifier.notify_one();
+	}
+
 	T pop(bool block=true) {
 		unique_lock<std::mutex> lock(mutex);
 
@@ -0,0 +1,169 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "resample.h"
+#include <cmath>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <byteswap.h>
+
+using namespace std;
+using namespace ambe;
+
+
+// The number of filter taps per phase for a conversion without decimation.
+// When decimating, the filter is made proportionally longer to keep the
+// transition band equally sharp in terms of the output rate.
+static const unsigned int base_taps = 16;
+
+
+bool Resampler::supported(unsigned int rate) {
+	switch(rate) {
+	case 8000:
+	case 16000:
+	case 32000:
+	case 44100:
+	case 48000:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
+Resampler::Resampler(unsigned int input_rate, unsigned int output_rate, unsigned int input_channels) :
+	input_rate(input_rate), output_rate(output_rate), channels(input_channels) {
+	if (!input_rate || !output_rate)
+		throw logic_error("Invalid sampling rate");
+
+	if (!channels)
+		throw logic_error("Invalid number of channels");
+
+	auto g = gcd(input_rate, output_rate);
+	L = output_rate / g;
+	M = input_rate / g;
+
+	// Without rate conversion, the converter only downmixes and re-chunks
+	// the input. A single tap is enough for that and read() copies the
+	// samples without filtering.
+	taps = (L == 1 && M == 1) ? 1 : base_taps * ((M + L - 1) / L);
+
+	// Design a windowed-sinc low-pass prototype filter at the upsampled rate.
+	// The cutoff frequency is set slightly below the Nyquist frequency of the
+	// lower of the two rates.
+	const size_t n = (size_t)L * taps;
+	const double cutoff = 0.45 / max(L, M);
+	const double center = (n - 1) / 2.0;
+	vector<double> h(n);
+
+	for (size_t i = 0; i < n; i++) {
+		double x = i - center;
+		double sinc = x == 0 ? 2 * cutoff : sin(2 * M_PI * cutoff * x) / (M_PI * x);
+		double window = 0.42 - 0.5 * cos(2 * M_PI * i / (n - 1)) + 0.08 * cos(4 * M_PI * i / (n - 1));
+		h[i] = sinc * window;
+	}
+
+	// Normalize for unity gain. Each phase then has approximately unity gain
+	// on its own.
+	double sum = accumulate(h.begin(), h.end(), 0.0);
+
+	coefs.resize(n);
+	for (unsigned int p = 0; p < L; p++) {
+		for (unsigned int k = 0; k < taps; k++) {
+			double v = h[p + (size_t)k * L] * L / sum;
+			coefs[(size_t)p * taps + (taps - 1 - k)] = (int16_t)lrint(max(-32768.0, min(32767.0, v * 32768)));
+		}
+	}
+
+	reset();
+}
+
+
+void Resampler::reset() {
+	history.assign(taps - 1, 0);
+	position = (uint64_t)(taps - 1) * L;
+}
+
+
+void Resampler::push(const int16_t* samples, size_t frames, bool big_endian) {
+	auto old = history.size();
+	history.resize(old + frames);
+	int16_t* dst = history.data() + old;
+
+	if (channels == 1) {
+		if (big_endian) for (size_t i = 0; i < frames; i++) dst[i] = bswap_16(samples[i]);
+		else            for (size_t i = 0; i < frames; i++) dst[i] = samples[i];
+		return;
+	}
+
+	for (size_t i = 0; i < frames; i++) {
+		int32_t sum = 0;
+		for (unsigned int c = 0; c < channels; c++) {
+			int16_t v = samples[i * channels + c];
+			sum += big_endian ? (int16_t)bswap_16(v) : v;
+		}
+		dst[i] = sum / (int32_t)channels;
+	}
+}
+
+
+size_t Resampler::available() const {
+	// Output sample at position t needs input samples up to t / L
+	uint64_t end = (uint64_t)history.size() * L;
+	if (position >= end) return 0;
+	return (end - position + M - 1) / M;
+}
+
+
+size_t Resampler::read(int16_t* dst, size_t count, bool big_endian) {
+	size_t n = min(count, available());
+
+	for (size_t i = 0; i < n; i++) {
+		uint64_t index = position / L;
+		unsigned int phase = position % L;
+
+		const int16_t* x = history.data() + index - (taps - 1);
+		const int16_t* c = coefs.data() + (size_t)phase * taps;
+
+		int16_t v;
+		if (taps == 1) {
+			v = x[0];
+		} else {
+			int32_t acc = 0;
+			for (unsigned int k = 0; k < taps; k++) acc += (int32_t)x[k] * c[k];
+
+			acc = (acc + (1 << 14)) >> 15;
+			v = acc > 32767 ? 32767 : acc < -32768 ? -32768 : acc;
+		}
+		dst[i] = big_endian ? bswap_16(v) : v;
+
+		position += M;
+	}
+
+	// Discard input samples that are no longer needed by the filter
+	uint64_t index = position / L;
+	if (index >= taps - 1 + 4096) {
+		size_t drop = index - (taps - 1);
+		history.erase(history.begin(), history.begin() + drop);
+		position -= (uint64_t)drop * L;
+	}
+
+	return n;
+}
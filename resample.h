@@ -0,0 +1,90 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+using namespace std;
+
+namespace ambe {
+
+	/**
+	 * Polyphase sample rate converter
+	 *
+	 * AMBE chips only accept 8 kHz mono audio. This class converts audio
+	 * between 8 kHz and the sampling rates commonly used by applications
+	 * (16, 32, 44.1, and 48 kHz). Multi-channel input is downmixed to mono.
+	 *
+	 * The converter works with any ratio of two integer rates L/M. The
+	 * prototype low-pass filter is split into L phases with Q15 coefficients
+	 * so that each output sample is a single int16 dot product which the
+	 * compiler can vectorize.
+	 *
+	 * Input can be pushed in chunks of arbitrary size. Output samples are
+	 * computed only when they are read, directly into the caller's buffer.
+	 * This allows writing resampled audio straight into a packet and it makes
+	 * the converter usable for re-chunking audio into 20 ms frames.
+	 */
+	class Resampler {
+	public:
+		Resampler(unsigned int input_rate, unsigned int output_rate, unsigned int input_channels=1);
+
+		// Append interleaved input samples. The argument frames is the
+		// number of samples per channel.
+		void push(const int16_t* samples, size_t frames, bool big_endian=false);
+
+		// The number of output samples that can be read right now
+		size_t available() const;
+
+		// Compute up to count output samples into dst. Returns the number of
+		// samples written.
+		size_t read(int16_t* dst, size_t count, bool big_endian=false);
+
+		void reset();
+
+		unsigned int inputRate() const { return input_rate; }
+		unsigned int outputRate() const { return output_rate; }
+		unsigned int inputChannels() const { return channels; }
+
+		static bool supported(unsigned int rate);
+
+	private:
+		unsigned int input_rate;
+		unsigned int output_rate;
+		unsigned int channels;
+
+		// Upsampling and downsampling factors
+		unsigned int L, M;
+
+		// Filter taps per phase
+		unsigned int taps;
+
+		// Polyphase coefficients, "taps" coefficients per phase stored in
+		// reverse order so that they can be applied to contiguous input.
+		vector<int16_t> coefs;
+
+		// Mono input history and the position of the next output sample in
+		// units of 1/L input samples, relative to the start of the history.
+		vector<int16_t> history;
+		uint64_t position;
+	};
+}
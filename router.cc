@@ -0,0 +1,633 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <getopt.h>
+#include <stdlib.h>
+#include <grpc++/grpc++.h>
+#include <grpcpp/generic/async_generic_service.h>
+#include <grpcpp/generic/generic_stub.h>
+#include "ambe.grpc.pb.h"
+#include "uri.h"
+#include "admission.h"
+
+using namespace std;
+using namespace ambe;
+
+using grpc::Server;
+using grpc::ServerBuilder;
+using grpc::ServerCompletionQueue;
+using grpc::Status;
+using grpc::StatusCode;
+
+
+static unsigned short port = 50051;
+static vector<string> listeners;
+static vector<string> targets;
+static unsigned int threads = 2;
+static unsigned int interval = 1000;
+
+
+// The streaming calls proxied to a backend. Ping and capacity queries are
+// answered by the router itself.
+static const string service_prefix = "/ambe.rpc.AmbeService/";
+
+static bool proxied(const string& method) {
+	return method == service_prefix + "bind"
+		|| method == service_prefix + "transcode"
+		|| method == service_prefix + "frames";
+}
+
+
+// Metadata generated by gRPC itself must not be copied between calls
+static bool reserved(const grpc::string_ref& key) {
+	return key.starts_with(":") || key.starts_with("grpc-") || key == "user-agent"
+		|| key == "content-type" || key == "te";
+}
+
+
+/**
+ * The ambed servers behind the router
+ *
+ * A monitor thread asks every backend for its capacity once per interval.
+ * A backend that does not answer within the interval is considered down
+ * and receives no new streams until it answers again. Between two queries,
+ * the router subtracts the channels of the streams it has proxied to a
+ * backend from its last known capacity, so that a burst of new streams is
+ * spread over the backends rather than sent to the one that looked best at
+ * the last query.
+ */
+class Backends {
+public:
+	struct Backend {
+		string target;
+		shared_ptr<grpc::Channel> channel;
+		unique_ptr<grpc::GenericStub> stub;
+		unique_ptr<rpc::AmbeService::Stub> service;
+		bool up = false;
+		long channels = 0;
+		long free = 0;
+	};
+
+	Backends(const vector<string>& targets, chrono::milliseconds interval);
+	~Backends();
+
+	// Query all backends once and start the monitor thread
+	void start();
+
+	// Pick the backend with the most free channels that is not in the
+	// excluded list and lease count channels on it. Returns nullptr if no
+	// backend is up.
+	Backend* pick(size_t count, const vector<Backend*>& excluded);
+
+	// The total and free number of channels on all backends that are up
+	pair<long, long> capacity();
+
+private:
+	void poll();
+	void run();
+
+	std::mutex mutex;
+	condition_variable cond;
+	vector<unique_ptr<Backend>> backends;
+	chrono::milliseconds interval;
+	size_t next = 0;
+	bool quit = false;
+	thread monitor;
+};
+
+
+Backends::Backends(const vector<string>& targets, chrono::milliseconds interval) : interval(interval) {
+	for (auto& target : targets) {
+		auto b = make_unique<Backend>();
+		b->target = target;
+		b->channel = grpc::CreateChannel(target, grpc::InsecureChannelCredentials());
+		b->stub = make_unique<grpc::GenericStub>(b->channel);
+		b->service = rpc::AmbeService::NewStub(b->channel);
+		backends.push_back(move(b));
+	}
+}
+
+
+Backends::~Backends() {
+	{
+		lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	cond.notify_all();
+	if (monitor.joinable()) monitor.join();
+}
+
+
+void Backends::start() {
+	poll();
+	monitor = thread(&Backends::run, this);
+}
+
+
+void Backends::run() {
+	unique_lock<std::mutex> lock(mutex);
+	while (!cond.wait_for(lock, interval, [this] { return quit; })) {
+		lock.unlock();
+		poll();
+		lock.lock();
+	}
+}
+
+
+// Query all backends in parallel. The backends are only touched by this
+// thread, their state is updated under the lock.
+void Backends::poll() {
+	struct Query {
+		grpc::ClientContext context;
+		rpc::Capacity reply;
+		grpc::Status status;
+		unique_ptr<grpc::ClientAsyncResponseReader<rpc::Capacity>> call;
+	};
+
+	grpc::CompletionQueue cq;
+	vector<Query> queries(backends.size());
+	auto deadline = chrono::system_clock::now() + interval;
+
+	for (size_t i = 0; i < backends.size(); i++) {
+		auto& q = queries[i];
+		q.context.set_deadline(deadline);
+		q.call = backends[i]->service->Asynccapacity(&q.context, rpc::CapacityRequest(), &cq);
+		q.call->Finish(&q.reply, &q.status, &q);
+	}
+
+	void* tag;
+	bool ok;
+	for (size_t i = 0; i < queries.size(); i++) cq.Next(&tag, &ok);
+	cq.Shutdown();
+	while (cq.Next(&tag, &ok));
+
+	lock_guard<std::mutex> lock(mutex);
+	for (size_t i = 0; i < backends.size(); i++) {
+		auto& b = *backends[i];
+		auto& q = queries[i];
+
+		bool up = q.status.ok();
+		if (up != b.up)
+			cout << "Backend " << b.target << " is " << (up ? "up" : "down") << endl;
+
+		b.up = up;
+		b.channels = up ? q.reply.channels() : 0;
+		b.free = up ? q.reply.free() : 0;
+	}
+}
+
+
+Backends::Backend* Backends::pick(size_t count, const vector<Backend*>& excluded) {
+	lock_guard<std::mutex> lock(mutex);
+	Backend* best = nullptr;
+
+	// Start at a different backend each time, so that ties are broken in a
+	// round-robin fashion
+	auto n = backends.size();
+	for (size_t i = 0; i < n; i++) {
+		auto b = backends[(next + i) % n].get();
+		if (!b->up || find(excluded.begin(), excluded.end(), b) != excluded.end()) continue;
+		if (!best || b->free > best->free) best = b;
+	}
+	next++;
+
+	// A backend without free channels is still tried, its capacity may be
+	// out of date. It rejects the stream if it really is full.
+	if (best) best->free -= count;
+	return best;
+}
+
+
+pair<long, long> Backends::capacity() {
+	lock_guard<std::mutex> lock(mutex);
+	long channels = 0, free = 0;
+	for (auto& b : backends) {
+		if (!b->up) continue;
+		channels += b->channels;
+		free += max(b->free, 0L);
+	}
+	return make_pair(channels, free);
+}
+
+
+/**
+ * A call accepted by the router
+ *
+ * Streaming calls are forwarded to a backend. The messages are passed on in
+ * both directions as they are, without parsing; tags, batches, and metadata
+ * are handled by the client and the backend. If the backend rejects the
+ * stream because it has no channels left, the next best backend is tried.
+ *
+ * All events of a call are delivered to the completion queue of the thread
+ * that accepted it, so the call is never used from two threads at once.
+ */
+class Call {
+public:
+	enum Op {
+		CONNECT, DONE, START, METADATA, SEND_METADATA, CLIENT_READ, CLIENT_WRITE,
+		BACKEND_READ, BACKEND_WRITE, WRITES_DONE, BACKEND_FINISH, FINISH, OPS
+	};
+
+	struct Event {
+		Call* call;
+		Op op;
+	};
+
+	static void create(grpc::AsyncGenericService& service, Backends& backends, ServerCompletionQueue* cq) {
+		auto call = new Call(service, backends, cq);
+		call->context.AsyncNotifyWhenDone(&call->events[DONE]);
+		call->ops++;
+		call->issue(CONNECT);
+	}
+
+	void proceed(Op op, bool ok);
+
+private:
+	Call(grpc::AsyncGenericService& service, Backends& backends, ServerCompletionQueue* cq) :
+		service(service), backends(backends), cq(cq), stream(&context) {
+		for (int i = 0; i < OPS; i++)
+			events[i] = {this, (Op)i};
+	}
+
+	void issue(Op op);
+	void connect();
+	void finish(const Status& status);
+
+	grpc::AsyncGenericService& service;
+	Backends& backends;
+	ServerCompletionQueue* cq;
+	Event events[OPS];
+	unsigned int ops = 0;
+
+	grpc::GenericServerContext context;
+	grpc::GenericServerAsyncReaderWriter stream;
+	grpc::ByteBuffer request;
+	grpc::ByteBuffer response;
+
+	// The backends tried so far, the last one is in use
+	vector<Backends::Backend*> tried;
+	unique_ptr<grpc::ClientContext> backend_context;
+	unique_ptr<grpc::GenericClientAsyncReaderWriter> backend;
+	Status backend_status;
+
+	bool established = false;
+	bool backend_done = false;
+	bool finishing = false;
+};
+
+
+void Call::issue(Op op) {
+	auto tag = &events[op];
+	ops++;
+
+	switch(op) {
+	case CONNECT:        service.RequestCall(&context, &stream, cq, cq, tag); break;
+	case START:          backend->StartCall(tag);                             break;
+	case METADATA:       backend->ReadInitialMetadata(tag);                   break;
+	case SEND_METADATA:  stream.SendInitialMetadata(tag);                     break;
+	case CLIENT_READ:    stream.Read(&request, tag);                          break;
+	case CLIENT_WRITE:   stream.Write(response, tag);                         break;
+	case BACKEND_READ:   backend->Read(&response, tag);                       break;
+	case BACKEND_WRITE:  backend->Write(request, tag);                        break;
+	case WRITES_DONE:    backend->WritesDone(tag);                            break;
+	case BACKEND_FINISH:
+		backend_done = true;
+		backend->Finish(&backend_status, tag);
+		break;
+	default: throw logic_error("Bug: Invalid operation");
+	}
+}
+
+
+void Call::finish(const Status& status) {
+	finishing = true;
+	ops++;
+	stream.Finish(status, &events[FINISH]);
+}
+
+
+// Open the stream to the best backend that has not been tried yet. The
+// client's metadata is passed on, except for the client attribute, which
+// the router sets to the client's address so that the quotas of the backend
+// apply to the client rather than to the router.
+void Call::connect() {
+	auto& attrs = context.client_metadata();
+
+	// Bind clients may lease several channels at once, the backend checks
+	// the number
+	size_t count = context.method() == service_prefix + "transcode" ? 2 : 1;
+	auto n = attrs.find("channels");
+	if (context.method() == service_prefix + "bind" && n != attrs.end())
+		count = max(1, atoi(string(n->second.data(), n->second.size()).c_str()));
+
+	auto b = backends.pick(count, tried);
+	if (!b) {
+		finish(Status(StatusCode::UNAVAILABLE, "No channels left"));
+		return;
+	}
+	tried.push_back(b);
+
+	backend.reset();
+	backend_context = make_unique<grpc::ClientContext>();
+	backend_done = false;
+
+	for (auto& attr : attrs) {
+		if (reserved(attr.first) || attr.first == "client") continue;
+		backend_context->AddMetadata(string(attr.first.data(), attr.first.size()),
+			string(attr.second.data(), attr.second.size()));
+	}
+	backend_context->AddMetadata("client", Admission::identity(context.peer()));
+
+	backend = b->stub->PrepareCall(backend_context.get(), context.method(), cq);
+	issue(START);
+}
+
+
+void Call::proceed(Op op, bool ok) {
+	ops--;
+
+	switch(op) {
+	case CONNECT:
+		// The server is shutting down
+		if (!ok) {
+			delete this;
+			return;
+		}
+		create(service, backends, cq);
+
+		if (proxied(context.method())) {
+			connect();
+		} else if (context.method() == service_prefix + "ping") {
+			issue(CLIENT_READ);
+		} else if (context.method() == service_prefix + "capacity") {
+			issue(CLIENT_READ);
+		} else {
+			finish(Status(StatusCode::UNIMPLEMENTED, "Method not supported by the router"));
+		}
+		break;
+
+	case DONE:
+		// Abort the backend stream if the client has gone away
+		if (context.IsCancelled() && backend_context) backend_context->TryCancel();
+		break;
+
+	case START:
+		if (ok) issue(METADATA);
+		else issue(BACKEND_FINISH);
+		break;
+
+	case METADATA:
+		// A backend that rejects the stream sends no metadata
+		if (!ok || backend_context->GetServerInitialMetadata().empty()) {
+			issue(BACKEND_FINISH);
+			break;
+		}
+
+		for (auto& attr : backend_context->GetServerInitialMetadata()) {
+			if (reserved(attr.first)) continue;
+			context.AddInitialMetadata(string(attr.first.data(), attr.first.size()),
+				string(attr.second.data(), attr.second.size()));
+		}
+		established = true;
+		issue(SEND_METADATA);
+		break;
+
+	case SEND_METADATA:
+		if (!ok) {
+			backend_context->TryCancel();
+			issue(BACKEND_FINISH);
+			break;
+		}
+		issue(CLIENT_READ);
+		issue(BACKEND_READ);
+		break;
+
+	case CLIENT_READ:
+		if (finishing) break;
+
+		if (context.method() == service_prefix + "ping") {
+			if (!ok) {
+				finish(Status::OK);
+				break;
+			}
+			response.Swap(&request);
+			issue(CLIENT_WRITE);
+			break;
+		}
+
+		if (context.method() == service_prefix + "capacity") {
+			if (!ok) {
+				finish(Status(StatusCode::INVALID_ARGUMENT, "Request expected"));
+				break;
+			}
+			auto capacity = backends.capacity();
+			rpc::Capacity reply;
+			reply.set_channels(capacity.first);
+			reply.set_free(capacity.second);
+
+			bool own;
+			grpc::SerializationTraits<rpc::Capacity>::Serialize(reply, &response, &own);
+			finishing = true;
+			ops++;
+			stream.WriteAndFinish(response, grpc::WriteOptions(), Status::OK, &events[FINISH]);
+			break;
+		}
+
+		// Nothing more can be sent once the backend stream is finishing
+		if (backend_done) break;
+
+		// The client has closed its side of the stream
+		if (!ok) issue(WRITES_DONE);
+		else issue(BACKEND_WRITE);
+		break;
+
+	case BACKEND_WRITE:
+		// If the backend has gone away, its read fails too
+		if (ok && !backend_done) issue(CLIENT_READ);
+		break;
+
+	case WRITES_DONE:
+		break;
+
+	case BACKEND_READ:
+		if (ok) issue(CLIENT_WRITE);
+		else issue(BACKEND_FINISH);
+		break;
+
+	case CLIENT_WRITE:
+		if (finishing) break;
+
+		if (context.method() == service_prefix + "ping") {
+			if (ok) issue(CLIENT_READ);
+			else finish(Status::OK);
+			break;
+		}
+
+		if (ok) {
+			issue(BACKEND_READ);
+			break;
+		}
+
+		// The client has gone away. No backend read is outstanding, so
+		// cancel the backend stream and collect its status here, which
+		// finishes the call.
+		backend_context->TryCancel();
+		if (!backend_done) issue(BACKEND_FINISH);
+		break;
+
+	case BACKEND_FINISH:
+		// A backend that has no channels left rejects the stream before
+		// sending any metadata. Try another one.
+		if (!established && backend_status.error_code() == StatusCode::UNAVAILABLE && !context.IsCancelled()) {
+			cerr << "Backend " << tried.back()->target << ": " << backend_status.error_message() << endl;
+			connect();
+			break;
+		}
+		finish(backend_status);
+		break;
+
+	case FINISH:
+		break;
+
+	default:
+		throw logic_error("Bug: Invalid operation");
+	}
+
+	// Once the client's stream has been finished, the call only waits for
+	// the outstanding operations to complete
+	if (finishing && !ops) delete this;
+}
+
+
+static void serve(grpc::AsyncGenericService* service, Backends* backends, ServerCompletionQueue* cq) {
+	Call::create(*service, *backends, cq);
+
+	void* tag;
+	bool ok;
+	while (cq->Next(&tag, &ok)) {
+		auto event = static_cast<Call::Event*>(tag);
+		event->call->proceed(event->op, ok);
+	}
+}
+
+
+static void print_help(void) {
+	static char help_msg[] = "\
+Usage: ambe-router [options]\n\
+Options:\n\
+    -h         This help text.\n\
+    -p <num>   Port number to listen on.\n\
+    -l <addr>  Listen on host:port, unix:<path>, or unix:@<name> (abstract\n\
+               socket) instead. Can be given multiple times.\n\
+    -b <addr>  Backend ambed server (host:port, unix:<path>, or unix:@<name>).\n\
+               Can be given multiple times.\n\
+    -t <num>   Number of threads serving RPC calls (default: 2).\n\
+    -i <ms>    Interval between capacity queries to backends (default: 1000).\n\
+";
+
+	fprintf(stdout, "%s", help_msg);
+	exit(EXIT_SUCCESS);
+}
+
+
+int main(int argc, char** argv) {
+	int opt;
+
+	while((opt = getopt(argc, argv, "hp:l:b:t:i:")) != -1) {
+		switch(opt) {
+		case 'h': print_help();             break;
+		case 'p': port = atoi(optarg);      break;
+		case 't': threads = atoi(optarg);   break;
+		case 'i': interval = atoi(optarg);  break;
+		case 'l':
+			listeners.push_back(grpcAddress(optarg));
+			break;
+		case 'b':
+			targets.push_back(grpcAddress(optarg));
+			break;
+		default:
+			fprintf(stderr, "Use the -h option for list of supported "
+					"program arguments.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (port < 0 || port > 65535) {
+		fprintf(stderr, "Invalid port number: %d\n", port);
+		exit(EXIT_FAILURE);
+	}
+
+	if (threads < 1) {
+		fprintf(stderr, "Invalid number of threads: %u\n", threads);
+		exit(EXIT_FAILURE);
+	}
+
+	if (interval < 1) {
+		fprintf(stderr, "Invalid interval: %u\n", interval);
+		exit(EXIT_FAILURE);
+	}
+
+	if (targets.empty()) {
+		fprintf(stderr, "Please provide at least one backend (see -h)\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (listeners.empty())
+		listeners.push_back("0.0.0.0:" + to_string(port));
+
+	Backends backends(targets, chrono::milliseconds(interval));
+	backends.start();
+
+	ServerBuilder builder;
+	grpc::AsyncGenericService service;
+	for (auto& addr : listeners)
+		builder.AddListeningPort(addr, grpc::InsecureServerCredentials());
+	builder.RegisterAsyncGenericService(&service);
+
+	vector<unique_ptr<ServerCompletionQueue>> cqs;
+	for (unsigned int i = 0; i < threads; i++)
+		cqs.push_back(builder.AddCompletionQueue());
+
+	unique_ptr<Server> server(builder.BuildAndStart());
+	if (!server) {
+		fprintf(stderr, "Could not start gRPC server\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (auto& addr : listeners)
+		cout << "AMBE router listening on " << addr << endl;
+
+	vector<thread> workers;
+	for (auto& cq : cqs)
+		workers.emplace_back(serve, &service, &backends, cq.get());
+
+	for (auto& worker : workers)
+		worker.join();
+
+	return EXIT_SUCCESS;
+}
@@ -24,62 +24,209 @@
 #include <thread>
 #include <queue>
 #include <chrono>
+#include <cstring>
+#include <random>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <algorithm>
 
 #include <grpcpp/grpcpp.h>
 #include "ambe.grpc.pb.h"
 #include "api.h"
 #include "device.h"
+#include "uri.h"
 
 using namespace std;
 using namespace ambe;
 
 
-RpcDevice::RpcDevice(shared_ptr<grpc::ChannelInterface> channel) : stub(rpc::AmbeService::NewStub(channel)) {
+RpcDevice::RpcDevice(shared_ptr<grpc::ChannelInterface> channel, bool transcoder) :
+	transcoder(transcoder), connection(channel), stub(rpc::AmbeService::NewStub(channel)) {
 	stream = nullptr;
 }
 
 
-void RpcDevice::start() {
-	terminating = false;
+// Return true if the server agreed to exchange packet batches
+static bool batchesAccepted(const multimap<grpc::string_ref, grpc::string_ref>& attrs) {
+	auto b = attrs.find("batch");
+	return b != attrs.cend() && b->second == "1";
+}
 
-	stream = stub->bind(&context);
-	stream->WaitForInitialMetadata();
 
-	auto attrs = context.GetServerInitialMetadata();
+// Invoke the callback for each packet in a message received from the server.
+// The message carries either a single packet or a batch.
+static void dispatch(rpc::Packet& message, const TaggedCallback& recv) {
+	if (!message.has_batch()) {
+		recv(message.tag(), message.data(), message.busy());
+		return;
+	}
+
+	for (auto& packet : *message.mutable_batch()->mutable_packets())
+		recv(packet.tag(), packet.data(), packet.busy());
+}
+
+
+// Configure the device from the initial metadata sent by the server. Returns
+// false if a mandatory attribute is missing.
+static bool parseMetadata(const multimap<grpc::string_ref, grpc::string_ref>& attrs, Device& device, int& channel) {
 	auto ch = attrs.find("channel");
 	auto up = attrs.find("uses_parity");
 
-	if (ch == attrs.cend() || up == attrs.cend()) {
+	if (ch == attrs.cend() || up == attrs.cend())
+		return false;
+
+	channel = stoi(string(ch->second.data(), ch->second.length()));
+	device.uses_parity = stoi(string(up->second.data(), up->second.length()));
+
+	// Servers that predate companding support do not send this attribute
+	auto cm = attrs.find("compand");
+	if (cm != attrs.cend())
+		device.compand = parseCompand(string(cm->second.data(), cm->second.length()));
+
+	return true;
+}
+
+
+// Parse a comma-separated list of channel numbers, e.g., 0,1,2
+static vector<int> parseChannels(const grpc::string_ref& value) {
+	vector<int> rv;
+	string list(value.data(), value.length());
+
+	size_t start = 0;
+	while (start < list.size()) {
+		auto end = list.find(',', start);
+		if (end == string::npos) end = list.size();
+		rv.push_back(stoi(list.substr(start, end - start)));
+		start = end + 1;
+	}
+	return rv;
+}
+
+
+// Move a packet to other channels according to the map. Every channel field
+// is rewritten, a CONTROL packet may switch channels between its fields.
+// Packets that are not addressed to a channel, or that cannot be parsed, are
+// left alone.
+static void remapChannel(string& data, const array<uint8_t, 3>& map, bool parity, bool companded) {
+	if (data.size() <= sizeof(Header)) return;
+
+	try {
+		Packet packet(data, parity, false);
+		bool changed = false;
+		for (auto offset : packet.fields(companded)) {
+			auto field = packet.payload<ChannelField>(offset);
+			if (!field->valid()) continue;
+
+			auto ch = field->Field::type - CHANNEL0;
+			if (map[ch] == ch) continue;
+			new (field) ChannelField(map[ch]);
+			changed = true;
+		}
+		if (changed) data = packet.finalize(parity);
+	} catch(const runtime_error& e) {}
+}
+
+
+void RpcDevice::connect(vector<int>& leased, int& target) {
+	// The stream refers to the context, destroy it first
+	stream.reset();
+	{
+		lock_guard<std::mutex> lock(mutex);
+		context = make_unique<grpc::ClientContext>();
+		if (aborted) context->TryCancel();
+	}
+
+	context->AddMetadata("batch", "1");
+	if (!transcoder && channel_count != 1)
+		context->AddMetadata("channels", to_string(channel_count));
+	stream = transcoder ? stub->transcode(context.get()) : stub->bind(context.get());
+	stream->WaitForInitialMetadata();
+
+	auto attrs = context->GetServerInitialMetadata();
+	int first;
+	if (!parseMetadata(attrs, *this, first)) {
+		// Pass on the reason if the server refused the session, e.g., no
+		// channels left
+		stream->WritesDone();
+		auto status = stream->Finish();
+		throw runtime_error(status.ok() ? "Error while connecting to gRPC server" : status.error_message());
+	}
+	batching = batchesAccepted(attrs);
+
+	// Servers that predate multi-channel sessions lease a single channel
+	// and do not list it
+	auto chs = attrs.find("channels");
+	leased = transcoder || chs == attrs.cend() ? vector<int>{first} : parseChannels(chs->second);
+	if (!transcoder && leased.size() != channel_count) {
 		stream->WritesDone();
 		stream->Finish();
-		throw runtime_error("Error while connecting to gRPC server");
+		throw runtime_error("gRPC server does not support multi-channel sessions");
 	}
 
-	channel = stoi(ch->second.data());
-	uses_parity = stoi(up->second.data());
+	if (transcoder) {
+		auto tc = attrs.find("target_channel");
+		if (tc == attrs.cend()) {
+			stream->WritesDone();
+			stream->Finish();
+			throw runtime_error("gRPC server does not support transcoding");
+		}
+		target = stoi(string(tc->second.data(), tc->second.length()));
+	}
+}
+
+
+void RpcDevice::start() {
+	connect(session_channels, target_channel);
+	channel = session_channels[0];
 
+	terminating = false;
+	closing = false;
+	broken = false;
+	connected = true;
 	receiver = thread(&RpcDevice::packetReceiver, this);
+	sender = thread(&RpcDevice::packetSender, this);
 }
 
 
 void RpcDevice::stop() {
-	terminating = true;
+	bool active;
 
-	// Indicate to the server that we have no more packets to send
-	stream->WritesDone();
+	// Let the sender write the packets that are still queued. If the device
+	// is reconnecting, the receiver owns the stream and closes it itself.
+	{
+		lock_guard<std::mutex> lock(mutex);
+		terminating = true;
+		closing = true;
+		active = connected;
+		if (attempting) abandon();
+	}
+	wakeup.notify_all();
+	sender.join();
 
-	// Wait for the server to return the final status for the call to getChannel()
-	auto status = stream->Finish();
-	if (!status.ok())
-		throw runtime_error(status.error_message());
+	grpc::Status status;
+	if (active) {
+		// Indicate to the server that we have no more packets to send
+		stream->WritesDone();
+
+		// Wait for the server to return the final status for the call to getChannel()
+		status = stream->Finish();
+	}
 
 	// Wait for the packet reader thread to terminate
 	receiver.join();
+
+	if (!status.ok())
+		throw runtime_error(status.error_message());
 }
 
 
 int RpcDevice::channels() const {
-	return 1;
+	return transcoder ? 2 : channel_count;
+}
+
+
+bool RpcDevice::transcodes() const {
+	return transcoder;
 }
 
 
@@ -90,27 +237,891 @@ TaggedCallback RpcDevice::setCallback(TaggedCallback recv) {
 }
 
 
+// Queue a message for the sender. Must be called with the mutex held.
+void RpcDevice::enqueue(int32_t tag, const string& packet, bool cancel) {
+	if (count == queued.size()) queued.emplace_back();
+
+	auto& msg = queued[count++];
+	msg.set_tag(tag);
+	msg.set_data(packet);
+	msg.set_cancel(cancel);
+
+	if (!cancel) remember(packet);
+}
+
+
+// Keep CONTROL packets addressed to a channel in the profile. A packet
+// replaces the one sent earlier for the same channel and setting, RATET and
+// RATEP select the same setting. Must be called with the mutex held.
+void RpcDevice::remember(const string& data) {
+	if (data.size() <= sizeof(Header) + sizeof(ChannelField)) return;
+	if (((const Header*)data.data())->type != CONTROL) return;
+
+	Packet packet(data, uses_parity, false);
+	auto ch = packet.channel();
+	if (ch > 2) return;
+
+	auto field = packet.payload<Field>(sizeof(ChannelField))->type;
+	if (field == RATEP) field = RATET;
+
+	uint16_t key = ch << 8 | field;
+	for (auto& setting : profile) {
+		if (setting.first == key) {
+			setting.second = data;
+			return;
+		}
+	}
+	profile.emplace_back(key, data);
+}
+
+
 void RpcDevice::send(int32_t tag, const string& packet) {
-	rpc::Packet pkt;
-	pkt.set_tag(tag);
-	pkt.set_data(packet);
-	if (!stream->Write(pkt))
-		throw runtime_error("Error while sending packet");
+	{
+		lock_guard<std::mutex> lock(mutex);
+		if (broken || closing || (!connected && count >= max_backlog))
+			throw runtime_error("Error while sending packet");
+		enqueue(tag, packet, false);
+	}
+	wakeup.notify_all();
+}
+
+
+void RpcDevice::sendBatch(const vector<pair<int32_t, string>>& packets) {
+	{
+		lock_guard<std::mutex> lock(mutex);
+		if (broken || closing || (!connected && count >= max_backlog))
+			throw runtime_error("Error while sending packet");
+		for (auto& packet : packets) enqueue(packet.first, packet.second, false);
+	}
+	wakeup.notify_all();
+}
+
+
+void RpcDevice::cancel(int32_t tag) {
+	{
+		lock_guard<std::mutex> lock(mutex);
+
+		// Nothing to cancel on a stream that is gone
+		if (broken || closing || (!connected && count >= max_backlog)) return;
+		enqueue(tag, string(), true);
+	}
+	wakeup.notify_all();
+}
+
+
+void RpcDevice::fail(const vector<int32_t>& tags) {
+	if (recv) for (auto tag : tags) recv(tag, string(), false);
+}
+
+
+void RpcDevice::packetSender() {
+	vector<rpc::Packet> sending;
+	vector<int32_t> failed;
+	unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		wakeup.wait(lock, [this] { return (count && connected) || closing || broken; });
+		if (broken) return;
+
+		if (!connected) {
+			// The device is stopped while reconnecting. The packets still
+			// queued will never reach the server.
+			for (size_t i = 0; i < count; i++)
+				if (!queued[i].cancel()) failed.push_back(queued[i].tag());
+			count = 0;
+			lock.unlock();
+			fail(failed);
+			return;
+		}
+		if (!count) return;
+
+		// Take the queued messages. The messages written last time are
+		// handed back for reuse.
+		swap(sending, queued);
+		auto n = count;
+		count = 0;
+
+		bool replay = inflight_policy == InflightPolicy::REPLAY;
+		for (size_t i = 0; i < n; i++)
+			if (!sending[i].cancel())
+				inflight[sending[i].tag()] = replay ? sending[i].data() : string();
+
+		writing = true;
+		lock.unlock();
+		write(sending, n);
+		lock.lock();
+		writing = false;
+
+		// If the write failed, the stream is gone and the receiver takes
+		// care of the packets in flight
+		wakeup.notify_all();
+	}
+}
+
+
+// Write the first count messages. Servers that accept batches receive them
+// in as few batch messages as the flush threshold allows. Otherwise, the
+// messages are written one by one and the stream is corked between them.
+bool RpcDevice::write(vector<rpc::Packet>& messages, size_t count) {
+	if (remapped) {
+		for (size_t i = 0; i < count; i++)
+			remapChannel(*messages[i].mutable_data(), to_server, uses_parity, compand != Compand::NONE);
+	}
+
+	if (batching && count > 1) {
+		// Cleared elements are kept by the repeated field and reused. The
+		// data is swapped rather than copied into the batch.
+		auto packets = batch.mutable_batch()->mutable_packets();
+		for (size_t i = 0; i < count; ) {
+			packets->Clear();
+			for (size_t bytes = 0; i < count && bytes < flush_bytes; i++) {
+				auto pkt = packets->Add();
+				pkt->set_tag(messages[i].tag());
+				pkt->set_cancel(messages[i].cancel());
+				pkt->mutable_data()->swap(*messages[i].mutable_data());
+				bytes += pkt->data().size();
+			}
+			if (!stream->Write(batch)) return false;
+		}
+		return true;
+	}
+
+	size_t bytes = 0;
+	for (size_t i = 0; i < count; i++) {
+		bytes += messages[i].data().size();
+
+		grpc::WriteOptions options;
+		if (i + 1 < count && bytes < flush_bytes) options.set_buffer_hint();
+		else bytes = 0;
+
+		if (!stream->Write(messages[i], options)) return false;
+	}
+	return true;
+}
+
+
+// Forget the answered requests, move the packets back to the channels known
+// to the application, and pass them on
+void RpcDevice::deliver(rpc::Packet& message) {
+	{
+		lock_guard<std::mutex> lock(mutex);
+		if (message.has_batch()) {
+			for (auto& packet : message.batch().packets())
+				inflight.erase(packet.tag());
+		} else {
+			inflight.erase(message.tag());
+		}
+	}
+
+	if (remapped) {
+		if (message.has_batch()) {
+			for (auto& packet : *message.mutable_batch()->mutable_packets())
+				remapChannel(*packet.mutable_data(), to_client, uses_parity, compand != Compand::NONE);
+		} else {
+			remapChannel(*message.mutable_data(), to_client, uses_parity, compand != Compand::NONE);
+		}
+	}
+
+	if (recv) dispatch(message, recv);
 }
 
 
 void RpcDevice::packetReceiver() {
 	rpc::Packet packet;
 
-	while(stream->Read(&packet))
-		if (recv) recv(packet.tag(), packet.data());
+	do {
+		while(stream->Read(&packet))
+			deliver(packet);
+	} while (recover());
+}
+
+
+bool RpcDevice::recover() {
+	vector<int32_t> failed;
+	unique_lock<std::mutex> lock(mutex);
+
+	// The stream has been closed by stop()
+	if (terminating) return false;
+
+	cerr << "ambe: Lost connection to gRPC server (channel " << channel << ")" << endl;
+	connected = false;
+
+	// Requests in flight that are not going to be replayed are lost with
+	// the stream. Fail them right away rather than after the reconnect.
+	if (inflight_policy == InflightPolicy::FAIL || reconnect_timeout.count() == 0) {
+		for (auto& request : inflight) failed.push_back(request.first);
+		inflight.clear();
+	}
+
+	// Wait for the sender to stop using the stream
+	wakeup.wait(lock, [this] { return !writing; });
+	lock.unlock();
+
+	fail(failed);
+	failed.clear();
+	stream->Finish();
+
+	auto deadline = chrono::steady_clock::now() + reconnect_timeout;
+	auto backoff = min_backoff;
+	static thread_local mt19937 random(random_device{}());
+
+	while (true) {
+		// Wait between a half and the full backoff delay
+		auto delay = backoff / 2 + chrono::milliseconds(uniform_int_distribution<long>(0, backoff.count() / 2)(random));
+		auto now = chrono::steady_clock::now();
+
+		lock.lock();
+		if (now + delay >= deadline) break;
+		if (wakeup.wait_for(lock, delay, [this] { return terminating; })) break;
+		attempting = true;
+		aborted = false;
+		lock.unlock();
 
-	// If the connection to the server got close due to a reason other than the
-	// caller invoking the stop() method, report an error. We cannot easily
-	// re-establish the call because that would involve invoking getChannel()
-	// again which could potentiallly return a different channel. It's best to
-	// let the higher layer application code to handle the error.
+		if (!reconnect(deadline, backoff)) {
+			backoff = min(backoff * 2, max_backoff);
+			continue;
+		}
 
+		lock.lock();
+		if (terminating) {
+			lock.unlock();
+			stream->WritesDone();
+			stream->Finish();
+			lock.lock();
+			break;
+		}
+
+		cerr << "ambe: Reconnected to gRPC server (channel " << channel << ")" << endl;
+		connected = true;
+		wakeup.notify_all();
+		return true;
+	}
+
+	// Give up. Fail all pending requests, later sends throw.
 	if (!terminating)
-		throw runtime_error("Lost connection to gRPC server");
+		cerr << "ambe: Giving up reconnecting to gRPC server (channel " << channel << ")" << endl;
+
+	broken = true;
+	for (auto& request : inflight) failed.push_back(request.first);
+	inflight.clear();
+	for (size_t i = 0; i < count; i++)
+		if (!queued[i].cancel()) failed.push_back(queued[i].tag());
+	count = 0;
+	wakeup.notify_all();
+	lock.unlock();
+
+	fail(failed);
+	return false;
+}
+
+
+bool RpcDevice::reconnect(chrono::steady_clock::time_point deadline, chrono::milliseconds wait) {
+	// A deadline set on the context would end the new stream too. Cancel
+	// the attempt instead if it has not succeeded when the device gives up.
+	thread watchdog([this, deadline] {
+		unique_lock<std::mutex> lock(mutex);
+		if (!wakeup.wait_until(lock, deadline, [this] { return !attempting; }))
+			abandon();
+	});
+
+	// Calls fail right away while the channel is down. Wait for gRPC to
+	// re-establish the connection instead, so that the session is re-bound
+	// as soon as the server is back.
+	bool rv = true;
+	vector<int> leased;
+	int tc = -1;
+	try {
+		auto until = min<chrono::steady_clock::duration>(wait, deadline - chrono::steady_clock::now());
+		if (!connection->WaitForConnected(chrono::system_clock::now() + until))
+			throw runtime_error("Not connected");
+		connect(leased, tc);
+	} catch(const exception& e) {
+		rv = false;
+	}
+
+	if (rv) {
+		// Map the channels the application knows to those of the new
+		// session. A transcoding session has two.
+		to_server = {0, 1, 2};
+		to_client = {0, 1, 2};
+		remapped = false;
+		for (size_t i = 0; i < leased.size(); i++) {
+			to_server[session_channels[i]] = leased[i];
+			to_client[leased[i]] = session_channels[i];
+			remapped = remapped || leased[i] != session_channels[i];
+		}
+		if (transcoder) {
+			to_server[target_channel] = tc;
+			to_client[tc] = target_channel;
+			remapped = remapped || tc != target_channel;
+		}
+
+		rv = restore();
+		if (!rv) {
+			stream->WritesDone();
+			stream->Finish();
+		}
+	}
+
+	{
+		lock_guard<std::mutex> lock(mutex);
+		attempting = false;
+	}
+	wakeup.notify_all();
+	watchdog.join();
+	return rv;
+}
+
+
+void RpcDevice::abandon() {
+	aborted = true;
+	context->TryCancel();
+}
+
+
+// Send the channel profile and the requests to be replayed over a new stream.
+// Called by the receiver while the sender is idle. The responses to the
+// profile carry tag 0 and are consumed here.
+bool RpcDevice::restore() {
+	vector<string> settings;
+	vector<rpc::Packet> replay;
+	{
+		lock_guard<std::mutex> lock(mutex);
+		for (auto& setting : profile) settings.push_back(setting.second);
+
+		if (inflight_policy == InflightPolicy::REPLAY) {
+			for (auto& request : inflight) {
+				replay.emplace_back();
+				replay.back().set_tag(request.first);
+				replay.back().set_data(request.second);
+			}
+		}
+	}
+
+	rpc::Packet message;
+	for (auto& setting : settings) {
+		remapChannel(setting, to_server, uses_parity, compand != Compand::NONE);
+		message.set_data(setting);
+		if (!stream->Write(message)) return false;
+	}
+
+	for (size_t answered = 0; answered < settings.size(); ) {
+		if (!stream->Read(&message)) return false;
+
+		if (!message.has_batch()) {
+			if (message.tag()) deliver(message);
+			else if (message.data().empty()) return false;
+			else answered++;
+			continue;
+		}
+
+		for (auto& packet : message.batch().packets()) {
+			if (packet.tag()) {
+				rpc::Packet single;
+				single.set_tag(packet.tag());
+				single.set_data(packet.data());
+				deliver(single);
+			} else if (packet.data().empty()) {
+				return false;
+			} else {
+				answered++;
+			}
+		}
+	}
+
+	// Replayed requests stay in flight until answered
+	return replay.empty() || write(replay, replay.size());
+}
+
+
+RpcConnection::RpcConnection(shared_ptr<grpc::ChannelInterface> channel) :
+	stub(channel), service(rpc::AmbeService::NewStub(channel)),
+	cq(make_shared<grpc::CompletionQueue>()) {
+	runner = thread(&RpcConnection::run, cq);
+}
+
+
+RpcConnection::~RpcConnection() {
+	// All devices hold a reference to the connection, i.e., there are no
+	// outstanding operations on the completion queue at this point.
+	cq->Shutdown();
+
+	// The last reference may be dropped by a callback invoked from the
+	// runner, which cannot join itself. It finishes on its own once it
+	// returns to the queue.
+	if (runner.get_id() == this_thread::get_id()) runner.detach();
+	else runner.join();
+}
+
+
+shared_ptr<RpcConnection> RpcConnection::get(const string& authority) {
+	static std::mutex lock;
+	static unordered_map<string, weak_ptr<RpcConnection>> pool;
+
+	lock_guard<std::mutex> guard(lock);
+	auto& entry = pool[authority];
+	auto rv = entry.lock();
+	if (!rv) {
+		rv = make_shared<RpcConnection>(grpc::CreateChannel(authority, grpc::InsecureChannelCredentials()));
+		entry = rv;
+	}
+	return rv;
+}
+
+
+// Append the addresses of a gRPC target to the list. Host names are
+// resolved here only if they have several addresses of the same family
+// (e.g., localhost typically resolves to one IPv4 and one IPv6 address of the
+// same server). Other targets are left to gRPC.
+static void resolveTarget(const string& target, vector<string>& targets) {
+	auto name = target;
+	if (name.compare(0, 6, "dns://") == 0) {
+		auto slash = name.find('/', 6);
+		name = slash == string::npos ? string() : name.substr(slash + 1);
+	} else if (name.compare(0, 4, "dns:") == 0) {
+		name = name.substr(4);
+	}
+
+	auto colon = name.rfind(':');
+	if (name.compare(0, 4, "unix") == 0 || name.empty() || name[0] == '['
+		|| colon == string::npos || name.find(':') != colon) {
+		targets.push_back(target);
+		return;
+	}
+
+	auto host = name.substr(0, colon);
+	auto port = name.substr(colon + 1);
+
+	struct addrinfo hints = {}, *res;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res)) {
+		targets.push_back(target);
+		return;
+	}
+
+	vector<string> v4, v6;
+	char buf[INET6_ADDRSTRLEN];
+	for (auto ai = res; ai; ai = ai->ai_next) {
+		if (ai->ai_family == AF_INET) {
+			inet_ntop(AF_INET, &((sockaddr_in*)ai->ai_addr)->sin_addr, buf, sizeof(buf));
+			auto address = string(buf) + ":" + port;
+			if (find(v4.begin(), v4.end(), address) == v4.end()) v4.push_back(address);
+		} else if (ai->ai_family == AF_INET6) {
+			inet_ntop(AF_INET6, &((sockaddr_in6*)ai->ai_addr)->sin6_addr, buf, sizeof(buf));
+			auto address = "[" + string(buf) + "]:" + port;
+			if (find(v6.begin(), v6.end(), address) == v6.end()) v6.push_back(address);
+		}
+	}
+	freeaddrinfo(res);
+
+	if      (v4.size() > 1) targets.insert(targets.end(), v4.begin(), v4.end());
+	else if (v6.size() > 1) targets.insert(targets.end(), v6.begin(), v6.end());
+	else                    targets.push_back(target);
+}
+
+
+vector<shared_ptr<RpcConnection>> RpcConnection::balance(const string& authority, chrono::milliseconds timeout) {
+	vector<string> targets;
+	size_t start = 0;
+	while (start <= authority.size()) {
+		auto end = authority.find(',', start);
+		if (end == string::npos) end = authority.size();
+		auto target = grpcAddress(authority.substr(start, end - start));
+		start = end + 1;
+		if (!target.empty()) resolveTarget(target, targets);
+	}
+
+	if (targets.empty())
+		throw runtime_error("No gRPC server given");
+
+	vector<shared_ptr<RpcConnection>> rv;
+	for (auto& target : targets) rv.push_back(get(target));
+	if (rv.size() == 1) return rv;
+
+	// Query all servers at once
+	struct Query {
+		grpc::ClientContext context;
+		rpc::Capacity reply;
+		grpc::Status status;
+		unique_ptr<grpc::ClientAsyncResponseReader<rpc::Capacity>> call;
+	};
+
+	grpc::CompletionQueue cq;
+	vector<Query> queries(rv.size());
+	auto deadline = chrono::system_clock::now() + timeout;
+
+	for (size_t i = 0; i < rv.size(); i++) {
+		auto& q = queries[i];
+		q.context.set_deadline(deadline);
+		q.call = rv[i]->service->Asynccapacity(&q.context, rpc::CapacityRequest(), &cq);
+		q.call->Finish(&q.reply, &q.status, &q);
+	}
+
+	void* tag;
+	bool ok;
+	for (size_t i = 0; i < queries.size(); i++) cq.Next(&tag, &ok);
+	cq.Shutdown();
+	while (cq.Next(&tag, &ok));
+
+	// Servers that do not support the query may well have channels free,
+	// try them after those known to have some
+	vector<pair<long, shared_ptr<RpcConnection>>> ranked;
+	for (size_t i = 0; i < rv.size(); i++) {
+		auto& q = queries[i];
+		long free = -1;
+		if (q.status.ok()) free = q.reply.free();
+		else if (q.status.error_code() == grpc::StatusCode::UNIMPLEMENTED) free = 0;
+		ranked.emplace_back(free, rv[i]);
+	}
+
+	static thread_local mt19937 random(random_device{}());
+	shuffle(ranked.begin(), ranked.end(), random);
+	stable_sort(ranked.begin(), ranked.end(), [](auto& a, auto& b) { return a.first > b.first; });
+
+	for (size_t i = 0; i < rv.size(); i++) rv[i] = ranked[i].second;
+	return rv;
+}
+
+
+void RpcConnection::run(shared_ptr<grpc::CompletionQueue> cq) {
+	void* tag;
+	bool ok;
+
+	while (cq->Next(&tag, &ok)) {
+		auto event = static_cast<MuxRpcDevice::Event*>(tag);
+		event->device->handle(event->op, ok);
+	}
+}
+
+
+MuxRpcDevice::MuxRpcDevice(shared_ptr<RpcConnection> connection) :
+	connection(connection), done(finished.get_future().share()) {
+	for (int i = 0; i < OPS; i++)
+		events[i] = {this, (Op)i};
+}
+
+
+void MuxRpcDevice::start() {
+	{
+		lock_guard<std::mutex> lock(mutex);
+		context.AddMetadata("batch", "1");
+		stream = connection->stub.PrepareCall(&context, method(), connection->cq.get());
+		issue(START);
+	}
+
+	// Wait for the initial metadata which tells us what channel we got. If
+	// the server rejects the call, wait for the stream to terminate before
+	// reporting the error so that no operations remain outstanding.
+	try {
+		started.get_future().get();
+	} catch(...) {
+		done.wait();
+		if (!status.ok()) throw runtime_error(status.error_message());
+		throw;
+	}
+}
+
+
+void MuxRpcDevice::stop() {
+	{
+		lock_guard<std::mutex> lock(mutex);
+		closing = true;
+
+		// Indicate to the server that we have no more packets to send. If a
+		// write is in progress, this will be done once the write queue has
+		// been drained.
+		if (!writing && !broken && !finishing) issue(WRITES_DONE);
+	}
+
+	// Wait for the server to return the final status
+	done.wait();
+	if (!status.ok())
+		throw runtime_error(status.error_message());
+}
+
+
+int MuxRpcDevice::channels() const {
+	return 1;
+}
+
+
+grpc::StatusCode MuxRpcDevice::statusCode() const {
+	return status.error_code();
+}
+
+
+const char* MuxRpcDevice::method() const {
+	return "/ambe.rpc.AmbeService/bind";
+}
+
+
+WireMessage MuxRpcDevice::encode(int32_t tag, const string& packet) {
+	return WireMessage(tag, WireMessage::DATA, packet.data(), packet.length());
+}
+
+
+void MuxRpcDevice::deliver(rpc::Packet& msg, const TaggedCallback& recv) {
+	recv(msg.tag(), msg.data(), msg.busy());
+}
+
+
+TaggedCallback MuxRpcDevice::setCallback(TaggedCallback recv) {
+	lock_guard<std::mutex> lock(mutex);
+	TaggedCallback old = this->recv;
+	this->recv = recv;
+	return old;
+}
+
+
+void MuxRpcDevice::send(int32_t tag, const string& packet) {
+	lock_guard<std::mutex> lock(mutex);
+
+	if (broken || closing)
+		throw runtime_error("Error while sending packet");
+
+	writes.push(encode(tag, packet));
+	inflight.insert(tag);
+
+	if (!writing) issue(WRITE);
+}
+
+
+void MuxRpcDevice::sendBatch(const vector<pair<int32_t, string>>& packets) {
+	lock_guard<std::mutex> lock(mutex);
+
+	if (broken || closing)
+		throw runtime_error("Error while sending packet");
+
+	for (auto& packet : packets) {
+		writes.push(encode(packet.first, packet.second));
+		inflight.insert(packet.first);
+	}
+
+	if (!writing) issue(WRITE);
+}
+
+
+void MuxRpcDevice::cancel(int32_t tag) {
+	lock_guard<std::mutex> lock(mutex);
+
+	// Nothing to cancel on a stream that is gone
+	if (broken || closing) return;
+
+	writes.push(WireMessage::cancel(tag));
+
+	if (!writing) issue(WRITE);
+}
+
+
+// Start an asynchronous operation. Must be called with the mutex held.
+void MuxRpcDevice::issue(Op op) {
+	auto tag = &events[op];
+	outstanding++;
+
+	switch(op) {
+	case START:       stream->StartCall(tag);                    break;
+	case METADATA:    stream->ReadInitialMetadata(tag);          break;
+	case READ:        stream->Read(&incoming, tag);              break;
+	case WRITE:
+		// Gather everything that has been queued since the last write into
+		// a single message if the server supports batches
+		outgoing = WireMessage::serialize(writes, batching ? writes.size() : 1);
+		writing = true;
+		stream->Write(outgoing, tag);
+		break;
+	case WRITES_DONE: stream->WritesDone(tag);                   break;
+	case FINISH:      finishing = true; stream->Finish(&status, tag); break;
+	default: throw logic_error("Bug: Invalid stream operation");
+	}
+}
+
+
+// Invoked by the connection's thread when an operation has completed
+void MuxRpcDevice::handle(Op op, bool ok) {
+	unique_lock<std::mutex> lock(mutex);
+	outstanding--;
+
+	switch(op) {
+	case START:
+		if (ok) issue(METADATA);
+		else issue(FINISH);
+		break;
+
+	case METADATA:
+		if (ok && parseMetadata(context.GetServerInitialMetadata(), *this, channel)) {
+			batching = batchesAccepted(context.GetServerInitialMetadata());
+			started.set_value();
+			issue(READ);
+		} else {
+			// A server that rejects the call (e.g., because it has no
+			// channels left) sends no metadata and terminates the call
+			// right away. Cancel calls from servers that sent something
+			// unexpected.
+			broken = true;
+			if (ok && !context.GetServerInitialMetadata().empty()) context.TryCancel();
+			issue(FINISH);
+		}
+		break;
+
+	case READ:
+		if (!ok) {
+			// The server has closed the stream. If the caller did not ask
+			// for it, there will be no more responses. Fail the requests
+			// still in flight, so that nobody waits for them.
+			if (!closing)
+				cerr << "ambe: Lost connection to gRPC server (channel " << channel << ")" << endl;
+			broken = true;
+			issue(FINISH);
+
+			vector<int32_t> failed(inflight.begin(), inflight.end());
+			inflight.clear();
+			auto callback = recv;
+			lock.unlock();
+			if (callback)
+				for (auto tag : failed) callback(tag, string(), false);
+			lock.lock();
+			break;
+		}
+
+		{
+			// The parser is only used here and the next read is started
+			// after the message has been delivered
+			auto callback = recv;
+			grpc::ByteBuffer buffer;
+			buffer.Swap(&incoming);
+			lock.unlock();
+			auto message = parser.parse(buffer);
+			lock.lock();
+
+			if (!message) {
+				cerr << "ambe: Dropping malformed message from gRPC server" << endl;
+			} else {
+				// Answered requests are not failed if the stream breaks
+				if (message->has_batch()) {
+					for (auto& pkt : message->batch().packets()) inflight.erase(pkt.tag());
+				} else {
+					inflight.erase(message->tag());
+				}
+
+				lock.unlock();
+				if (callback) {
+					if (message->has_batch()) {
+						for (auto& pkt : *message->mutable_batch()->mutable_packets())
+							deliver(pkt, callback);
+					} else {
+						deliver(*message, callback);
+					}
+				}
+				lock.lock();
+			}
+		}
+		if (!finishing) issue(READ);
+		break;
+
+	case WRITE:
+		writing = false;
+		outgoing.Clear();
+		if (!ok) {
+			broken = true;
+			writes = queue<WireMessage>();
+		} else if (!writes.empty()) {
+			issue(WRITE);
+		} else if (closing && !finishing) {
+			issue(WRITES_DONE);
+		}
+		break;
+
+	case WRITES_DONE:
+		// The server will close the stream which terminates the read loop
+		break;
+
+	case FINISH:
+		finishing = false;
+		finished_ = true;
+		break;
+
+	default:
+		throw logic_error("Bug: Invalid stream operation");
+	}
+
+	// Only signal termination once no operation refers to this object
+	// anymore, the device can be destroyed right after stop() returns.
+	if (finished_ && !outstanding) {
+		finished_ = false;
+
+		// Report a failed call setup to start() if it is still waiting
+		try {
+			started.set_exception(make_exception_ptr(runtime_error("Error while connecting to gRPC server")));
+		} catch(const future_error&) {}
+
+		finished.set_value();
+	}
+}
+
+
+FrameRpcDevice::FrameRpcDevice(shared_ptr<RpcConnection> connection) :
+	MuxRpcDevice(connection) {
+}
+
+
+const char* FrameRpcDevice::method() const {
+	return "/ambe.rpc.AmbeService/frames";
+}
+
+
+WireMessage FrameRpcDevice::encode(int32_t tag, const string& packet) {
+	// Read the fields in place instead of constructing a Packet, which
+	// would copy the packet
+	Header::check(packet);
+	auto type = ((const Header*)packet.data())->type;
+	if (type == CONTROL)
+		return WireMessage(tag, WireMessage::DATA, packet.data(), packet.length());
+
+	// SPEECH and CHANNEL packets start with a channel field followed by the
+	// SPCHD or CHAND field, both consist of a type and a count
+	size_t offset = sizeof(Header) + sizeof(ChannelField) + sizeof(ChandField);
+	if (packet.length() < offset)
+		throw runtime_error("Packet too short to have given payload type");
+
+	uint8_t count = packet[offset - 1];
+	size_t length = type == SPEECH ? count * sizeof(int16_t) : AmbeFrame::byteLength(count);
+	if (packet.length() < offset + length)
+		throw runtime_error("Packet too short to have given payload type");
+
+	if (type == SPEECH)
+		return WireMessage(tag, WireMessage::SAMPLES, packet.data() + offset, length);
+	return WireMessage(tag, WireMessage::BITS, packet.data() + offset, length, count);
+}
+
+
+void FrameRpcDevice::deliver(rpc::Packet& msg, const TaggedCallback& recv) {
+	if (msg.data().length()) {
+		recv(msg.tag(), msg.data(), false);
+		return;
+	}
+
+	// A message without payload indicates a rejected request. Deliver an
+	// empty packet so that the request completes with an error.
+	if (!msg.samples().length() && !msg.bits().length()) {
+		recv(msg.tag(), string(), msg.busy());
+		return;
+	}
+
+	Packet pkt;
+
+	if (msg.samples().length()) {
+		size_t n = msg.samples().length() / sizeof(int16_t);
+		pkt = Packet(SPEECH);
+		pkt.append<ChannelField>(channel);
+		pkt.append<SpchdField>(n);
+		memcpy(pkt.appendArray<int16_t>(n), msg.samples().data(), n * sizeof(int16_t));
+	} else {
+		pkt = Packet(CHANNEL);
+		pkt.append<ChannelField>(channel);
+		pkt.append<ChandField>(msg.bit_count());
+		memcpy(pkt.appendArray<char>(msg.bits().length()), msg.bits().data(), msg.bits().length());
+	}
+
+	recv(msg.tag(), pkt.finalize(false), false);
 }
@@ -21,10 +21,22 @@
 
 #include <memory>
 #include <string>
+#include <queue>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <array>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
 #include <grpc++/grpc++.h>
+#include <grpcpp/generic/generic_stub.h>
 #include "device.h"
 #include "ambe.grpc.pb.h"
 #include "queue.h"
+#include "wire.h"
 
 using namespace std;
 
@@ -34,7 +46,30 @@ namespace ambe {
 	public:
 		int channel;
 
-		RpcDevice(shared_ptr<grpc::ChannelInterface> channel);
+		// The target channel of a transcoding session, -1 otherwise
+		int target_channel = -1;
+
+		// The number of channels a regular session leases on the server.
+		// Set it before start(); servers that do not support multi-channel
+		// sessions are refused. Once started, session_channels lists the
+		// channels of the session, the first one is channel.
+		unsigned int channel_count = 1;
+		vector<int> session_channels;
+
+		// What to do with the requests in flight when the connection to the
+		// server breaks. FAIL completes them with an empty response right
+		// away, REPLAY sends them again once the device has reconnected.
+		enum class InflightPolicy { FAIL, REPLAY };
+		InflightPolicy inflight_policy = InflightPolicy::FAIL;
+
+		// How long to keep trying to reconnect after the connection to the
+		// server broke before giving up. Zero disables reconnects. Once the
+		// device gives up, all pending requests fail and later sends throw.
+		chrono::milliseconds reconnect_timeout = chrono::seconds(30);
+
+		// If transcoder is true, the device opens a transcoding session with
+		// two channels on the server instead of a regular session.
+		RpcDevice(shared_ptr<grpc::ChannelInterface> channel, bool transcoder=false);
 
 		virtual void start() override;
 		virtual void stop() override;
@@ -43,17 +78,263 @@ namespace ambe {
 
 		virtual TaggedCallback setCallback(TaggedCallback recv) override;
 		virtual void send(int32_t tag, const string& packet) override;
+		virtual void sendBatch(const vector<pair<int32_t, string>>& packets) override;
+		virtual bool transcodes() const override;
+		virtual void cancel(int32_t tag) override;
 
 	private:
+		// Corked writes are flushed once this many bytes have been written
+		static const size_t flush_bytes = 16384;
+
+		// The delay between reconnect attempts grows from min_backoff to
+		// max_backoff. Each delay is randomized so that the clients of a
+		// restarted server do not all reconnect at the same time.
+		static constexpr chrono::milliseconds min_backoff{100};
+		static constexpr chrono::milliseconds max_backoff{5000};
+
+		// Sends throw while the device is reconnecting and this many
+		// messages are already waiting for the sender
+		static const size_t max_backlog = 1024;
+
+		bool transcoder;
+
+		// True if the server accepted packet batches on the stream
+		bool batching = false;
 		bool terminating;
 		void packetReceiver();
 
+		// Open the stream and read the session parameters sent by the
+		// server. Throws runtime_error on failure.
+		void connect(vector<int>& leased, int& target);
+
+		// Called by the receiver when the stream has ended. Re-establishes
+		// the session and returns true, or returns false if the device is
+		// being stopped or has given up.
+		bool recover();
+
+		// Make one attempt to re-establish the session before the deadline:
+		// open a new stream, map the channels, and restore the profile.
+		bool reconnect(chrono::steady_clock::time_point deadline, chrono::milliseconds wait);
+		bool restore();
+
+		// Cancel the reconnect attempt in progress. Called with the mutex
+		// held.
+		void abandon();
+		void deliver(rpc::Packet& message);
+		void remember(const string& packet);
+		void fail(const vector<int32_t>& tags);
+
+		// Packets are written to the stream by a separate thread, so that
+		// send never waits for the network. The sender takes everything that
+		// has been queued since its last write and writes it corked (see
+		// grpc::WriteOptions::set_buffer_hint) until the queue has been
+		// drained or flush_bytes have been written.
+		void packetSender();
+		void enqueue(int32_t tag, const string& packet, bool cancel);
+		bool write(vector<rpc::Packet>& messages, size_t count);
+
 		TaggedCallback recv;
 
+		shared_ptr<grpc::ChannelInterface> connection;
 		unique_ptr<rpc::AmbeService::Stub> stub;
-		grpc::ClientContext context;
+		unique_ptr<grpc::ClientContext> context;
 		unique_ptr<grpc::ClientReaderWriter<rpc::Packet, rpc::Packet>> stream;
 
+		// Packets waiting for the sender. The messages are reused to avoid
+		// allocations, only the first count elements are queued.
+		std::mutex mutex;
+		condition_variable wakeup;
+		vector<rpc::Packet> queued;
+		size_t count = 0;
+		bool closing = false;
+		bool broken = false;
+
+		// False while the receiver re-establishes a broken session. The
+		// sender does not touch the stream then. Writing is true while the
+		// sender writes outside of the mutex.
+		bool connected = false;
+		bool writing = false;
+
+		// True while the receiver makes a reconnect attempt. The attempt is
+		// aborted through the context if the device is stopped or gives up
+		// in the meantime. The context is replaced under the mutex.
+		bool attempting = false;
+		bool aborted = false;
+
+		// Requests handed to the stream that have not been answered yet, with
+		// their packets if they are to be replayed
+		unordered_map<int32_t, string> inflight;
+
+		// The channel configuration (rate, init, etc.) of the session, the
+		// last CONTROL packet sent for each channel and setting. It is sent
+		// to the server again after a reconnect.
+		vector<pair<uint16_t, string>> profile;
+
+		// The server may assign different channels to a re-established
+		// session. The channel numbers seen by the application stay the same
+		// and packets are moved between the channels on the way.
+		bool remapped = false;
+		array<uint8_t, 3> to_server = {0, 1, 2};
+		array<uint8_t, 3> to_client = {0, 1, 2};
+
+		// Used by write() only, which runs in the sender or, while the
+		// sender is idle during a reconnect, in the receiver
+		rpc::Packet batch;
+
 		thread receiver;
+		thread sender;
+	};
+
+
+	class MuxRpcDevice;
+
+	/**
+	 * A gRPC connection shared by several devices
+	 *
+	 * All MuxRpcDevice instances created over the same connection share a
+	 * single HTTP/2 connection to the server and a single thread which drives
+	 * their streams from a common completion queue. This allows a process to
+	 * open hundreds of channels without opening a connection and starting a
+	 * receiver thread for each.
+	 */
+	class RpcConnection {
+	public:
+		RpcConnection(shared_ptr<grpc::ChannelInterface> channel);
+		~RpcConnection();
+
+		// Return the pooled connection to the server with the given
+		// authority, creating a new one if necessary. The connection is
+		// closed when the last reference to it is released.
+		static shared_ptr<RpcConnection> get(const string& authority);
+
+		// Return pooled connections to all servers named by the authority, a
+		// comma-separated list of gRPC targets, each passed through
+		// grpcAddress. Host names that resolve to several addresses stand
+		// for one server per address. If there are
+		// several servers, they are asked for their capacity and ordered by
+		// the number of free channels, most first. Servers with the same
+		// number are shuffled so that clients spread over them. Servers that
+		// do not answer within the timeout come last.
+		static vector<shared_ptr<RpcConnection>> balance(const string& authority, chrono::milliseconds timeout);
+
+	private:
+		friend class MuxRpcDevice;
+		friend class FrameRpcDevice;
+		static void run(shared_ptr<grpc::CompletionQueue> cq);
+
+		// Devices exchange raw buffers with the server, see wire.h
+		grpc::GenericStub stub;
+
+		// Used for capacity queries
+		unique_ptr<rpc::AmbeService::Stub> service;
+
+		// Shared with the runner thread, which may release the last
+		// reference to the connection from a device's callback and then
+		// outlive it
+		shared_ptr<grpc::CompletionQueue> cq;
+		thread runner;
+	};
+
+
+	/**
+	 * A remote channel multiplexed over a shared connection
+	 *
+	 * Like RpcDevice, but the bind stream is driven asynchronously by the
+	 * connection's thread. Responses are delivered to the callback from
+	 * that thread, so the callback must not block.
+	 */
+	class MuxRpcDevice : public TaggingDevice {
+	public:
+		int channel;
+
+		MuxRpcDevice(shared_ptr<RpcConnection> connection);
+
+		virtual void start() override;
+		virtual void stop() override;
+
+		virtual int channels() const override;
+
+		virtual TaggedCallback setCallback(TaggedCallback recv) override;
+		virtual void send(int32_t tag, const string& packet) override;
+		virtual void sendBatch(const vector<pair<int32_t, string>>& packets) override;
+		virtual void cancel(int32_t tag) override;
+
+		// The status the server terminated the stream with. Only valid after
+		// start() has failed or stop() has returned.
+		grpc::StatusCode statusCode() const;
+
+	protected:
+		// The full name of the streaming method the device calls
+		virtual const char* method() const;
+
+		// Convert an outgoing packet into a message and a received message
+		// (never a batch) back into a packet for the callback
+		virtual WireMessage encode(int32_t tag, const string& packet);
+		virtual void deliver(rpc::Packet& msg, const TaggedCallback& recv);
+
+		shared_ptr<RpcConnection> connection;
+		grpc::ClientContext context;
+
+	private:
+		friend class RpcConnection;
+
+		// Asynchronous operations on the stream. At most one operation of
+		// each type can be outstanding at any time.
+		enum Op { START, METADATA, READ, WRITE, WRITES_DONE, FINISH, OPS };
+
+		struct Event {
+			MuxRpcDevice* device;
+			Op op;
+		};
+
+		void handle(Op op, bool ok);
+		void issue(Op op);
+
+		unique_ptr<grpc::GenericClientAsyncReaderWriter> stream;
+		Event events[OPS];
+
+		TaggedCallback recv;
+		grpc::ByteBuffer incoming;
+		grpc::ByteBuffer outgoing;
+		WireParser parser;
+		grpc::Status status;
+
+		std::mutex mutex;
+		queue<WireMessage> writes;
+		unsigned int outstanding = 0;
+		bool writing = false;
+		bool closing = false;
+		bool broken = false;
+		bool finishing = false;
+		bool finished_ = false;
+		bool batching = false;
+
+		// Requests sent but not answered yet. They are failed if the
+		// stream breaks.
+		unordered_set<int32_t> inflight;
+
+		promise<void> started;
+		promise<void> finished;
+		shared_future<void> done;
+	};
+
+
+	/**
+	 * A remote channel that exchanges frames instead of packets
+	 *
+	 * Uses the frames call: only the samples or AMBE bits of SPEECH and
+	 * CHANNEL packets are sent to the server, which builds the packets for
+	 * the chip itself. Responses are turned back into packets without parity
+	 * so that the device can be used with the regular schedulers and API.
+	 * Servers that do not implement the call reject it with UNIMPLEMENTED.
+	 */
+	class FrameRpcDevice : public MuxRpcDevice {
+	public:
+		FrameRpcDevice(shared_ptr<RpcConnection> connection);
+
+	protected:
+		virtual const char* method() const override;
+		virtual WireMessage encode(int32_t tag, const string& packet) override;
+		virtual void deliver(rpc::Packet& msg, const TaggedCallback& recv) override;
 	};
 }
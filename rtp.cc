@@ -0,0 +1,582 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "rtp.h"
+#include <iostream>
+#include <cstring>
+#include <random>
+#include <system_error>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+using namespace std;
+using namespace ambe;
+
+
+// The largest payload sent by the gateway is one frame of L16 audio
+static const size_t MAX_PAYLOAD = FRAME_SIZE * sizeof(int16_t);
+
+// Number of datagrams received or sent with a single system call
+static const unsigned int BATCH_SIZE = 32;
+
+// Large enough for any datagram that fits into an Ethernet frame
+static const size_t RECV_SIZE = 1500;
+
+
+struct __attribute__ ((packed)) RtpHeader {
+	uint8_t  flags;     // Version, padding, extension, CSRC count
+	uint8_t  mpt;       // Marker and payload type
+	uint16_t seq;
+	uint32_t timestamp;
+	uint32_t ssrc;
+};
+
+static_assert(sizeof(RtpHeader) == 12);
+
+
+// One direction of a session: datagrams sent from the session's socket to
+// the configured peer. RTP state is only modified with the gateway's mutex
+// held.
+struct RtpGateway::Output {
+	int fd = -1;
+	sockaddr_storage peer;
+	socklen_t peer_len = 0;
+	bool rtp = true;
+	uint8_t pt = 0;
+	uint16_t seq = 0;
+	uint32_t timestamp = 0;
+	uint32_t ssrc = 0;
+	bool marker = true;
+};
+
+
+struct RtpGateway::Session {
+	RtpConfig config;
+	pair<string, vector<size_t>> channels;
+	uint8_t channel = 0;
+	unique_ptr<API> api;
+
+	int audio_fd = -1;
+	int ambe_fd = -1;
+	uint8_t audio_pt = 0;
+
+	Output to_audio;
+	Output to_ambe;
+
+	// Linear big endian samples received that do not form a full frame yet
+	vector<int16_t> pending;
+};
+
+
+struct RtpGateway::Datagram {
+	int fd;
+	const sockaddr_storage* peer;
+	socklen_t peer_len;
+	size_t length;
+	char data[sizeof(RtpHeader) + MAX_PAYLOAD];
+};
+
+
+static RtpCodec parseCodec(const string& value) {
+	if (value == "pcmu") return RtpCodec::PCMU;
+	if (value == "pcma") return RtpCodec::PCMA;
+	if (value == "l16")  return RtpCodec::L16;
+	throw runtime_error("Unsupported codec " + value + " (expected pcmu, pcma, or l16)");
+}
+
+
+static unsigned int parseNumber(const string& key, const string& value, unsigned int max) {
+	size_t end;
+	unsigned long rv;
+	try {
+		rv = stoul(value, &end);
+	} catch(const logic_error& e) {
+		throw runtime_error("Invalid value of " + key + ": " + value);
+	}
+	if (end != value.size() || rv > max)
+		throw runtime_error("Invalid value of " + key + ": " + value);
+	return rv;
+}
+
+
+RtpConfig RtpConfig::parse(const string& spec) {
+	RtpConfig rv;
+	string* last = nullptr;
+
+	size_t start = 0;
+	while (start <= spec.size()) {
+		auto end = spec.find(',', start);
+		if (end == string::npos) end = spec.size();
+		auto item = spec.substr(start, end - start);
+		start = end + 1;
+
+		auto eq = item.find('=');
+		if (eq == string::npos) {
+			// The rate may be a comma-separated list of rate control words
+			if (last != &rv.rate) throw runtime_error("Invalid gateway option " + item);
+			rv.rate += "," + item;
+			continue;
+		}
+
+		auto key = item.substr(0, eq);
+		auto value = item.substr(eq + 1);
+		last = nullptr;
+
+		if      (key == "codec")      rv.codec = parseCodec(value);
+		else if (key == "audio")      rv.audio = value;
+		else if (key == "audio_peer") rv.audio_peer = value;
+		else if (key == "ambe")       rv.ambe = value;
+		else if (key == "ambe_peer")  rv.ambe_peer = value;
+		else if (key == "bits")       rv.bits = parseNumber(key, value, 255);
+		else if (key == "audio_pt")   rv.audio_pt = parseNumber(key, value, 127);
+		else if (key == "ambe_pt")    rv.ambe_pt = parseNumber(key, value, 127);
+		else if (key == "rate") {
+			rv.rate = value;
+			last = &rv.rate;
+		} else if (key == "framing") {
+			if (value == "rtp") rv.raw = false;
+			else if (value == "raw") rv.raw = true;
+			else throw runtime_error("Invalid framing " + value + " (expected rtp or raw)");
+		} else {
+			throw runtime_error("Unknown gateway option " + key);
+		}
+	}
+
+	if (rv.audio.empty() || rv.audio_peer.empty() || rv.ambe.empty() || rv.ambe_peer.empty())
+		throw runtime_error("Gateway sessions need the options audio, audio_peer, ambe, and ambe_peer");
+
+	if (!rv.bits)
+		throw runtime_error("The number of bits per frame must not be zero");
+
+	// Validate the rate right away
+	Rate(rv.rate.c_str());
+	return rv;
+}
+
+
+// Resolve [host:]port. Hosts in IPv6 notation must be enclosed in brackets.
+static void resolve(const string& address, bool local, sockaddr_storage& addr, socklen_t& len) {
+	string host, port;
+
+	auto colon = address.rfind(':');
+	if (colon == string::npos) {
+		if (!local) throw runtime_error("Peer address must be host:port: " + address);
+		port = address;
+	} else {
+		host = address.substr(0, colon);
+		port = address.substr(colon + 1);
+		if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.size() - 2);
+	}
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV | (local ? AI_PASSIVE : 0);
+
+	auto rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &res);
+	if (rc != 0)
+		throw runtime_error("Cannot resolve " + address + ": " + gai_strerror(rc));
+
+	memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	len = res->ai_addrlen;
+	freeaddrinfo(res);
+}
+
+
+static int openSocket(const string& address) {
+	sockaddr_storage addr;
+	socklen_t len;
+	resolve(address, true, addr, len);
+
+	int fd = socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		throw system_error(errno, system_category(), "Error while creating socket");
+
+	if (bind(fd, (struct sockaddr*)&addr, len) < 0) {
+		auto err = errno;
+		close(fd);
+		throw system_error(err, system_category(), "Error while binding to " + address);
+	}
+	return fd;
+}
+
+
+// Return the payload of an RTP packet with the given payload type, or
+// nullptr for invalid packets and packets with other payload types (e.g.,
+// RFC 4733 telephone events).
+static const char* rtpPayload(const char* data, size_t& length, uint8_t pt) {
+	if (length < sizeof(RtpHeader)) return nullptr;
+
+	auto hdr = reinterpret_cast<const RtpHeader*>(data);
+	if ((hdr->flags >> 6) != 2) return nullptr;
+	if ((hdr->mpt & 0x7f) != pt) return nullptr;
+
+	size_t offset = sizeof(RtpHeader) + 4 * (hdr->flags & 0x0f);
+	size_t end = length;
+
+	// Header extension
+	if (hdr->flags & 0x10) {
+		if (offset + 4 > end) return nullptr;
+		uint16_t words;
+		memcpy(&words, data + offset + 2, sizeof(words));
+		offset += 4 + 4 * ntohs(words);
+	}
+
+	// Padding, the last byte holds the number of padding bytes
+	if (hdr->flags & 0x20) {
+		if (end == 0) return nullptr;
+		auto padding = (uint8_t)data[end - 1];
+		if (padding > end) return nullptr;
+		end -= padding;
+	}
+
+	if (offset > end) return nullptr;
+	length = end - offset;
+	return data + offset;
+}
+
+
+RtpGateway::RtpGateway(DeviceManager& manager, const vector<RtpConfig>& configs) : manager(manager) {
+	random_device rd;
+
+	try {
+		epoll = epoll_create1(EPOLL_CLOEXEC);
+		if (epoll < 0)
+			throw system_error(errno, system_category(), "Error in epoll_create1");
+
+		wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (wakeup < 0)
+			throw system_error(errno, system_category(), "Error while creating eventfd");
+		watch(wakeup);
+
+		for (auto& config : configs) {
+			auto s = make_unique<Session>();
+			s->config = config;
+
+			s->audio_fd = openSocket(config.audio);
+			s->ambe_fd = openSocket(config.ambe);
+
+			switch(config.codec) {
+			case RtpCodec::PCMU: s->audio_pt = 0;  break;
+			case RtpCodec::PCMA: s->audio_pt = 8;  break;
+			case RtpCodec::L16:  s->audio_pt = 96; break;
+			}
+			if (config.audio_pt >= 0) s->audio_pt = config.audio_pt;
+
+			s->to_audio.fd = s->audio_fd;
+			s->to_audio.pt = s->audio_pt;
+			s->to_audio.ssrc = rd();
+			s->to_audio.seq = rd();
+			s->to_audio.timestamp = rd();
+			resolve(config.audio_peer, false, s->to_audio.peer, s->to_audio.peer_len);
+
+			s->to_ambe.fd = s->ambe_fd;
+			s->to_ambe.rtp = !config.raw;
+			s->to_ambe.pt = config.ambe_pt;
+			s->to_ambe.ssrc = rd();
+			s->to_ambe.seq = rd();
+			s->to_ambe.timestamp = rd();
+			resolve(config.ambe_peer, false, s->to_ambe.peer, s->to_ambe.peer_len);
+
+			// The channel is configured with its own API object. API objects
+			// are cheap and all of them share the device's scheduler.
+			s->channels = manager.acquireChannels(1);
+			s->channel = s->channels.second[0];
+
+			auto data = manager.getData(s->channels.first);
+			if (!data) throw logic_error("Bug: Device of a leased channel not found");
+			s->api = make_unique<API>(get<0>(*data), get<1>(*data));
+			s->api->rate(s->channel, Rate(config.rate.c_str()));
+			s->api->init(s->channel);
+
+			watch(s->audio_fd);
+			watch(s->ambe_fd);
+			sockets[s->audio_fd] = s.get();
+			sockets[s->ambe_fd] = s.get();
+
+			cout << "RTP gateway: audio " << config.audio << " <-> channel " << (int)s->channel
+				<< " <-> AMBE " << config.ambe << endl;
+			sessions.push_back(move(s));
+		}
+	} catch(...) {
+		close();
+		throw;
+	}
+}
+
+
+RtpGateway::~RtpGateway() {
+	close();
+}
+
+
+void RtpGateway::close() {
+	for (auto& s : sessions) {
+		if (s->audio_fd >= 0) ::close(s->audio_fd);
+		if (s->ambe_fd >= 0) ::close(s->ambe_fd);
+		if (!s->channels.second.empty())
+			manager.releaseChannels(s->channels.first, s->channels.second);
+	}
+	sessions.clear();
+
+	if (wakeup >= 0) ::close(wakeup);
+	if (epoll >= 0) ::close(epoll);
+	wakeup = epoll = -1;
+}
+
+
+void RtpGateway::watch(int fd) {
+	struct epoll_event event;
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.fd = fd;
+	if (epoll_ctl(epoll, EPOLL_CTL_ADD, fd, &event) < 0)
+		throw system_error(errno, system_category(), "Error in epoll_ctl");
+}
+
+
+void RtpGateway::run() {
+	struct epoll_event events[64];
+
+	while (true) {
+		auto n = epoll_wait(epoll, events, 64, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			throw system_error(errno, system_category(), "Error in epoll_wait");
+		}
+
+		for (int i = 0; i < n; i++) {
+			int fd = events[i].data.fd;
+			if (fd == wakeup) {
+				uint64_t value;
+				if (read(wakeup, &value, sizeof(value)) < 0 && errno != EAGAIN)
+					throw system_error(errno, system_category(), "Error while reading eventfd");
+				flush();
+			} else {
+				receive(fd);
+			}
+		}
+	}
+}
+
+
+void RtpGateway::receive(int fd) {
+	auto session = sockets.at(fd);
+
+	static thread_local char buffers[BATCH_SIZE][RECV_SIZE];
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+
+	for (unsigned int i = 0; i < BATCH_SIZE; i++) {
+		iovs[i].iov_base = buffers[i];
+		iovs[i].iov_len = RECV_SIZE;
+		memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	while (true) {
+		auto n = recvmmsg(fd, msgs, BATCH_SIZE, 0, nullptr);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				cerr << "RTP gateway: Error while receiving: " << strerror(errno) << endl;
+			return;
+		}
+
+		for (int i = 0; i < n; i++) {
+			// Truncated datagrams are not valid media packets
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+
+			try {
+				if (fd == session->audio_fd) audio(*session, buffers[i], msgs[i].msg_len);
+				else frames(*session, buffers[i], msgs[i].msg_len);
+			} catch(const exception& e) {
+				cerr << "RTP gateway: " << e.what() << endl;
+			}
+		}
+
+		if ((unsigned int)n < BATCH_SIZE) return;
+	}
+}
+
+
+// Audio from the audio peer: collect full frames of linear samples and
+// submit them for compression
+void RtpGateway::audio(Session& s, const char* data, size_t length) {
+	auto payload = rtpPayload(data, length, s.audio_pt);
+	if (!payload) return;
+
+	auto& pending = s.pending;
+	auto old = pending.size();
+
+	switch(s.config.codec) {
+	case RtpCodec::PCMU:
+	case RtpCodec::PCMA:
+		pending.resize(old + length);
+		g711::decode(pending.data() + old, (const uint8_t*)payload, length,
+			s.config.codec == RtpCodec::PCMU ? Compand::ULAW : Compand::ALAW, true);
+		break;
+
+	case RtpCodec::L16:
+		// L16 samples are in network byte order, i.e., big endian like the
+		// samples expected by the chip
+		pending.resize(old + length / 2);
+		memcpy(pending.data() + old, payload, length / 2 * 2);
+		break;
+	}
+
+	size_t offset = 0;
+	for (; pending.size() - offset >= FRAME_SIZE; offset += FRAME_SIZE) {
+		s.api->compressAsync(s.channel, pending.data() + offset, FRAME_SIZE, [this, &s](const Packet& response) {
+			try {
+				size_t count;
+				auto bits = response.bits(count);
+				send(s.to_ambe, bits, AmbeFrame::byteLength(count));
+			} catch(const exception& e) {
+				cerr << "RTP gateway: " << e.what() << endl;
+			}
+		});
+	}
+	pending.erase(pending.begin(), pending.begin() + offset);
+}
+
+
+// AMBE frames from the AMBE peer. A datagram may carry several frames.
+void RtpGateway::frames(Session& s, const char* data, size_t length) {
+	const char* payload = data;
+	if (!s.config.raw) {
+		payload = rtpPayload(data, length, s.config.ambe_pt);
+		if (!payload) return;
+	}
+
+	auto bytes = AmbeFrame::byteLength(s.config.bits);
+	for (size_t i = 0; i + bytes <= length; i += bytes) {
+		s.api->decompressAsync(s.channel, payload + i, s.config.bits, [this, &s](const Packet& response) {
+			try {
+				if (s.config.codec == RtpCodec::L16) {
+					int16_t samples[FRAME_SIZE];
+					auto n = s.api->samples(samples, FRAME_SIZE, response);
+					send(s.to_audio, samples, n * sizeof(samples[0]));
+				} else {
+					uint8_t samples[FRAME_SIZE];
+					auto law = s.config.codec == RtpCodec::PCMU ? Compand::ULAW : Compand::ALAW;
+					auto n = s.api->companded(samples, FRAME_SIZE, response, law);
+					send(s.to_audio, samples, n);
+				}
+			} catch(const exception& e) {
+				cerr << "RTP gateway: " << e.what() << endl;
+			}
+		});
+	}
+}
+
+
+// Invoked from the scheduler's thread. The datagram is sent by the gateway's
+// thread together with other datagrams queued in the meantime.
+void RtpGateway::send(Output& out, const void* payload, size_t length) {
+	if (length > MAX_PAYLOAD) throw runtime_error("Payload too large");
+
+	bool wake;
+	{
+		lock_guard<std::mutex> lock(mutex);
+		wake = outgoing.empty();
+		outgoing.emplace_back();
+		auto& dgram = outgoing.back();
+		dgram.fd = out.fd;
+		dgram.peer = &out.peer;
+		dgram.peer_len = out.peer_len;
+
+		char* dst = dgram.data;
+		if (out.rtp) {
+			RtpHeader hdr;
+			hdr.flags = 2 << 6;
+			hdr.mpt = out.pt | (out.marker ? 0x80 : 0);
+			hdr.seq = htons(out.seq++);
+			hdr.timestamp = htonl(out.timestamp);
+			hdr.ssrc = htonl(out.ssrc);
+			memcpy(dst, &hdr, sizeof(hdr));
+			dst += sizeof(hdr);
+
+			// Each datagram carries one 20 ms frame
+			out.timestamp += FRAME_SIZE;
+			out.marker = false;
+		}
+		memcpy(dst, payload, length);
+		dgram.length = dst - dgram.data + length;
+	}
+
+	if (wake) {
+		uint64_t one = 1;
+		if (write(wakeup, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			cerr << "RTP gateway: Error while waking up sender" << endl;
+	}
+}
+
+
+void RtpGateway::flush() {
+	vector<Datagram> queue;
+	{
+		lock_guard<std::mutex> lock(mutex);
+		queue.swap(outgoing);
+	}
+
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+
+	// Send runs of datagrams from the same socket with one system call each
+	for (size_t i = 0; i < queue.size(); ) {
+		int fd = queue[i].fd;
+		unsigned int n = 0;
+		for (; n < BATCH_SIZE && i + n < queue.size() && queue[i + n].fd == fd; n++) {
+			auto& dgram = queue[i + n];
+			iovs[n].iov_base = dgram.data;
+			iovs[n].iov_len = dgram.length;
+			memset(&msgs[n].msg_hdr, 0, sizeof(msgs[n].msg_hdr));
+			msgs[n].msg_hdr.msg_name = const_cast<sockaddr_storage*>(dgram.peer);
+			msgs[n].msg_hdr.msg_namelen = dgram.peer_len;
+			msgs[n].msg_hdr.msg_iov = &iovs[n];
+			msgs[n].msg_hdr.msg_iovlen = 1;
+		}
+
+		unsigned int sent = 0;
+		while (sent < n) {
+			auto rc = sendmmsg(fd, msgs + sent, n - sent, 0);
+			if (rc < 0) {
+				if (errno == EINTR) continue;
+				// Media is not retransmitted, drop what could not be sent
+				if (errno != EAGAIN && errno != EWOULDBLOCK)
+					cerr << "RTP gateway: Error while sending: " << strerror(errno) << endl;
+				break;
+			}
+			sent += rc;
+		}
+		i += n;
+	}
+
+	// Keep the buffer for the next round
+	queue.clear();
+	lock_guard<std::mutex> lock(mutex);
+	if (outgoing.empty()) outgoing.swap(queue);
+}
@@ -0,0 +1,122 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <sys/socket.h>
+#include "api.h"
+#include "device.h"
+
+using namespace std;
+
+namespace ambe {
+
+	enum class RtpCodec {
+		PCMU,
+		PCMA,
+		L16
+	};
+
+
+	/**
+	 * Configuration of a single gateway session
+	 *
+	 * A session connects an audio stream (RTP with PCMU, PCMA, or 8 kHz L16
+	 * payload) with a stream of AMBE frames (RTP or raw UDP). Audio received
+	 * on the audio port is compressed and sent to the AMBE peer, AMBE frames
+	 * received on the AMBE port are decompressed and sent to the audio peer.
+	 * The configuration is given as a comma-separated list of key=value
+	 * pairs, e.g.,
+	 *
+	 *   codec=pcmu,audio=40000,audio_peer=10.0.0.1:40000,ambe=40002,ambe_peer=10.0.0.2:40002
+	 *
+	 * Local addresses are either a port number or host:port.
+	 */
+	struct RtpConfig {
+		RtpCodec codec = RtpCodec::PCMU;
+		string audio;
+		string audio_peer;
+		string ambe;
+		string ambe_peer;
+
+		// Send and expect AMBE frames without an RTP header
+		bool raw = false;
+
+		// AMBE rate (see Rate) and the number of bits in a frame at that
+		// rate. Rate 33 produces 49 bits per frame.
+		string rate = "33";
+		unsigned int bits = 49;
+
+		// RTP payload types. The audio payload type defaults to the static
+		// payload type of the codec (96 for L16).
+		int audio_pt = -1;
+		int ambe_pt = 96;
+
+		// Throws runtime_error if the specification is invalid
+		static RtpConfig parse(const string& spec);
+	};
+
+
+	/**
+	 * A media gateway between RTP audio streams and AMBE frames
+	 *
+	 * Each session leases a channel through the device manager for the
+	 * lifetime of the gateway. A single thread receives datagrams from all
+	 * sessions in batches (recvmmsg) and submits frames to the scheduler.
+	 * Responses are queued by the scheduler's thread and sent in batches
+	 * (sendmmsg) by the gateway's thread.
+	 */
+	class RtpGateway {
+	public:
+		RtpGateway(DeviceManager& manager, const vector<RtpConfig>& sessions);
+		~RtpGateway();
+
+		// Serve all sessions, never returns
+		void run();
+
+	private:
+		struct Output;
+		struct Session;
+		struct Datagram;
+
+		void receive(int fd);
+		void audio(Session& session, const char* data, size_t length);
+		void frames(Session& session, const char* data, size_t length);
+		void send(Output& output, const void* payload, size_t length);
+		void flush();
+		void watch(int fd);
+		void close();
+
+		DeviceManager& manager;
+		vector<unique_ptr<Session>> sessions;
+		unordered_map<int, Session*> sockets;
+
+		int epoll = -1;
+		int wakeup = -1;
+
+		// Datagrams waiting to be sent by the gateway's thread
+		std::mutex mutex;
+		vector<Datagram> outgoing;
+	};
+}
@@ -30,7 +30,7 @@ using namespace ambe;
 using namespace std;
 
 
-future<Packet> Scheduler::submit(const Packet& packet) {
+future<Packet> Scheduler::submit(const Packet& packet, const Origin& origin) {
 	auto rv = make_shared<promise<Packet>>();
 	auto future = rv->get_future();
 
@@ -38,71 +38,268 @@ future<Packet> Scheduler::submit(const Packet& packet) {
 		rv->set_value(move(response));
 	};
 
-	submitAsync(packet, callback);
+	submitAsync(packet, callback, origin);
 	return future;
 }
 
 
-FifoScheduler::FifoScheduler(TaggingDevice& device) : device(device) {
+void Scheduler::submitBatchAsync(Batch&& batch) {
+	for (auto& request : batch)
+		submitAsync(get<0>(request), move(get<1>(request)), get<2>(request));
+}
+
+
+future<Packet> Scheduler::transcode(const Packet& packet, uint8_t target) {
+	auto rv = make_shared<promise<Packet>>();
+	auto future = rv->get_future();
+
+	auto callback = [rv](const Packet& response) {
+		rv->set_value(move(response));
+	};
+
+	transcodeAsync(packet, target, callback);
+	return future;
+}
+
+
+void Scheduler::transcodeAsync(const Packet& packet, uint8_t target, ResponseCallback callback, const Origin& origin) {
+	submitAsync(packet, [this, target, callback, origin](const Packet& response) {
+		if (response.type() != SPEECH) {
+			callback(response);
+			return;
+		}
+
+		Packet request(response);
+		request.setChannel(target);
+		request.finalize(response.hasParity());
+		submitAsync(request, callback, origin);
+	}, origin);
+}
+
+
+// The state word of a ring slot, see FifoScheduler::Slot
+static inline uint64_t slotWord(int32_t tag, uint32_t state) {
+	return (uint64_t)(uint32_t)tag << 32 | state;
+}
+
+
+FifoScheduler::FifoScheduler(TaggingDevice& device, size_t capacity) : device(device) {
+	size_t size = 1;
+	while (size < capacity) size <<= 1;
+
+	slots.reset(new Slot[size]);
+	mask = size - 1;
 }
 
 
 void FifoScheduler::start() {
 	quit = false;
-	tag = 0;
-	terminated = promise<void>();
-	device.setCallback(bind(&FifoScheduler::recv, this, _1, _2));
+	next_tag = 0;
+	device.setCallback(bind(&FifoScheduler::recv, this, _1, _2, _3));
 }
 
 
 void FifoScheduler::stop() {
-	unique_lock<std::mutex> lock(mutex);
-
-	// If we have outstanding requests on the queue, wait for all of them to get
-	// closed. Set a flag and a promise for the receiving thread to resolve once
-	// the queue is empty.
-
-	if (!submitted.empty()) {
+	// Wait for the responses to all outstanding requests. The receiving
+	// thread notifies us once the last slot has been released.
+	{
+		unique_lock<std::mutex> lock(mutex);
 		quit = true;
-		auto future = terminated.get_future();
-		lock.unlock();
-		future.get();
+		drained.wait(lock, [this] { return !outstanding; });
 	}
 
 	device.setCallback(nullptr);
 }
 
 
-void FifoScheduler::submitAsync(const Packet& packet, ResponseCallback callback) {
-	// Note: we can lock the mutex before device.send() because the method is
-	// guaranteed to be non-blocking, i.e., it will not block until the packet
-	// is written to the device.
+int32_t FifoScheduler::claim(ResponseCallback&& callback, const Origin& origin) {
+	// The slot for the next tag may still be held by a request that has not
+	// been answered yet (e.g., a cancelled one). Skip a few such tags. Since
+	// tags are assigned in order, the ring is most likely full if several
+	// slots in a row are taken.
+	for (unsigned int i = 0; i < 4; i++) {
+		int32_t tag = (int32_t)++next_tag;
+
+		// Tag 0 is reserved for messages that do not belong to a request
+		if (!tag) continue;
+
+		auto& slot = slots[(uint32_t)tag & mask];
+		uint64_t expected = FREE;
+		if (!slot.state.compare_exchange_strong(expected, slotWord(tag, CLAIMED), memory_order_acquire))
+			continue;
+
+		outstanding++;
+		slot.callback = move(callback);
+		slot.origin = origin;
+		slot.state.store(slotWord(tag, PENDING), memory_order_release);
+		return tag;
+	}
+	return 0;
+}
+
+
+bool FifoScheduler::acquire(Slot& slot, int32_t tag, SlotState from) {
+	while (true) {
+		auto expected = slotWord(tag, from);
+		if (slot.state.compare_exchange_strong(expected, slotWord(tag, BUSY), memory_order_acquire))
+			return true;
+
+		// Another thread holds the slot for a moment, e.g., cancel() while
+		// it checks the origin
+		if (expected != slotWord(tag, BUSY)) return false;
+		this_thread::yield();
+	}
+}
+
+
+int32_t FifoScheduler::registerRequest(ResponseCallback&& callback, const Origin& origin) {
+	auto tag = claim(move(callback), origin);
+	if (tag) return tag;
+
+	// The ring is full, e.g., after a burst of asynchronous requests
+	lock_guard<std::mutex> lock(overflow_lock);
+	do {
+		tag = (int32_t)++next_tag;
+	} while (!tag);
+
+	outstanding++;
+	overflowed++;
+	overflow[tag] = make_pair(move(callback), origin);
+	return tag;
+}
+
+
+void FifoScheduler::release(Slot& slot) {
+	slot.callback = nullptr;
+	slot.origin = Origin();
+	slot.state.store(FREE, memory_order_release);
+	finished();
+}
+
+
+void FifoScheduler::finished() {
+	if (--outstanding == 0 && quit) {
+		lock_guard<std::mutex> lock(mutex);
+		drained.notify_all();
+	}
+}
+
+
+// The request is registered before the packet is handed to the device, so
+// that the response can be matched no matter how fast it arrives. Concurrent
+// callers do not wait for each other.
+void FifoScheduler::submitAsync(const Packet& packet, ResponseCallback callback, const Origin& origin) {
+	auto tag = registerRequest(move(callback), origin);
 
-	lock_guard<std::mutex> lock(mutex);
 	try {
-		device.send(++tag, packet.data());
+		device.send(tag, packet.data());
 	} catch(...) {
-		callback(Packet());
+		recv(tag, string());
 	}
+}
+
+
+void FifoScheduler::submitBatchAsync(Batch&& batch) {
+	vector<pair<int32_t, string>> packets;
+	packets.reserve(batch.size());
 
-	submitted[tag] = callback;
+	for (auto& request : batch)
+		packets.emplace_back(registerRequest(move(get<1>(request)), get<2>(request)), get<0>(request).data());
+
+	try {
+		device.sendBatch(packets);
+	} catch(...) {
+		for (auto& packet : packets) recv(packet.first, string());
+	}
+}
+
+
+void FifoScheduler::transcodeAsync(const Packet& packet, uint8_t target, ResponseCallback callback, const Origin& origin) {
+	// If the remote device chains the requests itself, the transcoding request
+	// is a single round trip.
+	if (device.transcodes()) submitAsync(packet, callback, origin);
+	else Scheduler::transcodeAsync(packet, target, callback, origin);
 }
 
 
-void FifoScheduler::recv(int32_t tag, const string& packet) {
-	lock_guard<std::mutex> lock(mutex);
+void FifoScheduler::cancel(const Origin& origin) {
+	vector<ResponseCallback> cancelled;
+
+	for (uint32_t i = 0; i <= mask; i++) {
+		auto& slot = slots[i];
+		auto word = slot.state.load(memory_order_relaxed);
+		if ((uint32_t)word != PENDING) continue;
+
+		int32_t tag = (int32_t)(word >> 32);
+		if (!acquire(slot, tag, PENDING)) continue;
+
+		if (!origin.matches(slot.origin)) {
+			slot.state.store(slotWord(tag, PENDING), memory_order_release);
+			continue;
+		}
+
+		// The slot stays reserved until the device answers the request
+		cancelled.push_back(move(slot.callback));
+		slot.callback = nullptr;
+		slot.state.store(slotWord(tag, CANCELLED), memory_order_release);
+
+		try {
+			device.cancel(tag);
+		} catch(...) {}
+	}
+
+	if (overflowed) {
+		lock_guard<std::mutex> lock(overflow_lock);
+		for (auto& request : overflow) {
+			auto& callback = request.second.first;
+			if (!callback || !origin.matches(request.second.second)) continue;
 
-	auto v = submitted.find(tag);
-	if (v == submitted.end()) {
-		cerr << "Warning: Received response with unknown tag" << endl;
-		return;
+			try {
+				device.cancel(request.first);
+			} catch(...) {}
+
+			cancelled.push_back(move(callback));
+			callback = nullptr;
+		}
 	}
 
-	v->second(Packet(move(packet), device.uses_parity, false));
-	submitted.erase(v);
+	for (auto& callback : cancelled) callback(Packet());
+}
+
 
-	if (quit && submitted.empty())
-		terminated.set_value();
+// The callback is invoked after the slot has been released, it may submit
+// further requests (see Scheduler::transcodeAsync).
+void FifoScheduler::recv(int32_t tag, const string& packet, bool busy) {
+	auto& slot = slots[(uint32_t)tag & mask];
+	ResponseCallback callback;
+
+	if (acquire(slot, tag, PENDING)) {
+		callback = move(slot.callback);
+		release(slot);
+	} else if (acquire(slot, tag, CANCELLED)) {
+		release(slot);
+	} else {
+		unique_lock<std::mutex> lock(overflow_lock, defer_lock);
+		if (overflowed) lock.lock();
+
+		auto v = lock ? overflow.find(tag) : overflow.end();
+		if (v == overflow.end()) {
+			cerr << "Warning: Received response with unknown tag" << endl;
+			return;
+		}
+
+		callback = move(v->second.first);
+		overflow.erase(v);
+		overflowed--;
+		lock.unlock();
+		finished();
+	}
+
+	// The response to a cancelled request is dropped. Requests that the
+	// server could not process are answered with an empty message.
+	if (!callback) return;
+	if (packet.empty()) callback(busy ? Packet::busy() : Packet());
+	else callback(Packet(move(packet), device.uses_parity, false));
 }
 
 
@@ -134,8 +331,36 @@ void MultiQueueScheduler::stop() {
 }
 
 
-void MultiQueueScheduler::submitAsync(const Packet& packet, ResponseCallback callback) {
-	process.push(make_tuple(packet, move(callback)));
+void MultiQueueScheduler::submitAsync(const Packet& packet, ResponseCallback callback, const Origin& origin) {
+	process.push(make_tuple(packet, move(callback), -1, origin));
+}
+
+
+void MultiQueueScheduler::transcodeAsync(const Packet& packet, uint8_t target, ResponseCallback callback, const Origin& origin) {
+	if (target >= channels)
+		throw logic_error("Invalid target channel: " + to_string(target));
+
+	process.push(make_tuple(packet, move(callback), target, origin));
+}
+
+
+void MultiQueueScheduler::submitBatchAsync(Batch&& batch) {
+	vector<State> states;
+	states.reserve(batch.size());
+	for (auto& request : batch)
+		states.emplace_back(move(get<0>(request)), move(get<1>(request)), -1, get<2>(request));
+
+	process.push(move(states));
+}
+
+
+// A cancellation request is an empty packet without a callback. It is
+// processed on the scheduler's thread in the order in which it was
+// submitted, i.e., after all requests submitted before it have been queued.
+
+void MultiQueueScheduler::cancel(const Origin& origin) {
+	if (!origin.session) return;
+	process.push(make_tuple(Packet(), nullopt, -1, origin));
 }
 
 
@@ -143,7 +368,14 @@ void MultiQueueScheduler::submitAsync(const Packet& packet, ResponseCallback cal
 // packets.
 
 void MultiQueueScheduler::recv(const string& packet) {
-	process.push(make_tuple(Packet(move(packet), device.uses_parity, false), nullopt));
+	process.push(make_tuple(Packet(move(packet), device.uses_parity, false), nullopt, -1, Origin()));
+}
+
+
+void MultiQueueScheduler::enqueue(State&& state) {
+	auto i = queueIndex(get<0>(state));
+	if (i == -1) device_queue.push(move(state));
+	else channel_queue[i].push(move(state));
 }
 
 
@@ -204,6 +436,39 @@ bool MultiQueueScheduler::canSend(const Packet& request) const {
 }
 
 
+// Remove the requests that match the origin from the queues and drop the
+// responses to matching requests that have been sent to the device already.
+// Returns the number of requests removed from the queues.
+
+unsigned int MultiQueueScheduler::purge(const Origin& origin) {
+	vector<ResponseCallback> cancelled;
+
+	auto filter = [&](queue<State>& q) {
+		queue<State> kept;
+		for (; !q.empty(); q.pop()) {
+			auto& state = q.front();
+			if (origin.matches(get<3>(state))) cancelled.push_back(move(*get<1>(state)));
+			else kept.push(move(state));
+		}
+		q = move(kept);
+	};
+
+	filter(device_queue);
+	for (auto& q : channel_queue) filter(q);
+	unsigned int removed = cancelled.size();
+
+	for (auto& state : submitted) {
+		auto& callback = get<1>(state);
+		if (!callback || !origin.matches(get<3>(state))) continue;
+		cancelled.push_back(move(*callback));
+		callback = nullopt;
+	}
+
+	for (auto& callback : cancelled) callback(Packet());
+	return removed;
+}
+
+
 unsigned int MultiQueueScheduler::queued() const {
 	unsigned int rv = device_queue.size();
 	for(const auto& q : channel_queue) rv += q.size();
@@ -219,22 +484,23 @@ void MultiQueueScheduler::run() {
 
 	while (!quit || queued || submitted.size()) {
 		auto tuple = move(process.pop());
-		const auto& packet = get<0>(tuple);
+		auto& packet = get<0>(tuple);
 		auto& callback = get<1>(tuple);
 
-		if (!packet.payloadLength()) {
+		if (!packet.payloadLength() && !callback) {
+			// A cancellation request, see cancel()
+			queued -= purge(get<3>(tuple));
+		} else if (!packet.payloadLength()) {
 			// If it is an empty packet, set a flag to terminate once all
 			// data has been processed and discard it.
 			quit = true;
 
 			// Notify the stop method once the thread has stopped
-			if (callback) terminated = callback;
+			terminated = callback;
 		} else if (callback) {
 			// We got a new request to transmit to the AMBE chip. File it in
 			// the appropriate queue.
-			auto i = queueIndex(packet);
-			if (i == -1) device_queue.push(move(tuple));
-			else channel_queue[i].push(move(tuple));
+			enqueue(move(tuple));
 			queued++;
 		} else {
 			// We got a new response from the AMBE chip
@@ -242,17 +508,34 @@ void MultiQueueScheduler::run() {
 				auto& tuple = submitted.front();
 				const auto& request = get<0>(tuple);
 				auto& callback = get<1>(tuple);
+				auto target = get<2>(tuple);
+				auto origin = get<3>(tuple);
 
 				int i = queueIndex(request);
 				if (i != -1) {
 					submitted_by_type[typeIndex(request)]--;
 					submitted_by_queue[queueIndex(request)]--;
 				}
-				// If we have (an optional) promise associated with the request,
-				// fullfill it with the response packet that we just received.
-				if (callback) callback.value()(packet);
 
-				submitted.pop();
+				if (target != -1 && callback && packet.type() == SPEECH) {
+					// The first stage of a transcoding request has finished.
+					// The SPEECH response has the same layout as a SPEECH
+					// request, so we only redirect it to the target channel and
+					// queue it for the encoder there. The final response will
+					// be passed to the original callback.
+					packet.setChannel(target);
+					packet.finalize(device.uses_parity);
+					enqueue(make_tuple(move(packet), move(callback), -1, origin));
+					queued++;
+				} else if (callback) {
+					// If we have (an optional) promise associated with the
+					// request, fullfill it with the response packet that we
+					// just received. Responses to cancelled requests have no
+					// callback and are dropped.
+					callback.value()(packet);
+				}
+
+				submitted.pop_front();
 			}
 		}
 
@@ -267,7 +550,7 @@ void MultiQueueScheduler::run() {
 
 			device.send(request.data());
 
-			submitted.push(move(device_queue.front()));
+			submitted.push_back(move(device_queue.front()));
 			device_queue.pop();
 			queued--;
 		}
@@ -283,7 +566,7 @@ void MultiQueueScheduler::run() {
 
 			submitted_by_type[typeIndex(request)]++;
 			submitted_by_queue[queueIndex(request)]++;
-			submitted.push(move(channel_queue[next].front()));
+			submitted.push_back(move(channel_queue[next].front()));
 			channel_queue[next].pop();
 			queued--;
 
@@ -23,9 +23,12 @@
 #include <future>
 #include <optional>
 #include <unordered_map>
+#include <atomic>
+#include <condition_variable>
 #include "device.h"
 #include "queue.h"
 #include "packet.h"
+#include "origin.h"
 
 using namespace std;
 
@@ -34,7 +37,14 @@ namespace ambe {
 	class FifoDevice;
 
 	typedef function<void (const Packet& packet)> ResponseCallback;
-	typedef tuple<Packet, optional<ResponseCallback>> State;
+
+	// A request or response packet, the callback to invoke with the response,
+	// the channel to forward the SPEECH response to (-1 if none), and the
+	// origin of the request.
+	typedef tuple<Packet, optional<ResponseCallback>, int, Origin> State;
+
+	// Several requests submitted together, see Scheduler::submitBatchAsync
+	typedef vector<tuple<Packet, ResponseCallback, Origin>> Batch;
 
 	/**
 	 * AMBE request scheduler base class
@@ -90,8 +100,46 @@ namespace ambe {
 		 * NOTE: This method cannot be used to send requests for which the AMBE
 		 * dongle generates no response (there are a couple).
 		 */
-		virtual future<Packet> submit(const Packet& packet);
-		virtual void submitAsync(const Packet& packet, ResponseCallback callback) = 0;
+		virtual future<Packet> submit(const Packet& packet, const Origin& origin=Origin());
+		virtual void submitAsync(const Packet& packet, ResponseCallback callback, const Origin& origin=Origin()) = 0;
+
+		/**
+		 * Submit several requests in one go
+		 *
+		 * Equivalent to invoking submitAsync for each request in order, but
+		 * allows the scheduler to hand all requests to its thread or to the
+		 * device at once. The default implementation submits the requests
+		 * one by one.
+		 */
+		virtual void submitBatchAsync(Batch&& batch);
+
+		/**
+		 * Decompress on one channel and compress the result on another
+		 *
+		 * The request must be a CHANNEL packet for the source channel. The
+		 * SPEECH response is turned into a compression request for the target
+		 * channel and the callback receives the resulting CHANNEL packet. If
+		 * the decoder returns anything else than a SPEECH packet, the callback
+		 * receives that packet instead.
+		 *
+		 * The default implementation chains the two requests via submitAsync.
+		 * Schedulers that can forward the intermediate packet internally
+		 * should override it.
+		 */
+		virtual future<Packet> transcode(const Packet& packet, uint8_t target);
+		virtual void transcodeAsync(const Packet& packet, uint8_t target, ResponseCallback callback, const Origin& origin=Origin());
+
+		/**
+		 * Cancel the requests that match the given origin
+		 *
+		 * Requests that have not been sent to the device yet are discarded
+		 * and the responses to requests in flight are dropped when they
+		 * arrive. The callbacks of cancelled requests are invoked with an
+		 * empty packet, possibly before the method returns. The default
+		 * implementation does nothing, i.e., the requests complete
+		 * normally.
+		 */
+		virtual void cancel(const Origin& origin) {}
 	};
 
 
@@ -101,33 +149,84 @@ namespace ambe {
 	 * This class implements the simplest possible request scheduler for AMBE
 	 * devices. The scheduler sends packets to the device in the order in which
 	 * they arrive and it assumes that the AMBE device will generate reponses in
-	 * the same order. Internally, the scheduler keeps a queue of submitted
-	 * requests and whenever a packet is received from the device, it is
-	 * associated with the request packet at the front of the queue.
+	 * the same order. Internally, each request is sent with a unique tag and
+	 * the device's responses are matched to the requests by their tags, so
+	 * the scheduler also works with devices that reorder requests.
 	 *
 	 * The future value may be satisfied with an exception if the scheduler
 	 * fails to write the packet to the device.
 	 */
 	class FifoScheduler final : public Scheduler {
 	public:
-		FifoScheduler(TaggingDevice& device);
+		// The ring holds capacity requests (rounded up to a power of two),
+		// see Slot. Requests beyond that are kept in a map under a lock.
+		FifoScheduler(TaggingDevice& device, size_t capacity=1024);
 
 		virtual void start() override;
 		virtual void stop() override;
 
-		void submitAsync(const Packet& packet, ResponseCallback callback) override;
+		void submitAsync(const Packet& packet, ResponseCallback callback, const Origin& origin=Origin()) override;
+		void submitBatchAsync(Batch&& batch) override;
+		void transcodeAsync(const Packet& packet, uint8_t target, ResponseCallback callback, const Origin& origin=Origin()) override;
+
+		// Cancelled requests are also cancelled on the device (see
+		// TaggingDevice::cancel). Their tags remain reserved until the device
+		// has answered them.
+		void cancel(const Origin& origin) override;
 
 	private:
-		void recv(int32_t tag, const string& packet);
+		// Requests waiting for a response are kept in a ring of slots indexed
+		// by the low bits of their tag. The state word of a slot holds the
+		// slot's state in the lower and the full tag in the upper half, so
+		// that responses with stale or unknown tags are detected. Submitters
+		// claim free slots and the receiving thread releases them without
+		// taking a lock. A slot is owned by the thread that has moved it to
+		// CLAIMED or BUSY; the callback and the origin are only accessed by
+		// the owner.
+		enum SlotState : uint32_t { FREE, CLAIMED, PENDING, CANCELLED, BUSY };
+
+		struct Slot {
+			atomic<uint64_t> state{FREE};
+			ResponseCallback callback;
+			Origin origin;
+		};
+
+		// Return the tag of a newly claimed slot or 0 if all slots are taken
+		int32_t claim(ResponseCallback&& callback, const Origin& origin);
+
+		// Register a request in the ring or, if it is full, in the overflow
+		// map and return its tag
+		int32_t registerRequest(ResponseCallback&& callback, const Origin& origin);
+
+		// Take over the slot of the given tag if it is in the given state,
+		// waiting while another thread holds it BUSY
+		bool acquire(Slot& slot, int32_t tag, SlotState from);
+
+		// Free a slot held BUSY
+		void release(Slot& slot);
+
+		// Invoked once a request has been answered
+		void finished();
+
+		void recv(int32_t tag, const string& packet, bool busy=false);
 
 		TaggingDevice& device;
-		int32_t tag;
 
-		std::mutex mutex;
-		unordered_map<int32_t, ResponseCallback> submitted;
+		unique_ptr<Slot[]> slots;
+		uint32_t mask;
+		atomic<uint32_t> next_tag{0};
+		atomic<unsigned int> outstanding{0};
+
+		// Requests that did not fit into the ring. The callback of a
+		// cancelled request is empty.
+		std::mutex overflow_lock;
+		unordered_map<int32_t, pair<ResponseCallback, Origin>> overflow;
+		atomic<unsigned int> overflowed{0};
 
-		bool quit;
-		promise<void> terminated;
+		// Used by stop() to wait for the outstanding requests
+		std::mutex mutex;
+		condition_variable drained;
+		atomic<bool> quit{false};
 	};
 
 
@@ -159,12 +258,23 @@ namespace ambe {
 		void start() override;
 		void stop() override;
 
-		void submitAsync(const Packet& packet, ResponseCallback callback) override;
+		void submitAsync(const Packet& packet, ResponseCallback callback, const Origin& origin=Origin()) override;
+		void submitBatchAsync(Batch&& batch) override;
+
+		// SPEECH responses from the source channel are rewritten in place
+		// into requests for the target channel and queued on the scheduler
+		// thread, i.e., the intermediate audio never leaves the scheduler.
+		void transcodeAsync(const Packet& packet, uint8_t target, ResponseCallback callback, const Origin& origin=Origin()) override;
+
+		// The requests are purged on the scheduler's thread
+		void cancel(const Origin& origin) override;
 
 	private:
 
 		void recv(const string& packet);
 		void run();
+		void enqueue(State&& state);
+		unsigned int purge(const Origin& origin);
 
 		unsigned int queued() const;
 		int queueIndex(const Packet& request) const;
@@ -183,8 +293,9 @@ namespace ambe {
 		vector<queue<State>> channel_queue;
 
 		// A queue of requests that have been submitted to the AMBE device but
-		// for which we have not received a response yet.
-		queue<State> submitted;
+		// for which we have not received a response yet. Cancelled requests
+		// stay on the queue without a callback until the response arrives.
+		deque<State> submitted;
 
 		// The number of requests on the submitted queue broken down by packet
 		// type.
@@ -0,0 +1,399 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "shm.h"
+#include <cstring>
+#include <iostream>
+#include <system_error>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+
+using namespace std;
+using namespace ambe;
+
+
+bool ShmRing::push(int32_t tag, const char* data, size_t length) {
+	if (length > sizeof(ShmSlot::data))
+		throw runtime_error("Packet too large for a shared memory slot");
+
+	auto t = tail.load(memory_order_relaxed);
+	if (t - head.load(memory_order_acquire) >= SHM_SLOTS) return false;
+
+	auto& slot = slots[t % SHM_SLOTS];
+	slot.tag = tag;
+	slot.length = length;
+	memcpy(slot.data, data, length);
+
+	// Sequentially consistent so that the store is ordered before the load
+	// of the waiting flag in notify (pairs with sleep)
+	tail.store(t + 1, memory_order_seq_cst);
+	return true;
+}
+
+
+void ShmRing::notify(int doorbell) {
+	if (!waiting.load(memory_order_seq_cst)) return;
+
+	uint64_t one = 1;
+	if (write(doorbell, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		throw system_error(errno, system_category(), "Error while ringing doorbell");
+}
+
+
+size_t ShmRing::drain(const function<void (int32_t tag, const char* data, size_t length)>& callback) {
+	auto h = head.load(memory_order_relaxed);
+	auto t = tail.load(memory_order_acquire);
+	if (t - h > SHM_SLOTS)
+		throw runtime_error("Corrupted shared memory ring");
+
+	size_t n = 0;
+	for (; h != t; h++, n++) {
+		auto& slot = slots[h % SHM_SLOTS];
+		size_t length = slot.length;
+		if (length > sizeof(slot.data))
+			throw runtime_error("Corrupted shared memory slot");
+
+		callback(slot.tag, slot.data, length);
+
+		// Hand the slot back right away, the producer may be waiting for it
+		head.store(h + 1, memory_order_release);
+	}
+	return n;
+}
+
+
+bool ShmRing::sleep() {
+	waiting.store(1, memory_order_seq_cst);
+	if (tail.load(memory_order_seq_cst) != head.load(memory_order_relaxed)) {
+		waiting.store(0, memory_order_relaxed);
+		return false;
+	}
+	return true;
+}
+
+
+void ShmRing::wake() {
+	waiting.store(0, memory_order_relaxed);
+}
+
+
+socklen_t ambe::shmAddress(const string& path, struct sockaddr_un& addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (path.empty() || path.size() >= sizeof(addr.sun_path))
+		throw runtime_error("Invalid Unix domain socket path: " + path);
+
+	memcpy(addr.sun_path, path.data(), path.size());
+
+	// Abstract sockets start with a zero byte and their address length does
+	// not include a terminating zero
+	if (path[0] == '@') {
+		addr.sun_path[0] = '\0';
+		return offsetof(struct sockaddr_un, sun_path) + path.size();
+	}
+	return sizeof(addr);
+}
+
+
+void ambe::shmSend(int sock, const void* msg, size_t length, const int* fds, size_t count) {
+	struct iovec iov;
+	iov.iov_base = const_cast<void*>(msg);
+	iov.iov_len = length;
+
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+
+	char control[CMSG_SPACE(sizeof(int) * 4)];
+	if (count) {
+		if (count > 4) throw logic_error("Too many file descriptors");
+
+		memset(control, 0, sizeof(control));
+		hdr.msg_control = control;
+		hdr.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+		auto cmsg = CMSG_FIRSTHDR(&hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+	}
+
+	if (sendmsg(sock, &hdr, MSG_NOSIGNAL) < 0)
+		throw system_error(errno, system_category(), "Error while sending control message");
+}
+
+
+size_t ambe::shmRecv(int sock, void* msg, size_t length, int* fds, size_t& count) {
+	struct iovec iov;
+	iov.iov_base = msg;
+	iov.iov_len = length;
+
+	char control[CMSG_SPACE(sizeof(int) * 4)];
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = &iov;
+	hdr.msg_iovlen = 1;
+	hdr.msg_control = control;
+	hdr.msg_controllen = sizeof(control);
+
+	auto rc = recvmsg(sock, &hdr, MSG_CMSG_CLOEXEC);
+	if (rc < 0)
+		throw system_error(errno, system_category(), "Error while receiving control message");
+
+	size_t n = 0;
+	for (auto cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+
+		size_t k = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int received[4];
+		memcpy(received, CMSG_DATA(cmsg), min(k, (size_t)4) * sizeof(int));
+
+		// Never leak descriptors the caller did not ask for
+		for (size_t i = 0; i < k; i++) {
+			if (n < count) fds[n++] = received[i];
+			else ::close(received[i]);
+		}
+	}
+
+	if (hdr.msg_flags & MSG_CTRUNC) {
+		for (size_t i = 0; i < n; i++) ::close(fds[i]);
+		throw runtime_error("Too many file descriptors in control message");
+	}
+
+	count = n;
+	return rc;
+}
+
+
+ShmDevice::ShmDevice(const string& path) : path(path) {
+}
+
+
+ShmDevice::~ShmDevice() {
+	close();
+}
+
+
+void ShmDevice::start() {
+	struct sockaddr_un addr;
+	auto len = shmAddress(path, addr);
+
+	sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		throw system_error(errno, system_category(), "Error while creating socket");
+
+	try {
+		if (connect(sock, (struct sockaddr*)&addr, len) < 0)
+			throw system_error(errno, system_category(), "Error while connecting to " + path);
+
+		ShmHello hello = { SHM_MAGIC, SHM_VERSION };
+		shmSend(sock, &hello, sizeof(hello), nullptr, 0);
+
+		ShmWelcome welcome;
+		int fds[3];
+		size_t count = 3;
+		auto n = shmRecv(sock, &welcome, sizeof(welcome), fds, count);
+		if (n == 0)
+			throw runtime_error("Connection closed by server");
+
+		if (n != sizeof(welcome) || welcome.magic != SHM_MAGIC) {
+			for (size_t i = 0; i < count; i++) ::close(fds[i]);
+			throw runtime_error("Invalid response from server");
+		}
+
+		if (welcome.status) {
+			for (size_t i = 0; i < count; i++) ::close(fds[i]);
+			welcome.error[sizeof(welcome.error) - 1] = '\0';
+			throw runtime_error(welcome.error);
+		}
+
+		if (count != 3) {
+			for (size_t i = 0; i < count; i++) ::close(fds[i]);
+			throw runtime_error("Server did not send shared memory descriptors");
+		}
+
+		memfd = fds[0];
+		request_bell = fds[1];
+		response_bell = fds[2];
+
+		struct stat st;
+		if (fstat(memfd, &st) < 0 || (size_t)st.st_size < sizeof(ShmArea))
+			throw runtime_error("Shared memory area too small");
+
+		auto mem = mmap(nullptr, sizeof(ShmArea), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+		if (mem == MAP_FAILED)
+			throw system_error(errno, system_category(), "Error while mapping shared memory");
+		area = static_cast<ShmArea*>(mem);
+
+		channel = welcome.channel;
+		uses_parity = welcome.uses_parity;
+		compand = static_cast<Compand>(welcome.compand);
+
+		quit = eventfd(0, EFD_CLOEXEC);
+		if (quit < 0)
+			throw system_error(errno, system_category(), "Error while creating eventfd");
+	} catch (...) {
+		close();
+		throw;
+	}
+
+	broken = false;
+	outstanding.clear();
+	runner = thread(&ShmDevice::receiver, this);
+}
+
+
+void ShmDevice::stop() {
+	if (runner.joinable()) {
+		uint64_t one = 1;
+		if (write(quit, &one, sizeof(one)) < 0)
+			cerr << "Error while stopping shared memory receiver" << endl;
+		runner.join();
+	}
+	close();
+}
+
+
+void ShmDevice::close() {
+	if (runner.joinable()) return;
+
+	if (area) munmap(area, sizeof(ShmArea));
+	area = nullptr;
+
+	for (auto fd : { &sock, &memfd, &request_bell, &response_bell, &quit }) {
+		if (*fd >= 0) ::close(*fd);
+		*fd = -1;
+	}
+}
+
+
+int ShmDevice::channels() const {
+	return 1;
+}
+
+
+TaggedCallback ShmDevice::setCallback(TaggedCallback recv) {
+	lock_guard<std::mutex> guard(mutex);
+	auto prev = this->recv;
+	this->recv = recv;
+	return prev;
+}
+
+
+void ShmDevice::push(int32_t tag, const string& packet) {
+	if (broken)
+		throw runtime_error("Shared memory session closed by server");
+
+	if (sent - received >= SHM_SLOTS)
+		throw runtime_error("Too many outstanding requests");
+
+	if (!area->requests.push(tag, packet.data(), packet.size()))
+		throw runtime_error("Shared memory request ring is full");
+	outstanding.insert(tag);
+	sent++;
+}
+
+
+void ShmDevice::send(int32_t tag, const string& packet) {
+	lock_guard<std::mutex> guard(sending);
+	push(tag, packet);
+	area->requests.notify(request_bell);
+}
+
+
+void ShmDevice::sendBatch(const vector<pair<int32_t, string>>& packets) {
+	lock_guard<std::mutex> guard(sending);
+	for (auto& packet : packets) push(packet.first, packet.second);
+	area->requests.notify(request_bell);
+}
+
+
+void ShmDevice::receiver() {
+	struct pollfd fds[3] = {
+		{ response_bell, POLLIN, 0 },
+		{ sock, POLLIN, 0 },
+		{ quit, POLLIN, 0 }
+	};
+
+	auto deliver = [this](int32_t tag, const char* data, size_t length) {
+		string packet(data, length);
+		{
+			lock_guard<std::mutex> guard(sending);
+			outstanding.erase(tag);
+		}
+		received++;
+
+		lock_guard<std::mutex> guard(mutex);
+		if (recv) recv(tag, packet, false);
+	};
+
+	try {
+		while (true) {
+			area->responses.drain(deliver);
+			if (!area->responses.sleep()) continue;
+
+			if (poll(fds, 3, -1) < 0) {
+				if (errno == EINTR) continue;
+				throw system_error(errno, system_category(), "Error in poll");
+			}
+			area->responses.wake();
+
+			if (fds[2].revents) return;
+
+			// The server never writes to the socket after the welcome
+			// message, any event means that the session has ended
+			if (fds[1].revents) {
+				area->responses.drain(deliver);
+				cerr << "Shared memory session closed by server" << endl;
+				break;
+			}
+
+			if (fds[0].revents) {
+				uint64_t value;
+				if (read(response_bell, &value, sizeof(value)) < 0 && errno != EAGAIN)
+					throw system_error(errno, system_category(), "Error while reading doorbell");
+			}
+		}
+	} catch (exception& e) {
+		cerr << "Shared memory receiver: " << e.what() << endl;
+	}
+	fail();
+}
+
+
+// The session is over. Complete the outstanding requests with an empty
+// response, no response is going to arrive for them anymore.
+void ShmDevice::fail() {
+	unordered_set<int32_t> failed;
+	{
+		lock_guard<std::mutex> guard(sending);
+		broken = true;
+		failed.swap(outstanding);
+	}
+
+	lock_guard<std::mutex> guard(mutex);
+	for (auto tag : failed)
+		if (recv) recv(tag, string(), false);
+}
@@ -0,0 +1,186 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+#include <functional>
+#include <mutex>
+#include <unordered_set>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "device.h"
+
+using namespace std;
+
+namespace ambe {
+
+	/**
+	 * Shared-memory transport for clients running on the same host as ambed
+	 *
+	 * A client connects to ambed's Unix domain socket (SOCK_SEQPACKET) and
+	 * sends a ShmHello message. The server leases a channel and replies with
+	 * a ShmWelcome message which carries three file descriptors: a memfd with
+	 * the shared mapping and two eventfds used as doorbells. The mapping holds
+	 * two single-producer single-consumer rings, one for requests and one for
+	 * responses. The socket stays open for the lifetime of the session;
+	 * closing it ends the session and releases the channel.
+	 */
+
+	static const uint32_t SHM_MAGIC = 0x414d4245;  // "AMBE"
+	static const uint32_t SHM_VERSION = 1;
+
+	// Number of slots in each ring (a power of two) and the size of a slot.
+	// A slot holds one packet, the largest SPEECH packet has 329 bytes.
+	static const uint32_t SHM_SLOTS = 256;
+	static const size_t SHM_SLOT_SIZE = 512;
+
+	struct ShmHello {
+		uint32_t magic;
+		uint32_t version;
+	};
+
+	struct ShmWelcome {
+		uint32_t magic;
+		int32_t status;        // 0 on success, the channel is valid then
+		int32_t channel;
+		uint8_t uses_parity;
+		uint8_t compand;       // Compand
+		char error[64];        // Reason for a failure
+	};
+
+	struct ShmSlot {
+		int32_t tag;
+		uint16_t length;
+		char data[SHM_SLOT_SIZE - sizeof(int32_t) - sizeof(uint16_t)];
+	};
+
+	static_assert(sizeof(ShmSlot) == SHM_SLOT_SIZE);
+
+	/**
+	 * A lock-free ring of packets in shared memory
+	 *
+	 * The producer fills the slot at tail and then advances tail, the
+	 * consumer processes the slot at head and then advances head. Both
+	 * indices grow monotonically and are reduced modulo the number of slots.
+	 * A consumer about to sleep sets the waiting flag and the producer only
+	 * rings the doorbell (eventfd) if the flag is set, so that busy rings
+	 * cost no system calls.
+	 *
+	 * The memory is shared with another process and must not be trusted:
+	 * the consumer validates the indices and slot lengths it reads.
+	 */
+	struct ShmRing {
+		alignas(64) atomic<uint32_t> head;
+		alignas(64) atomic<uint32_t> tail;
+		alignas(64) atomic<uint32_t> waiting;
+		ShmSlot slots[SHM_SLOTS];
+
+		// Append a packet. Returns false if the ring is full. Only one thread
+		// may produce at a time. Invoke notify once done pushing.
+		bool push(int32_t tag, const char* data, size_t length);
+		void notify(int doorbell);
+
+		// Invoke the callback for each packet in the ring and return the
+		// number of packets consumed. Throws runtime_error if the producer
+		// corrupted the ring. Only one thread may consume at a time.
+		size_t drain(const function<void (int32_t tag, const char* data, size_t length)>& callback);
+
+		// Prepare to sleep on the doorbell. Returns false if packets arrived
+		// in the meantime and the consumer must drain the ring again.
+		bool sleep();
+		void wake();
+	};
+
+	// The shared mapping created by the server for each session
+	struct ShmArea {
+		ShmRing requests;
+		ShmRing responses;
+	};
+
+	// Fill in the address of a Unix domain socket. Paths starting with @
+	// refer to the abstract namespace.
+	socklen_t shmAddress(const string& path, struct sockaddr_un& addr);
+
+	// Send and receive control messages with file descriptors attached. The
+	// receive function returns the length of the message and stores the
+	// number of received descriptors in count.
+	void shmSend(int sock, const void* msg, size_t length, const int* fds, size_t count);
+	size_t shmRecv(int sock, void* msg, size_t length, int* fds, size_t& count);
+
+
+	/**
+	 * A remote channel reached via shared memory
+	 *
+	 * Packets are written into the request ring and responses are read from
+	 * the response ring by a receiver thread that sleeps on the response
+	 * doorbell when the ring is empty. At most SHM_SLOTS requests can be
+	 * outstanding, send throws runtime_error beyond that. If the server ends
+	 * the session, all outstanding requests complete with an empty response
+	 * and later sends throw.
+	 */
+	class ShmDevice : public TaggingDevice {
+	public:
+		int channel = -1;
+
+		ShmDevice(const string& path);
+		virtual ~ShmDevice();
+
+		virtual void start() override;
+		virtual void stop() override;
+
+		virtual int channels() const override;
+
+		virtual TaggedCallback setCallback(TaggedCallback recv) override;
+		virtual void send(int32_t tag, const string& packet) override;
+		virtual void sendBatch(const vector<pair<int32_t, string>>& packets) override;
+
+	private:
+		void push(int32_t tag, const string& packet);
+		void receiver();
+		void fail();
+		void close();
+
+		string path;
+		int sock = -1;
+		int memfd = -1;
+		int request_bell = -1;
+		int response_bell = -1;
+		int quit = -1;
+		ShmArea* area = nullptr;
+
+		std::mutex mutex;
+		TaggedCallback recv;
+		thread runner;
+
+		// The request ring has a single producer, concurrent senders take
+		// turns. The lock also protects the tags of the outstanding requests
+		// and the broken flag.
+		std::mutex sending;
+		unordered_set<int32_t> outstanding;
+		bool broken = false;
+
+		// Requests sent and responses received, used to keep the number of
+		// outstanding requests within the capacity of the rings
+		atomic<uint32_t> sent{0};
+		atomic<uint32_t> received{0};
+	};
+}
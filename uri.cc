@@ -26,6 +26,21 @@ using namespace std;
 using namespace ambe;
 
 
+// Convert each address in a comma-separated list
+static string grpcAddresses(const string& list) {
+	string rv;
+	size_t start = 0;
+	while (start <= list.size()) {
+		auto end = list.find(',', start);
+		if (end == string::npos) end = list.size();
+		if (start) rv += ',';
+		rv += grpcAddress(list.substr(start, end - start));
+		start = end + 1;
+	}
+	return rv;
+}
+
+
 URI URI::parse(const string& uri) {
 	if (!uri.length())
 		throw runtime_error("URI string must not be empty");
@@ -40,7 +55,18 @@ URI URI::parse(const string& uri) {
 	auto type = scheme;
 	for_each(type.begin(), type.end(), [](char& c){ c = ::tolower(c); });
 
+	// unix:<path> is a shorthand for grpc:unix:<path>
 	if      (type == "usb")  return UsbURI(scheme, authority);
-	else if (type == "grpc") return GrpcURI(scheme, authority);
+	else if (type == "grpc") return GrpcURI(scheme, grpcAddresses(authority));
+	else if (type == "unix") return GrpcURI(scheme, grpcAddresses("unix:" + authority));
+	else if (type == "shm")  return ShmURI(scheme, authority);
 	else                     return URI(UriType::UNKNOWN, scheme, authority);
 }
+
+
+string ambe::grpcAddress(const string& address) {
+	static const string prefix = "unix:@";
+	if (address.compare(0, prefix.size(), prefix) == 0)
+		return "unix-abstract:" + address.substr(prefix.size());
+	return address;
+}
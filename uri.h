@@ -29,7 +29,8 @@ namespace ambe {
 	enum class UriType {
 		UNKNOWN,
 		USB,
-		GRPC
+		GRPC,
+		SHM
 	};
 
 
@@ -55,10 +56,26 @@ namespace ambe {
 	};
 
 
+	// Convert a listening or target address into a gRPC address. Addresses
+	// of the form unix:@<name> refer to abstract Unix domain sockets; all
+	// other addresses (host:port, unix:<path>) are used as they are.
+	string grpcAddress(const string& address);
+
+
+	// The authority is a gRPC target: host:port, unix:<path>, or
+	// unix-abstract:<name>, or a comma-separated list of targets
 	class GrpcURI : public URI {
 	public:
 		GrpcURI(const string& scheme, const string& authority) :
 			URI(UriType::GRPC, scheme, authority) {
 		};
 	};
+
+
+	class ShmURI : public URI {
+	public:
+		ShmURI(const string& scheme, const string& authority) :
+			URI(UriType::SHM, scheme, authority) {
+		};
+	};
 }
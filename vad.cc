@@ -0,0 +1,83 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "vad.h"
+#include <cmath>
+#include <byteswap.h>
+
+using namespace std;
+using namespace ambe;
+
+
+VoiceActivityDetector::VoiceActivityDetector(const VadParams& params) : params(params), hang(0) {
+}
+
+
+void VoiceActivityDetector::reset() {
+	hang = 0;
+}
+
+
+void VoiceActivityDetector::analyze(double& energy, double& zcr, const int16_t* samples, size_t count) {
+	if (count < 2) {
+		energy = -INFINITY;
+		zcr = 0;
+		return;
+	}
+
+	// Both loops are free of branches and loop-carried dependencies other
+	// than the reductions, which lets GCC turn them into SIMD code at -O3.
+	int64_t sum = 0;
+	int32_t crossings = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		int32_t v = (int16_t)bswap_16(samples[i]);
+		sum += v * v;
+	}
+
+	for (size_t i = 1; i < count; i++) {
+		int16_t a = bswap_16(samples[i - 1]);
+		int16_t b = bswap_16(samples[i]);
+		crossings += (a ^ b) < 0;
+	}
+
+	double mean = (double)sum / count;
+	energy = mean > 0 ? 10 * log10(mean / (32768.0 * 32768.0)) : -INFINITY;
+	zcr = (double)crossings / (count - 1);
+}
+
+
+bool VoiceActivityDetector::active(const int16_t* samples, size_t count) {
+	double energy, zcr;
+	analyze(energy, zcr, samples, count);
+
+	bool loud = energy > params.threshold;
+	bool unvoiced = energy > params.threshold - params.unvoiced_margin && zcr > params.zcr_threshold;
+
+	if (loud || unvoiced) {
+		hang = params.hangover;
+		return true;
+	}
+
+	if (hang > 0) {
+		hang--;
+		return true;
+	}
+	return false;
+}
@@ -0,0 +1,74 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace ambe {
+
+	struct VadParams {
+		// Frames with energy above this level (in dBFS) are always speech
+		double threshold = -45;
+
+		// Frames within this many dB below the threshold are speech if their
+		// zero-crossing rate is high, i.e., they look like unvoiced speech
+		// (fricatives) rather than background noise.
+		double unvoiced_margin = 10;
+		double zcr_threshold = 0.25;
+
+		// The number of frames that are still treated as speech after the
+		// last speech frame. This keeps word endings and short pauses intact.
+		unsigned int hangover = 10;
+	};
+
+
+	/**
+	 * Energy and zero-crossing based voice activity detector
+	 *
+	 * The detector classifies 20 ms audio frames into speech and silence. A
+	 * frame that looks like speech switches the detector into the active
+	 * state immediately, so speech onsets are never suppressed. The detector
+	 * only becomes inactive after "hangover" consecutive silent frames.
+	 *
+	 * The per-frame statistics are computed in two short loops, one for the
+	 * energy and one for the zero crossings, written so that the compiler
+	 * can vectorize them.
+	 */
+	class VoiceActivityDetector {
+	public:
+		VoiceActivityDetector(const VadParams& params=VadParams());
+
+		// Classify a frame of 16-bit big endian samples. Returns true if the
+		// frame should be treated as speech.
+		bool active(const int16_t* samples, size_t count);
+
+		void reset();
+
+		// Compute the mean energy (in dBFS) and the zero-crossing rate (the
+		// fraction of adjacent sample pairs with opposite sign) of a frame of
+		// big endian samples.
+		static void analyze(double& energy, double& zcr, const int16_t* samples, size_t count);
+
+	private:
+		VadParams params;
+		unsigned int hang;
+	};
+}
@@ -0,0 +1,182 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "wire.h"
+#include <cstring>
+#include <vector>
+#include <grpcpp/support/proto_buffer_reader.h>
+
+using namespace std;
+using namespace ambe;
+
+
+// Protocol Buffers wire format keys (field number and wire type) used in
+// rpc::Packet and rpc::PacketBatch
+static const uint8_t TAG_KEY       = (1 << 3) | 0;
+static const uint8_t BATCH_KEY     = (3 << 3) | 2;
+static const uint8_t BIT_COUNT_KEY = (6 << 3) | 0;
+static const uint8_t SEQ_KEY       = (7 << 3) | 0;
+static const uint8_t CANCEL_KEY    = (8 << 3) | 0;
+static const uint8_t BUSY_KEY      = (9 << 3) | 0;
+static const uint8_t CONCEALED_KEY = (10 << 3) | 0;
+static const uint8_t ELEMENT_KEY   = (1 << 3) | 2;
+
+
+static size_t varintSize(uint64_t value) {
+	size_t n = 1;
+	for (; value >= 0x80; value >>= 7) n++;
+	return n;
+}
+
+
+static char* putVarint(char* dst, uint64_t value) {
+	for (; value >= 0x80; value >>= 7)
+		*dst++ = (char)(value | 0x80);
+	*dst++ = (char)value;
+	return dst;
+}
+
+
+WireMessage::WireMessage(int32_t tag, Field field, const void* data, size_t length, uint32_t bit_count, uint32_t seq, bool concealed) :
+	WireMessage(tag, field, length, bit_count, seq, concealed) {
+	if (length) memcpy(payload(), data, length);
+}
+
+
+WireMessage::WireMessage(int32_t tag, Field field, size_t length, uint32_t bit_count, uint32_t seq, bool concealed) :
+	WireMessage(concealed ? CONCEALED_KEY : 0, tag, field, length, bit_count, seq) {
+}
+
+
+WireMessage WireMessage::cancel(int32_t tag) {
+	return WireMessage(CANCEL_KEY, tag, DATA, 0, 0, 0);
+}
+
+
+WireMessage WireMessage::busy(int32_t tag) {
+	return WireMessage(BUSY_KEY, tag, DATA, 0, 0, 0);
+}
+
+
+WireMessage::WireMessage(uint8_t flag, int32_t tag, Field field, size_t length, uint32_t bit_count, uint32_t seq) {
+	// Negative int32 values are sign-extended to 64 bits on the wire
+	uint64_t tag_value = (uint64_t)(int64_t)tag;
+
+	size_t message = 1 + varintSize(length) + length;
+	if (tag) message += 1 + varintSize(tag_value);
+	if (bit_count) message += 1 + varintSize(bit_count);
+	if (seq) message += 1 + varintSize(seq);
+	if (flag) message += 2;
+
+	offset = 1 + varintSize(message);
+	size = offset + message;
+	buffer.reset(new char[size]);
+
+	auto p = buffer.get();
+	*p++ = ELEMENT_KEY;
+	p = putVarint(p, message);
+
+	if (tag) {
+		*p++ = TAG_KEY;
+		p = putVarint(p, tag_value);
+	}
+
+	*p++ = (char)((field << 3) | 2);
+	p = putVarint(p, length);
+	start = p - buffer.get();
+	p += length;
+
+	if (bit_count) {
+		*p++ = BIT_COUNT_KEY;
+		p = putVarint(p, bit_count);
+	}
+
+	if (seq) {
+		*p++ = SEQ_KEY;
+		p = putVarint(p, seq);
+	}
+
+	if (flag) {
+		*p++ = flag;
+		*p++ = 1;
+	}
+}
+
+
+char* WireMessage::payload() {
+	return buffer.get() + start;
+}
+
+
+static void release(void* buffer) {
+	delete[] static_cast<char*>(buffer);
+}
+
+
+grpc::ByteBuffer WireMessage::serialize(queue<WireMessage>& messages, size_t count) {
+	count = min(count, messages.size());
+	if (!count) return grpc::ByteBuffer();
+
+	if (count == 1) {
+		auto& msg = messages.front();
+		auto buf = msg.buffer.release();
+		grpc::Slice slice(buf + msg.offset, msg.size - msg.offset, release, buf);
+		messages.pop();
+		return grpc::ByteBuffer(&slice, 1);
+	}
+
+	// A batch message consists of the batch field header followed by the
+	// messages which already carry the framing of PacketBatch elements
+	vector<grpc::Slice> slices;
+	slices.reserve(count + 1);
+	slices.emplace_back();
+
+	size_t length = 0;
+	for (size_t i = 0; i < count; i++, messages.pop()) {
+		auto& msg = messages.front();
+		auto buf = msg.buffer.release();
+		length += msg.size;
+		slices.emplace_back(buf, msg.size, release, buf);
+	}
+
+	char header[16];
+	header[0] = BATCH_KEY;
+	auto end = putVarint(header + 1, length);
+	slices[0] = grpc::Slice(header, end - header);
+
+	return grpc::ByteBuffer(slices.data(), slices.size());
+}
+
+
+WireParser::WireParser() : arena(block, sizeof(block)) {
+}
+
+
+rpc::Packet* WireParser::parse(grpc::ByteBuffer& buffer) {
+	arena.Reset();
+	auto msg = google::protobuf::Arena::CreateMessage<rpc::Packet>(&arena);
+
+	bool ok;
+	{
+		grpc::ProtoBufferReader reader(&buffer);
+		ok = msg->ParseFromZeroCopyStream(&reader);
+	}
+	buffer.Clear();
+	return ok ? msg : nullptr;
+}
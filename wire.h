@@ -0,0 +1,106 @@
+/*
+ * A library for working with DVSI's AMBE vocoder chips
+ *
+ * Copyright (C) 2019-2020 Internet Real-Time Lab, Columbia University
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+#include <string>
+#include <queue>
+#include <grpc++/grpc++.h>
+#include <google/protobuf/arena.h>
+#include "ambe.pb.h"
+
+using namespace std;
+
+namespace ambe {
+
+	/**
+	 * A serialized rpc::Packet message
+	 *
+	 * When sending a generated message, gRPC serializes it into a new
+	 * buffer, i.e., the payload of each packet is copied once into the
+	 * message and once more into the serialized form. A WireMessage is
+	 * already in the serialized form: the payload is written into the
+	 * message's buffer exactly once and the buffer is handed to gRPC as a
+	 * slice without copying.
+	 *
+	 * The buffer starts with the framing of a PacketBatch element, so that
+	 * several messages can be sent in one batch message without being
+	 * re-encoded.
+	 */
+	class WireMessage {
+	public:
+		// The fields of rpc::Packet that carry a payload
+		enum Field { DATA = 2, SAMPLES = 4, BITS = 5 };
+
+		// Create a message with a copy of the given payload. A non-zero seq
+		// is sent in the seq field, concealed marks the response to a frame
+		// concealed by the chip (jitter buffer sessions).
+		WireMessage(int32_t tag, Field field, const void* data, size_t length, uint32_t bit_count=0, uint32_t seq=0, bool concealed=false);
+
+		// Create a message with an uninitialized payload of the given length
+		// which the caller fills in via payload()
+		WireMessage(int32_t tag, Field field, size_t length, uint32_t bit_count=0, uint32_t seq=0, bool concealed=false);
+
+		// Create a message that cancels the request with the given tag
+		static WireMessage cancel(int32_t tag);
+
+		// Create a message that rejects the request with the given tag
+		// because the client has exceeded its quota
+		static WireMessage busy(int32_t tag);
+
+		char* payload();
+
+		// Remove up to count messages from the front of the queue and return
+		// them serialized in a buffer for a stream's Write method. More than
+		// one message is sent as a batch.
+		static grpc::ByteBuffer serialize(queue<WireMessage>& messages, size_t count);
+
+	private:
+		// A non-zero flag is the key of a boolean field set to true
+		WireMessage(uint8_t flag, int32_t tag, Field field, size_t length, uint32_t bit_count, uint32_t seq);
+
+		unique_ptr<char[]> buffer;
+		size_t size;     // Length of the buffer
+		size_t offset;   // Start of the message (after the batch framing)
+		size_t start;    // Start of the payload
+	};
+
+
+	/**
+	 * Parses rpc::Packet messages received as raw buffers
+	 *
+	 * Messages are allocated from an arena owned by the parser, so that a
+	 * message with a batch of packets costs a handful of allocations
+	 * instead of several per packet. The arena is recycled for each message:
+	 * a message returned by parse() is only valid until the next call.
+	 */
+	class WireParser {
+	public:
+		WireParser();
+
+		// Returns nullptr if the buffer does not hold a valid message. The
+		// buffer is cleared.
+		rpc::Packet* parse(grpc::ByteBuffer& buffer);
+
+	private:
+		char block[4096];
+		google::protobuf::Arena arena;
+	};
+}